@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "minivtun.h"
+
+/**
+ * Loopback benchmark: a server and a client, each in a child process,
+ * talk over UDP on 127.0.0.1 while their TUN devices are replaced by
+ * socket pairs. The parent writes IPv4 packets into the client side and
+ * times them out of the server side, so the whole datapath is measured
+ * without root privileges or a real TUN device.
+ */
+
+#define BENCH_PASSWORD  "minivtun-bench"
+
+/* Packets in flight, enough to fill the batches on both sides */
+#define BENCH_WINDOW  (NM_BATCH_SIZE * 2)
+
+/* Silence after which the packets in flight are counted as lost (ms) */
+#define BENCH_LOSS_TIMEO  200
+
+#define BENCH_MIN_SIZE  28
+#define BENCH_MAX_SIZE  8000
+
+struct bench_result {
+	unsigned long sent;
+	unsigned long received;
+	double seconds;
+	__u64 p50_ns;
+	__u64 p99_ns;
+};
+
+static __u64 bench_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* A socket pair standing in for a TUN device, which keeps packet boundaries */
+static int fake_tun_pair(int fds[2])
+{
+	int bufsz = 1 << 20, i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0)
+		return -1;
+	for (i = 0; i < 2; i++) {
+		setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+		setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+		set_nonblock(fds[i]);
+	}
+	return 0;
+}
+
+/* Find a free UDP port on the loopback for the server */
+static int pick_loopback_port(void)
+{
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	int fd, port = -1;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return -1;
+	memset(&sa, 0x0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0 &&
+		getsockname(fd, (struct sockaddr *)&sa, &salen) == 0)
+		port = ntohs(sa.sin_port);
+	close(fd);
+	return port;
+}
+
+/* Run a server or client with a single worker on 'tunfd', never returns */
+static void bench_child(bool is_server, int tunfd, const char *addr_pair)
+{
+	struct worker *w;
+	int devnull;
+
+	/* Keep the banners out of the report */
+	if ((devnull = open("/dev/null", O_WRONLY)) >= 0) {
+		dup2(devnull, STDOUT_FILENO);
+		close(devnull);
+	}
+
+	state.workers = calloc(1, sizeof(struct worker));
+	if ((w = state.workers) == NULL)
+		exit(1);
+	w->sockfd = -1;
+	w->tunfd = tunfd;
+	if (enabled_encryption()) {
+		w->crypto_ctx = crypto_init(config.crypto_type, config.crypto_key,
+				offsetof(struct minivtun_msg, hdr.auth_key),
+				sizeof(((struct minivtun_msg *)0)->hdr.auth_key));
+		if (w->crypto_ctx == NULL)
+			exit(1);
+	}
+
+	if (is_server) {
+		run_server(addr_pair);
+	} else {
+		run_client(&addr_pair, 1);
+	}
+	exit(1);
+}
+
+static pid_t bench_spawn(bool is_server, int tunfd, int other_fds[3],
+		const char *addr_pair)
+{
+	pid_t pid;
+	int i;
+
+	if ((pid = fork()) == 0) {
+		for (i = 0; i < 3; i++)
+			close(other_fds[i]);
+		bench_child(is_server, tunfd, addr_pair);
+	}
+	return pid;
+}
+
+/* Build an IPv4 packet from 10.199.0.2 to 10.199.0.1 with a timestamp */
+static size_t build_packet(char *buf, size_t size, __u64 ts)
+{
+	struct tun_pi *pi = (void *)buf;
+	unsigned char *ip = (void *)(pi + 1);
+
+	pi->flags = 0;
+	pi->proto = htons(ETH_P_IP);
+	osx_ether_to_af(&pi->proto);
+
+	memset(ip, 0x0, 20);
+	ip[0] = 0x45;
+	ip[2] = size >> 8;
+	ip[3] = size & 0xff;
+	ip[8] = 64;
+	ip[9] = 253; /* experimental protocol */
+	ip[12] = 10; ip[13] = 199; ip[14] = 0; ip[15] = 2;
+	ip[16] = 10; ip[17] = 199; ip[18] = 0; ip[19] = 1;
+	memcpy(ip + 20, &ts, sizeof(ts));
+
+	return sizeof(*pi) + size;
+}
+
+/* Push 'count' packets of 'size' bytes through the tunnel */
+static int bench_transfer(int cli_tun, int srv_tun, size_t size, unsigned long count,
+		struct bench_result *res)
+{
+	char *txbuf, *rxbuf;
+	size_t txlen;
+	__u64 *lat, t_start, t_last;
+	unsigned long inflight = 0, nr_lat = 0;
+	struct pollfd pfd = { .fd = srv_tun, .events = POLLIN };
+	int rc;
+
+	memset(res, 0x0, sizeof(*res));
+	txbuf = malloc(sizeof(struct tun_pi) + BENCH_MAX_SIZE);
+	rxbuf = malloc(NM_PI_BUFFER_SIZE);
+	lat = malloc(sizeof(__u64) * count);
+	if (!txbuf || !rxbuf || !lat) {
+		free(txbuf);
+		free(rxbuf);
+		free(lat);
+		return -1;
+	}
+	memset(txbuf, 0x0, sizeof(struct tun_pi) + BENCH_MAX_SIZE);
+
+	/* Wait for the client to get through before the clock starts */
+	for (rc = 0; rc < 50; rc++) {
+		txlen = build_packet(txbuf, size, bench_clock_ns());
+		(void)write(cli_tun, txbuf, txlen);
+		if (poll(&pfd, 1, 100) > 0) {
+			while (read(srv_tun, rxbuf, NM_PI_BUFFER_SIZE) > 0)
+				;
+			break;
+		}
+	}
+	if (rc == 50) {
+		free(txbuf);
+		free(rxbuf);
+		free(lat);
+		return -1;
+	}
+
+	t_start = t_last = bench_clock_ns();
+	while (res->sent < count || inflight) {
+		while (res->sent < count && inflight < BENCH_WINDOW) {
+			txlen = build_packet(txbuf, size, bench_clock_ns());
+			if (write(cli_tun, txbuf, txlen) < 0)
+				break;
+			res->sent++;
+			inflight++;
+		}
+
+		if ((rc = poll(&pfd, 1, BENCH_LOSS_TIMEO)) == 0) {
+			/* Whatever is still in flight is not coming */
+			inflight = 0;
+			continue;
+		}
+		while ((rc = read(srv_tun, rxbuf, NM_PI_BUFFER_SIZE)) > 0) {
+			__u64 ts, now = bench_clock_ns();
+			if ((size_t)rc < sizeof(struct tun_pi) + 20 + sizeof(ts))
+				continue;
+			memcpy(&ts, rxbuf + sizeof(struct tun_pi) + 20, sizeof(ts));
+			if (ts < t_start)
+				continue; /* left over from the warm-up */
+			if (nr_lat < count)
+				lat[nr_lat++] = now - ts;
+			res->received++;
+			t_last = now;
+			if (inflight)
+				inflight--;
+		}
+	}
+
+	res->seconds = (double)(t_last - t_start) / 1e9;
+	if (nr_lat) {
+		qsort(lat, nr_lat, sizeof(__u64), cmp_u64);
+		res->p50_ns = lat[nr_lat / 2];
+		res->p99_ns = lat[nr_lat * 99 / 100];
+	}
+
+	free(txbuf);
+	free(rxbuf);
+	free(lat);
+	return 0;
+}
+
+/* Set up a server and client pair with cipher 'name' and measure each size */
+static int bench_cipher(const char *name, const unsigned *sizes, unsigned nr_sizes,
+		unsigned long count)
+{
+	struct bench_result res;
+	char addr_pair[32];
+	int srv_fds[2], cli_fds[2], others[3], port, rc = 0;
+	pid_t srv_pid, cli_pid;
+	unsigned i;
+
+	if (name) {
+		struct crypto_context *c;
+		config.crypto_passwd = BENCH_PASSWORD;
+		fill_with_string_md5sum(config.crypto_passwd, config.crypto_key, CRYPTO_MAX_KEY_SIZE);
+		config.crypto_type = get_crypto_type(name);
+		if (!config.crypto_type || !(c = crypto_init(config.crypto_type, config.crypto_key,
+				offsetof(struct minivtun_msg, hdr.auth_key),
+				sizeof(((struct minivtun_msg *)0)->hdr.auth_key)))) {
+			printf("%-20s not available\n", name);
+			return 0;
+		}
+		crypto_free(c);
+	} else {
+		config.crypto_passwd = "";
+		memset(config.crypto_key, 0x0, CRYPTO_MAX_KEY_SIZE);
+		name = "none";
+	}
+
+	if ((port = pick_loopback_port()) < 0 || fake_tun_pair(srv_fds) < 0) {
+		fprintf(stderr, "*** Cannot set up the benchmark: %s.\n", strerror(errno));
+		return -1;
+	}
+	if (fake_tun_pair(cli_fds) < 0) {
+		fprintf(stderr, "*** Cannot set up the benchmark: %s.\n", strerror(errno));
+		close(srv_fds[0]);
+		close(srv_fds[1]);
+		return -1;
+	}
+	sprintf(addr_pair, "127.0.0.1:%d", port);
+
+	others[0] = srv_fds[0];
+	others[1] = cli_fds[0];
+	others[2] = cli_fds[1];
+	srv_pid = bench_spawn(true, srv_fds[1], others, addr_pair);
+	/* Give the server a moment to bind */
+	usleep(100000);
+	others[2] = srv_fds[1];
+	cli_pid = bench_spawn(false, cli_fds[1], others, addr_pair);
+	close(srv_fds[1]);
+	close(cli_fds[1]);
+
+	for (i = 0; i < nr_sizes; i++) {
+		if (bench_transfer(cli_fds[0], srv_fds[0], sizes[i], count, &res) < 0) {
+			printf("%-20s %5u  no packet got through\n", name, sizes[i]);
+			rc = -1;
+			break;
+		}
+		printf("%-20s %5u %10lu %8lu %11.0f %8.3f %9.1f %9.1f\n", name, sizes[i],
+				res.sent, res.sent - res.received,
+				res.seconds > 0 ? res.received / res.seconds : 0,
+				res.seconds > 0 ? res.received * sizes[i] * 8 / res.seconds / 1e9 : 0,
+				res.p50_ns / 1e3, res.p99_ns / 1e3);
+		fflush(stdout);
+	}
+
+	kill(srv_pid, SIGKILL);
+	kill(cli_pid, SIGKILL);
+	waitpid(srv_pid, NULL, 0);
+	waitpid(cli_pid, NULL, 0);
+	close(srv_fds[0]);
+	close(cli_fds[0]);
+
+	return rc;
+}
+
+/**
+ * Benchmark the datapath with packets of the comma separated 'sizes',
+ * plain and with every cipher. Returns -1 if any of them failed.
+ */
+int run_bench(const char *sizes, unsigned long count)
+{
+	unsigned sz[16], nr_sizes = 0, i;
+	const char *sp = sizes;
+	char *ep;
+	int rc = 0;
+
+	while (*sp && nr_sizes < countof(sz)) {
+		unsigned long v = strtoul(sp, &ep, 10);
+		if (ep == sp || (*ep && *ep != ',') || v < BENCH_MIN_SIZE || v > BENCH_MAX_SIZE) {
+			fprintf(stderr, "*** Acceptable benchmark packet sizes: %u~%u.\n",
+					BENCH_MIN_SIZE, BENCH_MAX_SIZE);
+			return -1;
+		}
+		sz[nr_sizes++] = v;
+		sp = *ep ? ep + 1 : ep;
+	}
+	if (nr_sizes == 0 || count == 0) {
+		fprintf(stderr, "*** No packets to benchmark with.\n");
+		return -1;
+	}
+
+	strcpy(config.ifname, "bench");
+	config.nr_queues = 1;
+	config.reuseport = REUSEPORT_NONE;
+	config.tap_mode = false;
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-20s %5s %10s %8s %11s %8s %9s %9s\n", "cipher", "size", "packets",
+			"lost", "packets/s", "Gbit/s", "p50(us)", "p99(us)");
+	if (bench_cipher(NULL, sz, nr_sizes, count) < 0)
+		rc = -1;
+	for (i = 0; cipher_pairs[i].name; i++) {
+		if (bench_cipher(cipher_pairs[i].name, sz, nr_sizes, count) < 0)
+			rc = -1;
+	}
+
+	return rc;
+}
@@ -16,8 +16,61 @@
 #include <sys/ioctl.h>
 #include <sys/uio.h>
 
+#include "event.h"
 #include "minivtun.h"
 
+static struct timeval startup_time;
+
+/* Seconds between attempts to reopen the socket of a path */
+#define PATH_RETRY_INTERVAL  5
+
+/* Seconds a failed path is still read from before its socket is replaced */
+#define PATH_DRAIN_INTERVAL  2
+
+/* Unanswered echoes after which a path takes no new packets */
+#define PATH_MAX_ECHO_MISSES  2
+
+/* Milliseconds between echoes over each of several paths, whatever '-K' */
+#define PATH_PROBE_INTERVAL_MS  250
+
+/* Datagrams from the server in an assess interval to tell its loss rate by */
+#define PATH_MIN_LOSS_SAMPLES  100
+
+/**
+ * Flows are scheduled over the paths by a table of contiguous ranges,
+ * each sized by the weight of its path. The first worker fills the idle
+ * table and flips the index, a worker still reading the old one only
+ * sends a packet or two over another valid path.
+ */
+#define PATH_TABLE_SIZE  256
+
+static __u8 path_tables[2][PATH_TABLE_SIZE];
+static unsigned path_table_idx;
+
+/* Path of each datagram queued on a worker's send ring, with several paths */
+static __u8 (*tx_path_tags)[NM_BATCH_SIZE];
+
+/* How a worker receives from a path, and which socket it follows */
+struct path_source {
+	struct event_source src; /* the first path uses the worker's 'sock_source' */
+	struct worker *w;
+	unsigned path;
+	unsigned sock_gen;
+};
+
+static struct path_source *path_sources; /* 'nr_paths' for each worker */
+
+/* Error correction, with '--fec': an encoder for each worker and path, and one decoder */
+static struct fec_encoder **fec_tx;
+static struct fec_decoder *fec_rx;
+
+/**
+ * Serializes the link and health state between the workers receiving
+ * from the server and the first one, which runs the periodic checks.
+ * It is not taken on the data path once the link is up.
+ */
+static pthread_mutex_t ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void handle_link_up(void)
 {
 	struct vt_route *rt;
@@ -50,164 +103,420 @@ static void handle_link_down(void)
 	ip_link_set_updown(config.ifname, false);
 }
 
-static int network_receiving(void)
+/* Whether another path than 'path' can carry the link */
+static bool other_path_up(const struct client_path *path)
+{
+	unsigned i;
+
+	for (i = 0; i < state.nr_paths; i++) {
+		const struct client_path *p = &state.paths[i];
+		if (p != path && p->sockfd >= 0 && !p->need_reconnect && p->is_healthy)
+			return true;
+	}
+	return false;
+}
+
+/* Write the packet of an IPDATA message of 'out_dlen' bytes to the TUN queue */
+static void handle_ipdata(struct worker *w, struct minivtun_msg *nmsg, size_t out_dlen)
 {
-	char read_buffer[NM_PI_BUFFER_SIZE], crypt_buffer[NM_PI_BUFFER_SIZE];
-	struct minivtun_msg *nmsg;
 	struct tun_pi pi;
-	void *out_data;
-	size_t ip_dlen, out_dlen;
-	struct sockaddr_inx real_peer;
-	socklen_t real_peer_alen;
-	struct iovec iov[2];
-	struct timeval __current;
-	int rc;
+	size_t ip_dlen;
 
-	gettimeofday(&__current, NULL);
+	if (config.tap_mode) {
+		/* No ethernet packet is shorter than 12 bytes. */
+		if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 12) {
+			stats_drop(&w->stats, DROP_SHORT_PACKET);
+			return;
+		}
+		ip_dlen = out_dlen - MINIVTUN_MSG_IPDATA_OFFSET;
+		nmsg->ipdata.proto = 0;
+	} else {
+		if (nmsg->ipdata.proto == htons(ETH_P_IP)) {
+			/* No valid IP packet is shorter than 20 bytes. */
+			if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 20) {
+				stats_drop(&w->stats, DROP_SHORT_PACKET);
+				return;
+			}
+		} else if (nmsg->ipdata.proto == htons(ETH_P_IPV6)) {
+			if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 40) {
+				stats_drop(&w->stats, DROP_SHORT_PACKET);
+				return;
+			}
+		} else {
+			syslog(LOG_WARNING, "*** Invalid protocol: 0x%x.", ntohs(nmsg->ipdata.proto));
+			stats_drop(&w->stats, DROP_BAD_PROTO);
+			return;
+		}
 
-	real_peer_alen = sizeof(real_peer);
-	rc = recvfrom(state.sockfd, &read_buffer, NM_PI_BUFFER_SIZE, 0,
-			(struct sockaddr *)&real_peer, &real_peer_alen);
-	if (rc <= 0)
-		return -1;
+		ip_dlen = ntohs(nmsg->ipdata.ip_dlen);
+		/* Drop incomplete IP packets. */
+		if (out_dlen - MINIVTUN_MSG_IPDATA_OFFSET < ip_dlen) {
+			stats_drop(&w->stats, DROP_TRUNCATED);
+			return;
+		}
+	}
 
-	out_data = crypt_buffer;
-	out_dlen = (size_t)rc;
-	netmsg_to_local(read_buffer, &out_data, &out_dlen);
-	nmsg = out_data;
+	pi.flags = 0;
+	pi.proto = nmsg->ipdata.proto;
+	osx_ether_to_af(&pi.proto);
+	if (tun_write_frame(w, &pi, (char *)nmsg + MINIVTUN_MSG_IPDATA_OFFSET,
+			ip_dlen) < 0) {
+		stats_drop(&w->stats, DROP_TUN_WRITE);
+		return;
+	}
+	stats_add(&w->stats.tun_tx_packets, 1);
+	stats_add(&w->stats.tun_tx_bytes, ip_dlen);
+}
 
-	if (out_dlen < MINIVTUN_MSG_BASIC_HLEN)
-		return 0;
+/* FEC_DATA and FEC_PARITY messages, with the data shards they complete */
+static void handle_fec_netmsg(struct worker *w, struct minivtun_msg *nmsg, size_t dlen)
+{
+	struct fec_recovered rec;
+	struct fec_trailer tr;
+	unsigned i;
+	int rc;
 
-	/* Verify password. */
-	if (memcmp(nmsg->hdr.auth_key, config.crypto_key,
-		sizeof(nmsg->hdr.auth_key)) != 0)
-		return 0;
+	if (fec_rx == NULL) {
+		stats_drop(&w->stats, DROP_BAD_OPCODE);
+		return;
+	}
+	if ((rc = netmsg_fec_decode(w, fec_rx, nmsg, dlen, &tr, &rec)) > 0)
+		handle_ipdata(w, nmsg, rc);
+	for (i = 0; i < rec.nr; i++)
+		handle_ipdata(w, (struct minivtun_msg *)rec.bufs[i], rec.lens[i]);
+}
 
-	state.last_recv = __current;
+static void handle_netmsg(struct worker *w, struct client_path *path,
+		void *data, size_t dlen, const struct timeval *now)
+{
+	struct minivtun_msg *nmsg;
+	size_t out_dlen;
+	struct netmsg_seq ns;
+
+	out_dlen = dlen;
+	if ((nmsg = netmsg_to_local(w, data, &out_dlen, &ns)) == NULL)
+		return;
+
+	/**
+	 * The server numbers all it sends over a path in turn, by 16 bits for
+	 * the loss counters alone. Once it numbers them in full, those it did
+	 * not are replayed.
+	 */
+	if (!config.replay_window) {
+		seq_track_mark(&path->track_head, &path->tracks[w->id], ntohs(nmsg->hdr.seq));
+	} else if ((ns.seq || __atomic_load_n(&path->replay.top, __ATOMIC_RELAXED)) &&
+		!replay_window_check(&path->replay, ns.seq, ns.stamp)) {
+		stats_drop(&w->stats, DROP_REPLAYED);
+		return;
+	}
 
-	if (!state.health_based_link_up) {
+	if (!state.health_based_link_up && !state.is_link_ok) {
+		pthread_mutex_lock(&ctl_lock);
 		/* Call link-up scripts */
-		if (!state.is_link_ok) {
+		if (!state.health_based_link_up && !state.is_link_ok) {
 			if (config.dynamic_link)
 				handle_link_up();
 			state.is_link_ok = true;
 		}
+		pthread_mutex_unlock(&ctl_lock);
 	}
 
 	switch (nmsg->hdr.opcode) {
 	case MINIVTUN_MSG_IPDATA:
-		if (config.tap_mode) {
-			/* No ethernet packet is shorter than 12 bytes. */
-			if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 12)
-				return 0;
-			ip_dlen = out_dlen - MINIVTUN_MSG_IPDATA_OFFSET;
-			nmsg->ipdata.proto = 0;
-		} else {
-			if (nmsg->ipdata.proto == htons(ETH_P_IP)) {
-				/* No valid IP packet is shorter than 20 bytes. */
-				if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 20)
-					return 0;
-			} else if (nmsg->ipdata.proto == htons(ETH_P_IPV6)) {
-				if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 40)
-					return 0;
-			} else {
-				syslog(LOG_WARNING, "*** Invalid protocol: 0x%x.", ntohs(nmsg->ipdata.proto));
-				return 0;
-			}
-
-			ip_dlen = ntohs(nmsg->ipdata.ip_dlen);
-			/* Drop incomplete IP packets. */
-			if (out_dlen - MINIVTUN_MSG_IPDATA_OFFSET < ip_dlen)
-				return 0;
-		}
-
-		pi.flags = 0;
-		pi.proto = nmsg->ipdata.proto;
-		osx_ether_to_af(&pi.proto);
-		iov[0].iov_base = &pi;
-		iov[0].iov_len = sizeof(pi);
-		iov[1].iov_base = (char *)nmsg + MINIVTUN_MSG_IPDATA_OFFSET;
-		iov[1].iov_len = ip_dlen;
-		rc = writev(state.tunfd, iov, 2);
+		handle_ipdata(w, nmsg, out_dlen);
+		break;
+	case MINIVTUN_MSG_FEC_DATA:
+	case MINIVTUN_MSG_FEC_PARITY:
+		handle_fec_netmsg(w, nmsg, out_dlen);
 		break;
 	case MINIVTUN_MSG_ECHO_ACK:
-		if (state.has_pending_echo && nmsg->echo.id == state.pending_echo_id) {
-			struct stats_data *st = &state.stats_buckets[state.current_bucket];
+		pthread_mutex_lock(&ctl_lock);
+		if (path->has_pending_echo && nmsg->echo.id == path->pending_echo_id) {
+			struct stats_data *st = &path->stats_buckets[path->current_bucket];
 			st->total_echo_rcvd++;
-			st->total_rtt_ms += __sub_timeval_ms(&__current, &state.last_echo_sent);
-			state.last_echo_recv = __current;
-			state.has_pending_echo = false;
+			st->total_rtt_ms += __sub_timeval_ms(now, &path->last_echo_sent);
+			path->last_echo_recv = *now;
+			path->has_pending_echo = false;
+			path->echo_misses = 0;
 		}
+		pthread_mutex_unlock(&ctl_lock);
+		break;
+	default:
+		stats_drop(&w->stats, DROP_BAD_OPCODE);
 		break;
 	}
+}
 
-	return 0;
+/* Handle 'nr' datagrams received from 'path' into the worker's ring */
+static int network_handle_batch(struct worker *w, struct client_path *path,
+		int nr, const struct timeval *now)
+{
+	struct msg_ring *ring = &w->rx_ring;
+	unsigned packets = 0;
+	int i;
+
+	if (nr <= 0)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		char *data = ring->iovs[i].iov_base;
+		size_t left = ring->msgs[i].msg_len;
+		size_t seg = msg_ring_segment_size(ring, i);
+
+		/* Split a GRO train back into its datagrams. */
+		do {
+			size_t len = left < seg ? left : seg;
+			stats_add(&w->stats.net_rx_packets, 1);
+			stats_add(&w->stats.net_rx_bytes, len);
+			handle_netmsg(w, path, data, len, now);
+			data += len;
+			left -= len;
+			packets++;
+		} while (left);
+	}
+	stats_add_shared(&path->rx_packets, packets);
+
+	if (tun_flush_frames(w) < 0)
+		stats_drop(&w->stats, DROP_TUN_WRITE);
+
+	/* A short batch means the socket queue has been drained. */
+	return nr < ring->size ? -1 : 0;
+}
+
+/* Receive from the first path, also on io_uring */
+static int network_receiving(struct event_source *src, const struct timeval *now)
+{
+	struct worker *w = container_of(src, struct worker, sock_source);
+
+	return network_handle_batch(w, &state.paths[0], netmsg_ring_recv(w), now);
+}
+
+/* Receive from the other paths */
+static int path_receiving(struct event_source *src, const struct timeval *now)
+{
+	struct path_source *ps = container_of(src, struct path_source, src);
+
+	return network_handle_batch(ps->w, &state.paths[ps->path],
+			msg_ring_recv(src->fd, &ps->w->rx_ring), now);
 }
 
-static int tunnel_receiving(void)
+/* Path for a frame, by the current schedule */
+static unsigned schedule_path(__be16 proto, const void *data, size_t len)
 {
-	char read_buffer[NM_PI_BUFFER_SIZE], crypt_buffer[NM_PI_BUFFER_SIZE];
-	struct tun_pi *pi = (void *)read_buffer;
-	struct minivtun_msg nmsg;
-	void *out_data;
+	unsigned idx = __atomic_load_n(&path_table_idx, __ATOMIC_ACQUIRE);
+
+	return path_tables[idx][flow_hash(proto, data, len) % PATH_TABLE_SIZE];
+}
+
+/**
+ * Send the datagrams queued on the worker's ring, each over the path of
+ * its flow. The iovecs are regrouped by path at the front of the ring,
+ * as GSO trains span adjacent ones.
+ */
+static void paths_ring_flush(struct worker *w)
+{
+	struct msg_ring *ring = &w->tx_ring;
+	const __u8 *tags = tx_path_tags[w->id];
+	struct iovec iovs[NM_BATCH_SIZE];
+	unsigned count = ring->count, sent = 0, i, n, p;
+	int sockfd, rc;
+
+	memcpy(iovs, ring->iovs, sizeof(iovs[0]) * count);
+
+	for (p = 0; p < state.nr_paths; p++) {
+		struct client_path *path = &state.paths[p];
+
+		for (i = n = 0; i < count; i++) {
+			if (tags[i] == p)
+				ring->iovs[n++] = iovs[i];
+		}
+		sockfd = __atomic_load_n(&path->sockfd, __ATOMIC_ACQUIRE);
+		if (n == 0 || sockfd < 0)
+			continue;
+		ring->count = n;
+		rc = msg_ring_send(sockfd, ring);
+		stats_add_shared(&path->tx_packets, rc);
+		sent += rc;
+	}
+	ring->count = 0;
+
+	if (sent < count)
+		stats_add(&w->stats.drops[DROP_NET_SEND], count - sent);
+}
+
+static void client_ring_flush(struct worker *w)
+{
+	if (tx_path_tags) {
+		paths_ring_flush(w);
+	} else {
+		netmsg_ring_flush(w);
+	}
+}
+
+/**
+ * Make room for a datagram on the worker's send ring. Flushing is left
+ * to us rather than netmsg_ring_next(), which would not keep the paths.
+ */
+static inline void client_ring_reserve(struct worker *w)
+{
+	if (w->tx_ring.count == w->tx_ring.size)
+		client_ring_flush(w);
+}
+
+/**
+ * Encoder of the worker for the groups over 'path'. A group is kept to
+ * one path, as the server decodes each of its real addresses apart.
+ */
+static inline struct fec_encoder *fec_encoder_of(struct worker *w, unsigned path)
+{
+	return fec_tx[w->id * state.nr_paths + path];
+}
+
+/* Queue the parity of the worker's open group over 'path', closing it */
+static void fec_queue_parity(struct worker *w, unsigned path)
+{
+	struct fec_encoder *enc = fec_encoder_of(w, path);
+	unsigned m = fec_parity_count(enc), j;
+
+	for (j = 0; j < m; j++) {
+		client_ring_reserve(w);
+		if (tx_path_tags)
+			tx_path_tags[w->id][w->tx_ring.count] = path;
+		netmsg_queue_parity(w, enc, j, next_xmit_seq(&state.paths[path].xmit_seq),
+				config.replay_window ? (int)path : -1, NULL);
+	}
+	fec_encoder_close(enc);
+}
+
+/* A group is not to hold back its parity for long, however few packets follow */
+static void fec_group_expired(struct event_loop *loop, const struct timeval *now)
+{
+	struct worker *w = container_of(loop, struct worker, loop);
+	unsigned p;
+
+	for (p = 0; p < state.nr_paths; p++) {
+		if (fec_encoder_busy(fec_encoder_of(w, p)))
+			fec_queue_parity(w, p);
+	}
+	if (w->tx_ring.count)
+		client_ring_flush(w);
+}
+
+static int tunnel_read_one(struct worker *w)
+{
+	struct minivtun_msg *nmsg;
+	struct tun_pi *pi;
+	__be16 proto;
 	size_t ip_dlen, out_dlen;
+	bool group_full = false;
+	unsigned path = 0;
+	__u64 seq;
 	int rc;
 
-	rc = read(state.tunfd, pi, NM_PI_BUFFER_SIZE);
-	if (rc < sizeof(struct tun_pi))
+	/* The frame is read straight into the buffer of the message. */
+	client_ring_reserve(w);
+	rc = tun_read_netmsg(w, &nmsg);
+	if (rc < (int)sizeof(struct tun_pi))
 		return -1;
+	pi = (void *)((char *)nmsg + MINIVTUN_MSG_IPDATA_OFFSET - sizeof(struct tun_pi));
 
 	osx_af_to_ether(&pi->proto);
 
 	ip_dlen = (size_t)rc - sizeof(struct tun_pi);
+	stats_add(&w->stats.tun_rx_packets, 1);
+	stats_add(&w->stats.tun_rx_bytes, ip_dlen);
 
 	if (config.tap_mode) {
-		if (ip_dlen < 12)
+		if (ip_dlen < 12) {
+			stats_drop(&w->stats, DROP_SHORT_PACKET);
 			return 0;
+		}
 	} else {
 		/* We only accept IPv4 or IPv6 frames. */
 		if (pi->proto == htons(ETH_P_IP)) {
-			if (ip_dlen < 20)
+			if (ip_dlen < 20) {
+				stats_drop(&w->stats, DROP_SHORT_PACKET);
 				return 0;
+			}
 		} else if (pi->proto == htons(ETH_P_IPV6)) {
-			if (ip_dlen < 40)
+			if (ip_dlen < 40) {
+				stats_drop(&w->stats, DROP_SHORT_PACKET);
 				return 0;
+			}
 		} else {
 			syslog(LOG_WARNING, "*** Invalid protocol: 0x%x.", ntohs(pi->proto));
+			stats_drop(&w->stats, DROP_BAD_PROTO);
 			return 0;
 		}
 	}
 
-	memset(&nmsg.hdr, 0x0, sizeof(nmsg.hdr));
-	nmsg.hdr.opcode = MINIVTUN_MSG_IPDATA;
-	nmsg.hdr.seq = htons(state.xmit_seq++);
-	memcpy(nmsg.hdr.auth_key, config.crypto_key, sizeof(nmsg.hdr.auth_key));
-	nmsg.ipdata.proto = pi->proto;
-	nmsg.ipdata.ip_dlen = htons(ip_dlen);
-	memcpy(nmsg.ipdata.data, pi + 1, ip_dlen);
+	/* Each path numbers the datagrams it carries. */
+	proto = pi->proto;
+	if (tx_path_tags) {
+		tx_path_tags[w->id][w->tx_ring.count] = path = schedule_path(proto,
+				(char *)nmsg + MINIVTUN_MSG_IPDATA_OFFSET, ip_dlen);
+	}
+	seq = next_xmit_seq(&state.paths[path].xmit_seq);
 
-	/* Do encryption. */
-	out_data = crypt_buffer;
+	memset(&nmsg->hdr, 0x0, sizeof(nmsg->hdr));
+	nmsg->hdr.opcode = MINIVTUN_MSG_IPDATA;
+	nmsg->hdr.seq = htons(seq);
+	memcpy(nmsg->hdr.auth_key, config.crypto_key, sizeof(nmsg->hdr.auth_key));
+	nmsg->ipdata.proto = proto;
+	nmsg->ipdata.ip_dlen = htons(ip_dlen);
 	out_dlen = MINIVTUN_MSG_IPDATA_OFFSET + ip_dlen;
-	local_to_netmsg(&nmsg, &out_data, &out_dlen);
 
-	(void)send(state.sockfd, out_data, out_dlen, 0);
+	/* Carry it as a data shard, the trailer goes behind the packet. */
+	if (fec_tx && out_dlen - MINIVTUN_MSG_BASIC_HLEN <= FEC_SHARD_MAX) {
+		struct fec_encoder *enc = fec_encoder_of(w, path);
+		struct fec_trailer tr;
+
+		if (!fec_encoder_busy(enc))
+			event_loop_alarm(&w->loop, FEC_GROUP_MS, fec_group_expired);
+		nmsg->hdr.opcode = MINIVTUN_MSG_FEC_DATA;
+		group_full = fec_encode(enc, &nmsg->ipdata, out_dlen - MINIVTUN_MSG_BASIC_HLEN,
+				config.fec_data, __atomic_load_n(&state.fec_parity, __ATOMIC_RELAXED), &tr);
+		out_dlen = netmsg_fec_trailer(nmsg, out_dlen, &tr);
+	}
+	if (config.replay_window)
+		nmsg = netmsg_push_seq(nmsg, &out_dlen, seq, path);
+
+	/* Encrypt in place, the ring is flushed after the whole batch. */
+	netmsg_ring_commit(w, nmsg, out_dlen, NULL);
+
+	if (group_full)
+		fec_queue_parity(w, path);
 
 	return 0;
 }
 
-static void do_an_echo_request(void)
+static int tunnel_receiving(struct event_source *src, const struct timeval *now)
 {
-	char in_data[64], crypt_buffer[64];
-	struct minivtun_msg *nmsg = (struct minivtun_msg *)in_data;
+	struct worker *w = container_of(src, struct worker, tun_source);
+	int rc = 0, i;
+
+	for (i = 0; i < NM_BATCH_SIZE; i++) {
+		if ((rc = tunnel_read_one(w)) < 0)
+			break;
+	}
+	if (w->tx_ring.count)
+		client_ring_flush(w);
+
+	return rc;
+}
+
+static void do_an_echo_request(struct worker *w, struct client_path *path)
+{
+	char in_data[MSG_RING_HEADROOM + 64 + MSG_RING_TAILROOM];
+	struct minivtun_msg *nmsg = (void *)(in_data + MSG_RING_HEADROOM);
 	void *out_msg;
 	size_t out_len;
 	__be32 r = rand();
+	__u64 seq = next_xmit_seq(&path->xmit_seq);
 
 	memset(nmsg, 0x0, sizeof(nmsg->hdr) + sizeof(nmsg->echo));
 	nmsg->hdr.opcode = MINIVTUN_MSG_ECHO_REQ;
-	nmsg->hdr.seq = htons(state.xmit_seq++);
+	nmsg->hdr.seq = htons(seq);
 	memcpy(nmsg->hdr.auth_key, config.crypto_key, sizeof(nmsg->hdr.auth_key));
 	if (!config.tap_mode) {
 		nmsg->echo.loc_tun_in = config.tun_in_local;
@@ -215,46 +524,89 @@ static void do_an_echo_request(void)
 	}
 	nmsg->echo.id = r;
 
-	out_msg = crypt_buffer;
 	out_len = MINIVTUN_MSG_BASIC_HLEN + sizeof(nmsg->echo);
-	local_to_netmsg(nmsg, &out_msg, &out_len);
-
-	(void)send(state.sockfd, out_msg, out_len, 0);
+	if (config.replay_window)
+		nmsg = netmsg_push_seq(nmsg, &out_len, seq, path - state.paths);
+	out_msg = local_to_netmsg(w, nmsg, &out_len);
+	stats_add(&w->stats.net_tx_packets, 1);
+	stats_add(&w->stats.net_tx_bytes, out_len);
+
+	if (send(path->sockfd, out_msg, out_len, 0) < 0)
+		stats_drop(&w->stats, DROP_NET_SEND);
+
+	if (path->has_pending_echo)
+		path->echo_misses++;
+	path->has_pending_echo = true;
+	path->pending_echo_id = r; /* must be checked on ECHO_ACK */
+	path->stats_buckets[path->current_bucket].total_echo_sent++;
+}
 
-	state.has_pending_echo = true;
-	state.pending_echo_id = r; /* must be checked on ECHO_ACK */
-	state.stats_buckets[state.current_bucket].total_echo_sent++;
+/* Weight of a path by its loss and RTT, from its health assess data */
+static unsigned path_weight(unsigned drop_percent, unsigned rtt_average)
+{
+	return (100 - drop_percent) * 1000 / (rtt_average + 50);
 }
 
-static void reset_state_on_reconnect(void)
+static void reset_path_on_reconnect(struct client_path *path,
+		const struct timeval *now)
 {
-	struct timeval __current;
 	int i;
 
-	gettimeofday(&__current, NULL);
-	state.xmit_seq = (__u16)rand();
-	state.last_recv = __current;
-	state.last_echo_recv = __current;
-	state.last_echo_sent = (struct timeval) { 0, 0 }; /* trigger the first echo */
-	state.last_health_assess = __current;
+	path->last_echo_recv = *now;
+	path->last_echo_sent = (struct timeval) { 0, 0 }; /* trigger the first echo */
+	path->last_health_assess = *now;
+	path->need_reconnect = false;
 
 	/* Reset health assess variables */
-	state.has_pending_echo = false;
-	state.pending_echo_id = 0;
+	path->has_pending_echo = false;
+	path->pending_echo_id = 0;
+	path->echo_misses = 0;
 
 	for (i = 0; i < config.nr_stats_buckets; i++)
-		zero_stats_data(&state.stats_buckets[i]);
-	state.current_bucket = 0;
+		zero_stats_data(&path->stats_buckets[i]);
+	path->current_bucket = 0;
+	path->weight = path_weight(0, 0);
+
+	/* The server may number from anywhere on the new socket. */
+	replay_window_reset(&path->replay);
+	seq_track_reset(&path->track_head);
+}
+
+/* Bring the loss counters of 'replay' up to date, with the ctl_lock held */
+static void path_sum_tracks(struct client_path *path)
+{
+	if (!config.replay_window)
+		seq_track_sum(&path->track_head, path->tracks, config.nr_queues, &path->replay);
+}
+
+/* Report the last health assess of each path, a line each */
+static void write_health_file(void)
+{
+	FILE *fp;
+	unsigned i;
+
+	remove(config.health_file);
+	if ((fp = fopen(config.health_file, "w"))) {
+		for (i = 0; i < state.nr_paths; i++) {
+			struct client_path *p = &state.paths[i];
+			fprintf(fp, "%u,%u,%u,%u,%u,%u,%u,%u\n", p->sent, p->rcvd, p->drop_percent,
+					p->rtt_average, p->data_rcvd, p->data_lost, p->jitter,
+					p->reorder_depth);
+		}
+		fclose(fp);
+	}
 }
 
-static bool do_link_health_assess(void)
+static bool do_link_health_assess(struct client_path *path)
 {
 	unsigned sent = 0, rcvd = 0, rtt = 0;
 	unsigned drop_percent, rtt_average, i;
+	__u64 received, lost;
 	bool health_ok = true;
+	char s_path[20] = "";
 
 	for (i = 0; i < config.nr_stats_buckets; i++) {
-		struct stats_data *st = &state.stats_buckets[i];
+		struct stats_data *st = &path->stats_buckets[i];
 		sent += st->total_echo_sent;
 		rcvd += st->total_echo_rcvd;
 		rtt += st->total_rtt_ms;
@@ -265,45 +617,488 @@ static bool do_link_health_assess(void)
 	drop_percent = sent ? ((sent - rcvd) * 100 / sent) : 0;
 	rtt_average = rcvd ? (rtt / rcvd) : 0;
 
+	/**
+	 * The numbering of the datagrams from the server tells the loss over
+	 * the interval far better than a few echoes, once there are enough.
+	 */
+	path_sum_tracks(path);
+	received = __atomic_load_n(&path->replay.received, __ATOMIC_RELAXED);
+	lost = __atomic_load_n(&path->replay.lost, __ATOMIC_RELAXED);
+	path->data_rcvd = received - path->last_received;
+	path->data_lost = (__s64)(lost - path->last_lost) > 0 ? lost - path->last_lost : 0;
+	path->last_received = received;
+	path->last_lost = lost;
+	if (path->data_rcvd + path->data_lost >= PATH_MIN_LOSS_SAMPLES)
+		drop_percent = path->data_lost * 100 / (path->data_rcvd + path->data_lost);
+	path->jitter = __atomic_load_n(&path->replay.jitter, __ATOMIC_RELAXED);
+	path->reorder_depth = replay_window_take_depth(&path->replay);
+
 	if (drop_percent > config.max_droprate) {
 		health_ok = false;
 	} else if (config.max_rtt && rtt_average > config.max_rtt) {
 		health_ok = false;
 	}
 
+	path->sent = sent;
+	path->rcvd = rcvd;
+	path->drop_percent = drop_percent;
+	path->rtt_average = rtt_average;
+	path->weight = path_weight(drop_percent, rtt_average + path->jitter / 1000);
+	if (state.nr_paths > 1)
+		sprintf(s_path, "Path %u: ", (unsigned)(path - state.paths));
+
 	/* Write into file */
 	if (config.health_file) {
-		FILE *fp;
-		remove(config.health_file);
-		if ((fp = fopen(config.health_file, "w"))) {
-			fprintf(fp, "%u,%u,%u,%u\n", sent, rcvd, drop_percent, rtt_average);
-			fclose(fp);
-		}
+		write_health_file();
 	} else {
-		printf("Sent: %u, received: %u, drop: %u%%, RTT: %u\n",
-				sent, rcvd, drop_percent, rtt_average);
+		printf("%sSent: %u, received: %u, drop: %u%%, RTT: %u, "
+				"data lost: %u of %u, jitter: %u us, reordered by: %u\n",
+				s_path, sent, rcvd, drop_percent, rtt_average, path->data_lost,
+				path->data_rcvd + path->data_lost, path->jitter, path->reorder_depth);
 	}
 
 	/* Move to the next bucket and clear it */
-	state.current_bucket = (state.current_bucket + 1) % config.nr_stats_buckets;
-	zero_stats_data(&state.stats_buckets[state.current_bucket]);
+	path->current_bucket = (path->current_bucket + 1) % config.nr_stats_buckets;
+	zero_stats_data(&path->stats_buckets[path->current_bucket]);
 
 	if (!health_ok) {
-		syslog(LOG_INFO, "Unhealthy state - sent: %u, received: %u, drop: %u%%, RTT: %u",
-				sent, rcvd, drop_percent, rtt_average);
+		syslog(LOG_INFO, "%sUnhealthy state - sent: %u, received: %u, drop: %u%%, RTT: %u, "
+				"data lost: %u of %u", s_path, sent, rcvd, drop_percent, rtt_average,
+				path->data_lost, path->data_rcvd + path->data_lost);
 	}
 
 	return health_ok;
 }
 
-int run_client(const char *peer_addr_pair)
+/* Share of the new packets a path takes, 0 while it cannot carry any */
+static unsigned path_share(const struct client_path *path)
+{
+	if (path->sockfd < 0 || path->need_reconnect || !path->is_healthy ||
+		path->echo_misses >= PATH_MAX_ECHO_MISSES)
+		return 0;
+	return path->weight ? path->weight : 1;
+}
+
+/**
+ * With standby paths, all flows go over the active one. It fails over at
+ * once to the first usable path, and back to a preferred path only after
+ * that has been usable for a whole health assess interval.
+ */
+static unsigned pick_active_path(const unsigned *shares, const struct timeval *now)
+{
+	static unsigned active;
+	unsigned i, last = active;
+
+	for (i = 0; i < state.nr_paths; i++) {
+		if (shares[i] && (!shares[active] || (i < active &&
+			(unsigned)__sub_timeval_ms(now, &state.paths[i].usable_since)
+				>= config.health_assess_interval * 1000))) {
+			active = i;
+			break;
+		}
+	}
+	if (active != last)
+		syslog(LOG_INFO, "Switched to path %u, '%s'.", active, state.paths[active].addr_pair);
+
+	return active;
+}
+
+/* Refill the schedule of flows if the shares of the paths have changed */
+static void update_path_schedule(const struct timeval *now)
+{
+	static unsigned last_shares[MAX_CLIENT_PATHS];
+	unsigned shares[MAX_CLIENT_PATHS], total = 0, sum = 0, slot = 0, i;
+	char buf[MAX_CLIENT_PATHS * 8];
+	size_t len = 0;
+	__u8 *table;
+
+	for (i = 0; i < state.nr_paths; i++) {
+		struct client_path *path = &state.paths[i];
+		total += (shares[i] = path_share(path));
+		if (!shares[i]) {
+			timerclear(&path->usable_since);
+		} else if (!timerisset(&path->usable_since)) {
+			path->usable_since = *now;
+		}
+	}
+	if (config.standby_paths) {
+		unsigned active = pick_active_path(shares, now);
+		for (i = 0; i < state.nr_paths; i++)
+			shares[i] = i == active;
+		total = 1;
+	}
+	/* Spread evenly over the open sockets while none is known to work */
+	if (total == 0) {
+		for (i = 0; i < state.nr_paths; i++)
+			total += (shares[i] = state.paths[i].sockfd >= 0);
+	}
+	if (total == 0)
+		total = shares[0] = 1;
+
+	if (memcmp(shares, last_shares, sizeof(shares[0]) * state.nr_paths) == 0)
+		return;
+	memcpy(last_shares, shares, sizeof(shares[0]) * state.nr_paths);
+
+	table = path_tables[!path_table_idx];
+	for (i = 0; i < state.nr_paths; i++) {
+		sum += shares[i];
+		for (; slot < sum * PATH_TABLE_SIZE / total; slot++)
+			table[slot] = i;
+		len += sprintf(buf + len, " %u%%", shares[i] * 100 / total);
+	}
+	__atomic_store_n(&path_table_idx, !path_table_idx, __ATOMIC_RELEASE);
+
+	if (!config.standby_paths)
+		syslog(LOG_INFO, "Path shares:%s.", buf);
+}
+
+/**
+ * Parity shards for each group: at least '--fec' asks for, plus twice the
+ * data shards a group is expected to lose on the worst path in use. An
+ * echo crosses the link both ways, half of its loss is one way's.
+ */
+static void update_fec_parity(void)
+{
+	unsigned drop = 0, m, i;
+
+	for (i = 0; i < state.nr_paths; i++) {
+		struct client_path *path = &state.paths[i];
+		if (path_share(path) && path->drop_percent > drop)
+			drop = path->drop_percent;
+	}
+	m = config.fec_parity + (config.fec_data * drop + 99) / 100;
+	if (m > FEC_MAX_PARITY)
+		m = FEC_MAX_PARITY;
+
+	if (m != state.fec_parity) {
+		syslog(LOG_INFO, "FEC groups: %u data, %u parity.", config.fec_data, m);
+		__atomic_store_n(&state.fec_parity, m, __ATOMIC_RELAXED);
+	}
+}
+
+/* Follow the sockets of the paths, after they were opened or replaced */
+static void worker_attach_paths(struct worker *w)
+{
+	unsigned i;
+
+	for (i = 0; i < state.nr_paths; i++) {
+		struct client_path *path = &state.paths[i];
+		struct path_source *ps = &path_sources[w->id * state.nr_paths + i];
+		struct event_source *src = i ? &ps->src : &w->sock_source;
+		unsigned gen = __atomic_load_n(&path->sock_gen, __ATOMIC_ACQUIRE);
+
+		if (ps->sock_gen == gen)
+			continue;
+		ps->sock_gen = gen;
+		if (src->fd >= 0)
+			event_loop_del(&w->loop, src);
+		src->fd = path->sockfd;
+		if (i == 0) {
+			w->sockfd = path->sockfd;
+			if (w->uring_sock) {
+				uring_watch_socket(w);
+				continue;
+			}
+		}
+		if (event_loop_add(&w->loop, src) < 0)
+			exit(1);
+	}
+}
+
+static void reconnect_path(struct worker *w, struct client_path *path,
+		const struct timeval *now)
 {
 	char s_peer_addr[50];
-	struct timeval startup_time;
+	int sockfd;
+
+	/* Call link-down scripts, unless another path carries the link */
+	if (state.is_link_ok && !other_path_up(path)) {
+		if (config.dynamic_link)
+			handle_link_down();
+		state.is_link_ok = false;
+	}
+	/* Reopen socket for a different local port, retry later on failure */
+	path->need_reconnect = true;
+	sockfd = resolve_and_connect(path->addr_pair, path->local, &path->peer_addr);
+	if (sockfd < 0) {
+		fprintf(stderr, "Unable to connect to '%s', retrying.\n", path->addr_pair);
+		path->next_connect = *now;
+		path->next_connect.tv_sec += PATH_RETRY_INTERVAL;
+		return;
+	}
+	/* Worked on the first socket, receiving without GRO is still fine. */
+	if (config.udp_offload)
+		udp_set_offload(sockfd);
+	if (path->sockfd >= 0) {
+		/* Replace the socket under the descriptor the workers use. */
+		dup2(sockfd, path->sockfd);
+		close(sockfd);
+	} else {
+		__atomic_store_n(&path->sockfd, sockfd, __ATOMIC_RELEASE);
+	}
+	__atomic_add_fetch(&path->sock_gen, 1, __ATOMIC_RELEASE);
+	worker_attach_paths(w);
+
+	reset_path_on_reconnect(path, now);
+	inet_ntop(path->peer_addr.sa.sa_family, addr_of_sockaddr(&path->peer_addr),
+			s_peer_addr, sizeof(s_peer_addr));
+	syslog(LOG_INFO, "Reconnected to %s:%u.", s_peer_addr,
+			ntohs(port_of_sockaddr(&path->peer_addr)));
+}
+
+/**
+ * Milliseconds from the last echo over a path to the next. Several paths
+ * are probed a few times a second, so that a failed one is out of the
+ * schedule within a second, not a couple of keep-alive intervals. An echo
+ * still unanswered has twice the RTT of the path more before it counts
+ * as missed.
+ */
+static unsigned echo_interval_ms(const struct client_path *path)
+{
+	if (state.nr_paths == 1)
+		return config.keepalive_interval * 1000;
+	if (path->has_pending_echo)
+		return PATH_PROBE_INTERVAL_MS + 2 * path->rtt_average;
+	return PATH_PROBE_INTERVAL_MS;
+}
+
+static void client_periodic_check(struct event_loop *loop, const struct timeval *now)
+{
+	struct worker *w = container_of(loop, struct worker, loop);
+	bool assessed = false, health_ok = false;
+	unsigned i;
+
+	pthread_mutex_lock(&ctl_lock);
+
+	/* Date corruption check */
+	for (i = 0; i < state.nr_paths; i++) {
+		struct client_path *path = &state.paths[i];
+		if (timercmp(&path->last_echo_sent, now, >))
+			path->last_echo_sent = *now;
+		if (timercmp(&path->last_echo_recv, now, >))
+			path->last_echo_recv = *now;
+	}
+
+	/* Command line requires an "exit after N seconds" */
+	if (config.exit_after && __sub_timeval_ms(now, &startup_time)
+			>= config.exit_after * 1000) {
+		syslog(LOG_INFO, "User sets a force-to-exit after %u seconds. Exited.",
+				config.exit_after);
+		exit(0);
+	}
+
+	for (i = 0; i < state.nr_paths; i++) {
+		struct client_path *path = &state.paths[i];
+		bool had_failed = path->need_reconnect;
+
+		/* Check connection status or reconnect */
+		if (path->sockfd < 0 ||
+			(unsigned)__sub_timeval_ms(now, &path->last_echo_recv)
+				>= config.reconnect_timeo * 1000) {
+			path->need_reconnect = true;
+		} else if (!path->need_reconnect &&
+			(unsigned)__sub_timeval_ms(now, &path->last_health_assess)
+				>= config.health_assess_interval * 1000) {
+			/* Calculate packet loss and RTT for a link health assess */
+			path->last_health_assess = *now;
+			path->is_healthy = do_link_health_assess(path);
+			path->need_reconnect = !path->is_healthy;
+			health_ok |= path->is_healthy;
+			assessed = true;
+		}
+
+		/**
+		 * Once another path has taken over, keep the old socket a little
+		 * for the datagrams still on their way to it.
+		 */
+		if (path->need_reconnect && !had_failed && path->sockfd >= 0 &&
+			other_path_up(path)) {
+			path->next_connect = *now;
+			path->next_connect.tv_sec += PATH_DRAIN_INTERVAL;
+		}
+
+		if (path->need_reconnect) {
+			if (!timercmp(now, &path->next_connect, <))
+				reconnect_path(w, path, now);
+		} else if ((unsigned)__sub_timeval_ms(now, &path->last_echo_sent)
+				>= echo_interval_ms(path)) {
+			/* Trigger an echo test */
+			do_an_echo_request(w, path);
+			path->last_echo_sent = *now;
+		}
+	}
+
+	if (health_ok) {
+		/* Call link-up scripts */
+		if (!state.is_link_ok) {
+			if (config.dynamic_link)
+				handle_link_up();
+			state.is_link_ok = true;
+		}
+		state.health_based_link_up = false;
+	} else if (assessed && !other_path_up(NULL)) {
+		/* Keep link down until next health assess passes */
+		state.health_based_link_up = true;
+	}
+
+	if (state.nr_paths > 1)
+		update_path_schedule(now);
+	if (config.fec_data && assessed)
+		update_fec_parity();
+
+	pthread_mutex_unlock(&ctl_lock);
+
+	if (config.drop_log_interval)
+		stats_log_drops(now);
+}
 
-	/* Allocate statistics data buckets */
-	state.stats_buckets = malloc(sizeof(struct stats_data) * config.nr_stats_buckets);
-	assert(state.stats_buckets);
+/* Periodic check of the other workers */
+static void worker_periodic_check(struct event_loop *loop, const struct timeval *now)
+{
+	struct worker *w = container_of(loop, struct worker, loop);
+
+	worker_attach_paths(w);
+}
+
+static void dump_paths_json(FILE *fp)
+{
+	unsigned i;
+
+	fprintf(fp, ",\"paths\":[");
+	for (i = 0; i < state.nr_paths; i++) {
+		struct client_path *p = &state.paths[i];
+		fprintf(fp, "%s{\"remote\":\"%s\",\"local\":\"%s\",\"up\":%s,"
+				"\"weight\":%u,\"drop_percent\":%u,\"rtt_ms\":%u,\"jitter_us\":%u,"
+				"\"reorder_depth\":%u,\"tx_packets\":%llu,\"rx_packets\":%llu,\"lost_packets\":%llu,"
+				"\"reordered_packets\":%llu,\"replayed_packets\":%llu}",
+				i ? "," : "", p->addr_pair, p->local ? p->local : "",
+				path_share(p) ? "true" : "false", p->weight, p->drop_percent,
+				p->rtt_average, p->jitter, p->reorder_depth,
+				(unsigned long long)__atomic_load_n(&p->tx_packets, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&p->rx_packets, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&p->replay.lost, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&p->replay.reordered, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&p->replay.replayed, __ATOMIC_RELAXED));
+	}
+	fprintf(fp, "]");
+}
+
+static void dump_paths_prometheus(FILE *fp)
+{
+	static const struct {
+		const char *name, *type, *help;
+	} metrics[] = {
+		{ "up", "gauge", "Whether the path takes new packets" },
+		{ "weight", "gauge", "Weight of the path by its loss and RTT" },
+		{ "drop_percent", "gauge", "Loss at the last health assess" },
+		{ "rtt_ms", "gauge", "Echo RTT at the last health assess" },
+		{ "jitter_us", "gauge", "Jitter of datagrams from the server at the last health assess" },
+		{ "reorder_depth", "gauge", "Furthest a datagram came late in the last health assess" },
+		{ "tx_packets_total", "counter", "Datagrams sent over the path" },
+		{ "rx_packets_total", "counter", "Datagrams received over the path" },
+		{ "lost_packets_total", "counter", "Datagrams from the server skipped in its numbering" },
+		{ "reordered_packets_total", "counter", "Datagrams from the server received late" },
+		{ "replayed_packets_total", "counter", "Datagrams from the server seen before" },
+	};
+	unsigned i, m;
+
+	for (m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+		fprintf(fp, "# HELP minivtun_path_%s %s.\n", metrics[m].name, metrics[m].help);
+		fprintf(fp, "# TYPE minivtun_path_%s %s\n", metrics[m].name, metrics[m].type);
+		for (i = 0; i < state.nr_paths; i++) {
+			struct client_path *p = &state.paths[i];
+			unsigned long long v;
+
+			switch (m) {
+			case 0: v = path_share(p) != 0; break;
+			case 1: v = p->weight; break;
+			case 2: v = p->drop_percent; break;
+			case 3: v = p->rtt_average; break;
+			case 4: v = p->jitter; break;
+			case 5: v = p->reorder_depth; break;
+			case 6: v = __atomic_load_n(&p->tx_packets, __ATOMIC_RELAXED); break;
+			case 7: v = __atomic_load_n(&p->rx_packets, __ATOMIC_RELAXED); break;
+			case 8: v = __atomic_load_n(&p->replay.lost, __ATOMIC_RELAXED); break;
+			case 9: v = __atomic_load_n(&p->replay.reordered, __ATOMIC_RELAXED); break;
+			default: v = __atomic_load_n(&p->replay.replayed, __ATOMIC_RELAXED); break;
+			}
+			fprintf(fp, "minivtun_path_%s{remote=\"%s\",local=\"%s\"} %llu\n",
+					metrics[m].name, p->addr_pair, p->local ? p->local : "", v);
+		}
+	}
+}
+
+/* Dump the state of the paths for the stats socket */
+static void dump_paths(FILE *fp, int format)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&ctl_lock);
+	for (i = 0; i < state.nr_paths; i++)
+		path_sum_tracks(&state.paths[i]);
+	if (format == STATS_FORMAT_JSON) {
+		dump_paths_json(fp);
+	} else {
+		dump_paths_prometheus(fp);
+	}
+	pthread_mutex_unlock(&ctl_lock);
+}
+
+/* Open the socket of a path at startup, returns a resolve_and_connect() error */
+static int path_init(struct client_path *path, const char *spec)
+{
+	struct timeval now;
+	char *at;
+	int rc;
+
+	/* 'host:port@local', an IPv6 host is braced and holds no '@' */
+	path->addr_pair = strdup(spec);
+	assert(path->addr_pair);
+	if ((at = strrchr(path->addr_pair, '@'))) {
+		*at = '\0';
+		path->local = at + 1;
+	}
+	path->stats_buckets = malloc(sizeof(struct stats_data) * config.nr_stats_buckets);
+	assert(path->stats_buckets);
+	path->is_healthy = true;
+	path->xmit_seq = initial_xmit_seq();
+	replay_window_init(&path->replay);
+	rc = posix_memalign((void **)&path->tracks, CACHE_LINE_SIZE,
+			sizeof(struct seq_track) * config.nr_queues);
+	assert(rc == 0);
+	memset(path->tracks, 0x0, sizeof(struct seq_track) * config.nr_queues);
+
+	gettimeofday(&now, NULL);
+	reset_path_on_reconnect(path, &now);
+	path->sockfd = resolve_and_connect(path->addr_pair, path->local, &path->peer_addr);
+	if (path->sockfd < 0) {
+		rc = path->sockfd;
+		path->sockfd = -1;
+		path->need_reconnect = true;
+		return rc;
+	}
+	if (config.udp_offload && udp_set_offload(path->sockfd) < 0) {
+		fprintf(stderr, "*** Cannot enable UDP offloads: %s.\n", strerror(errno));
+		exit(1);
+	}
+	path->sock_gen = 1;
+	return 0;
+}
+
+int run_client(const char *const *peer_addr_pairs, unsigned nr_pairs)
+{
+	char s_peer_addr[50], s_peers[MAX_CLIENT_PATHS * 60] = "";
+	size_t len = 0;
+	unsigned i;
+	int rc;
+
+	for (i = 0; i < config.nr_queues; i++) {
+		struct worker *w = &state.workers[i];
+		if (netmsg_rings_init(w) < 0) {
+			fprintf(stderr, "*** Cannot allocate datagram buffers.\n");
+			return -1;
+		}
+	}
 
 	/* Remember the startup time for checking with 'config.exit_after' */
 	gettimeofday(&startup_time, NULL);
@@ -313,25 +1108,39 @@ int run_client(const char *peer_addr_pair)
 	if (config.dynamic_link)
 		ip_link_set_updown(config.ifname, false);
 
-	if ((state.sockfd = resolve_and_connect(peer_addr_pair, &state.peer_addr)) >= 0) {
-		/* DNS resolve OK, start service normally */
-		reset_state_on_reconnect();
-		inet_ntop(state.peer_addr.sa.sa_family, addr_of_sockaddr(&state.peer_addr),
-				s_peer_addr, sizeof(s_peer_addr));
-		printf("Mini virtual tunneling client to %s:%u, interface: %s.\n",
-				s_peer_addr, ntohs(port_of_sockaddr(&state.peer_addr)), config.ifname);
-	} else if (state.sockfd == -EAGAIN && config.wait_dns) {
-		/* Connect later (state.sockfd < 0) */
-		gettimeofday(&state.last_health_assess, NULL);
-		printf("Mini virtual tunneling client, interface: %s. \n", config.ifname);
-		printf("WARNING: Connection to '%s' temporarily unavailable, "
-				"to be retried later.\n", peer_addr_pair);
-	} else if (state.sockfd == -EINVAL) {
-		fprintf(stderr, "*** Invalid address pair '%s'.\n", peer_addr_pair);
-		return -1;
+	state.paths = calloc(nr_pairs, sizeof(struct client_path));
+	assert(state.paths);
+	state.nr_paths = nr_pairs;
+	for (i = 0; i < state.nr_paths; i++) {
+		struct client_path *path = &state.paths[i];
+
+		if ((rc = path_init(path, peer_addr_pairs[i])) == 0) {
+			/* DNS resolve OK, start service normally */
+			inet_ntop(path->peer_addr.sa.sa_family, addr_of_sockaddr(&path->peer_addr),
+					s_peer_addr, sizeof(s_peer_addr));
+			len += sprintf(s_peers + len, "%s%s:%u", len ? ", " : "", s_peer_addr,
+					ntohs(port_of_sockaddr(&path->peer_addr)));
+		} else if (rc == -EAGAIN && config.wait_dns) {
+			/* Connect later (path->sockfd < 0) */
+		} else if (rc == -EINVAL) {
+			fprintf(stderr, "*** Invalid address pair '%s'.\n", peer_addr_pairs[i]);
+			return -1;
+		} else {
+			fprintf(stderr, "*** Unable to connect to '%s'.\n", peer_addr_pairs[i]);
+			return -1;
+		}
+	}
+
+	if (len) {
+		printf("Mini virtual tunneling client to %s, interface: %s.\n",
+				s_peers, config.ifname);
 	} else {
-		fprintf(stderr, "*** Unable to connect to '%s'.\n", peer_addr_pair);
-		return -1;
+		printf("Mini virtual tunneling client, interface: %s. \n", config.ifname);
+	}
+	for (i = 0; i < state.nr_paths; i++) {
+		if (state.paths[i].sockfd < 0)
+			printf("WARNING: Connection to '%s' temporarily unavailable, "
+					"to be retried later.\n", peer_addr_pairs[i]);
 	}
 
 	if (config.exit_after)
@@ -349,110 +1158,64 @@ int run_client(const char *peer_addr_pair)
 		}
 	}
 
-	for (;;) {
-		fd_set rset;
-		struct timeval __current, timeo;
-		int rc;
-		bool need_reconnect = false;
-
-		FD_ZERO(&rset);
-		FD_SET(state.tunfd, &rset);
-		if (state.sockfd >= 0)
-			FD_SET(state.sockfd, &rset);
-
-		timeo = (struct timeval) { 0, 500000 };
-		rc = select((state.tunfd > state.sockfd ? state.tunfd : state.sockfd) + 1,
-				&rset, NULL, NULL, &timeo);
-		if (rc < 0) {
-			fprintf(stderr, "*** select(): %s.\n", strerror(errno));
-			return -1;
-		}
-
-		gettimeofday(&__current, NULL);
-
-		/* Date corruption check */
-		if (timercmp(&state.last_recv, &__current, >))
-			state.last_recv = __current;
-		if (timercmp(&state.last_echo_sent, &__current, >))
-			state.last_echo_sent = __current;
-		if (timercmp(&state.last_echo_recv, &__current, >))
-			state.last_echo_recv = __current;
-
-		/* Command line requires an "exit after N seconds" */
-		if (config.exit_after && __sub_timeval_ms(&__current, &startup_time)
-				>= config.exit_after * 1000) {
-			syslog(LOG_INFO, "User sets a force-to-exit after %u seconds. Exited.",
-					config.exit_after);
-			exit(0);
-		}
-
-		/* Check connection status or reconnect */
-		if (state.sockfd < 0 ||
-			(unsigned)__sub_timeval_ms(&__current, &state.last_echo_recv)
-				>= config.reconnect_timeo * 1000) {
-			need_reconnect = true;
-		} else {
-			/* Calculate packet loss and RTT for a link health assess */
-			if ((unsigned)__sub_timeval_ms(&__current, &state.last_health_assess)
-					>= config.health_assess_interval * 1000) {
-				state.last_health_assess = __current;
-				if (do_link_health_assess()) {
-					/* Call link-up scripts */
-					if (!state.is_link_ok) {
-						if (config.dynamic_link)
-							handle_link_up();
-						state.is_link_ok = true;
-					}
-					state.health_based_link_up = false;
-				} else {
-					need_reconnect = true;
-					/* Keep link down until next health assess passes */
-					state.health_based_link_up = true;
-				}
-			}
+	if (config.fec_data) {
+		fec_tx = calloc(config.nr_queues * state.nr_paths, sizeof(*fec_tx));
+		assert(fec_tx);
+		for (i = 0; i < config.nr_queues * state.nr_paths; i++) {
+			fec_tx[i] = fec_encoder_new(i / state.nr_paths);
+			assert(fec_tx[i]);
 		}
+		fec_rx = fec_decoder_new();
+		assert(fec_rx);
+		state.fec_parity = config.fec_parity;
+	}
 
-		if (need_reconnect) {
-reconnect:
-			/* Call link-down scripts */
-			if (state.is_link_ok) {
-				if (config.dynamic_link)
-					handle_link_down();
-				state.is_link_ok = false;
-			}
-			/* Reopen socket for a different local port */
-			if (state.sockfd >= 0)
-				close(state.sockfd);
-			if ((state.sockfd = resolve_and_connect(peer_addr_pair, &state.peer_addr)) < 0) {
-				fprintf(stderr, "Unable to connect to '%s', retrying.\n", peer_addr_pair);
-				sleep(5);
-				goto reconnect;
-			}
-			reset_state_on_reconnect();
-			inet_ntop(state.peer_addr.sa.sa_family, addr_of_sockaddr(&state.peer_addr),
-					s_peer_addr, sizeof(s_peer_addr));
-			syslog(LOG_INFO, "Reconnected to %s:%u.", s_peer_addr,
-					ntohs(port_of_sockaddr(&state.peer_addr)));
-			continue;
-		}
+	path_sources = calloc(config.nr_queues * state.nr_paths, sizeof(struct path_source));
+	assert(path_sources);
+	if (state.nr_paths > 1) {
+		tx_path_tags = calloc(config.nr_queues, sizeof(*tx_path_tags));
+		assert(tx_path_tags);
+		update_path_schedule(&startup_time);
+	}
 
-		if (state.sockfd >= 0 && FD_ISSET(state.sockfd, &rset)) {
-			rc = network_receiving();
+	for (i = 0; i < config.nr_queues; i++) {
+		struct worker *w = &state.workers[i];
+		unsigned j;
+
+		/**
+		 * Connection state is checked every 500ms by the first worker,
+		 * or every 100ms to probe several paths in time.
+		 */
+		if (event_loop_init(&w->loop, state.nr_paths > 1 ? 100 : 500,
+			i ? worker_periodic_check : client_periodic_check) < 0)
+			exit(1);
+
+		w->tun_source.fd = w->tunfd;
+		w->tun_source.handler = tunnel_receiving;
+		if (event_loop_add(&w->loop, &w->tun_source) < 0)
+			exit(1);
+
+		/* All workers share the connected sockets. */
+		w->sock_source.fd = -1;
+		w->sock_source.shared = true;
+		w->sock_source.handler = network_receiving;
+		for (j = 0; j < state.nr_paths; j++) {
+			struct path_source *ps = &path_sources[i * state.nr_paths + j];
+			ps->w = w;
+			ps->path = j;
+			ps->src.fd = -1;
+			ps->src.shared = true;
+			ps->src.handler = path_receiving;
 		}
+		worker_attach_paths(w);
+	}
 
-		if (FD_ISSET(state.tunfd, &rset)) {
-			rc = tunnel_receiving();
-			assert(rc == 0);
-		}
+	if (config.stats_socket &&
+		stats_socket_init(config.stats_socket, dump_paths) < 0)
+		exit(1);
 
-		/* Trigger an echo test */
-		if (state.sockfd >= 0 &&
-			(unsigned)__sub_timeval_ms(&__current, &state.last_echo_sent)
-				>= config.keepalive_interval * 1000) {
-			do_an_echo_request();
-			state.last_echo_sent = __current;
-		}
-	}
+	if (run_workers() < 0)
+		return -1;
 
 	return 0;
 }
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <sys/select.h>
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+	#include <sys/epoll.h>
+	#include <sys/timerfd.h>
+#endif
+
+#include "event.h"
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+
+int event_loop_init(struct event_loop *loop, unsigned tick_ms, event_timer_t on_tick)
+{
+	memset(loop, 0x0, sizeof(*loop));
+	loop->epfd = -1;
+	loop->timerfd = -1;
+	loop->alarmfd = -1;
+	loop->tick_ms = tick_ms;
+	loop->on_tick = on_tick;
+	gettimeofday(&loop->now, NULL);
+	loop->last_tick = loop->now;
+	return 0;
+}
+
+static int __event_loop_add(struct event_loop *loop, struct event_source *src)
+{
+	return 0;
+}
+
+static void __event_loop_del(struct event_loop *loop, struct event_source *src)
+{
+}
+
+static int __event_loop_alarm(struct event_loop *loop, unsigned ms)
+{
+	loop->alarm_at.tv_sec = loop->now.tv_sec + ms / 1000;
+	loop->alarm_at.tv_usec = loop->now.tv_usec + (ms % 1000) * 1000;
+	if (loop->alarm_at.tv_usec >= 1000000) {
+		loop->alarm_at.tv_sec++;
+		loop->alarm_at.tv_usec -= 1000000;
+	}
+	return 0;
+}
+
+static int event_loop_wait(struct event_loop *loop, bool block)
+{
+	fd_set rset;
+	struct timeval timeo = { 0, 0 }, *tv = &timeo;
+	int maxfd = -1, rc;
+	unsigned i;
+
+	FD_ZERO(&rset);
+	for (i = 0; i < loop->nr_sources; i++) {
+		FD_SET(loop->sources[i]->fd, &rset);
+		if (loop->sources[i]->fd > maxfd)
+			maxfd = loop->sources[i]->fd;
+	}
+
+	if (block && !loop->on_tick && !loop->alarm_armed) {
+		tv = NULL;
+	} else if (block) {
+		long left = loop->on_tick ?
+			loop->tick_ms - __sub_timeval_ms(&loop->now, &loop->last_tick) : LONG_MAX;
+		if (loop->alarm_armed &&
+			__sub_timeval_ms(&loop->alarm_at, &loop->now) < left)
+			left = __sub_timeval_ms(&loop->alarm_at, &loop->now);
+		if (left < 0)
+			left = 0;
+		timeo.tv_sec = left / 1000;
+		timeo.tv_usec = (left % 1000) * 1000;
+	}
+
+	rc = select(maxfd + 1, &rset, NULL, NULL, tv);
+	if (rc < 0) {
+		if (errno == EINTR)
+			return 0;
+		fprintf(stderr, "*** select(): %s.\n", strerror(errno));
+		return -1;
+	}
+
+	gettimeofday(&loop->now, NULL);
+
+	for (i = 0; i < loop->nr_sources && rc > 0; i++) {
+		if (FD_ISSET(loop->sources[i]->fd, &rset))
+			loop->sources[i]->pending = true;
+	}
+
+	/* Also catches up after the wall clock being set backwards */
+	if (loop->on_tick &&
+		(__sub_timeval_ms(&loop->now, &loop->last_tick) >= (long)loop->tick_ms ||
+		timercmp(&loop->last_tick, &loop->now, >))) {
+		loop->last_tick = loop->now;
+		loop->on_tick(loop, &loop->now);
+	}
+
+	if (loop->alarm_armed && !timercmp(&loop->now, &loop->alarm_at, <)) {
+		loop->alarm_armed = false;
+		loop->on_alarm(loop, &loop->now);
+	}
+
+	return 0;
+}
+
+#else
+
+int event_loop_init(struct event_loop *loop, unsigned tick_ms, event_timer_t on_tick)
+{
+	struct itimerspec its;
+	struct epoll_event ev;
+
+	memset(loop, 0x0, sizeof(*loop));
+	loop->tick_ms = tick_ms;
+	loop->on_tick = on_tick;
+	gettimeofday(&loop->now, NULL);
+	loop->last_tick = loop->now;
+
+	loop->timerfd = -1;
+	loop->alarmfd = -1;
+
+	if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		fprintf(stderr, "*** epoll_create1() failed: %s.\n", strerror(errno));
+		return -1;
+	}
+	if (!on_tick)
+		return 0;
+
+	if ((loop->timerfd = timerfd_create(CLOCK_MONOTONIC,
+		TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+		fprintf(stderr, "*** timerfd_create() failed: %s.\n", strerror(errno));
+		close(loop->epfd);
+		return -1;
+	}
+
+	its.it_interval.tv_sec = tick_ms / 1000;
+	its.it_interval.tv_nsec = (tick_ms % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(loop->timerfd, 0, &its, NULL) < 0) {
+		fprintf(stderr, "*** timerfd_settime() failed: %s.\n", strerror(errno));
+		close(loop->timerfd);
+		close(loop->epfd);
+		return -1;
+	}
+
+	/* The timer is the only event without a source attached */
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) < 0) {
+		fprintf(stderr, "*** epoll_ctl() failed: %s.\n", strerror(errno));
+		close(loop->timerfd);
+		close(loop->epfd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int __event_loop_add(struct event_loop *loop, struct event_source *src)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+#ifdef EPOLLEXCLUSIVE
+	if (src->shared)
+		ev.events |= EPOLLEXCLUSIVE;
+#endif
+	ev.data.ptr = src;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+		fprintf(stderr, "*** epoll_ctl() failed: %s.\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void __event_loop_del(struct event_loop *loop, struct event_source *src)
+{
+	(void)epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+/* The alarm has a timer of its own, created when first set */
+static int __event_loop_alarm(struct event_loop *loop, unsigned ms)
+{
+	struct itimerspec its;
+	struct epoll_event ev;
+
+	if (loop->alarmfd < 0) {
+		if ((loop->alarmfd = timerfd_create(CLOCK_MONOTONIC,
+			TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+			return -1;
+		memset(&ev, 0x0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &loop->alarmfd;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->alarmfd, &ev) < 0) {
+			close(loop->alarmfd);
+			loop->alarmfd = -1;
+			return -1;
+		}
+	}
+
+	memset(&its, 0x0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000 + (ms ? 0 : 1);
+	return timerfd_settime(loop->alarmfd, 0, &its, NULL);
+}
+
+static int event_loop_wait(struct event_loop *loop, bool block)
+{
+	struct epoll_event evs[EVENT_MAX_SOURCES + 2];
+	bool need_tick = false, need_alarm = false;
+	int nfds, i;
+
+	nfds = epoll_wait(loop->epfd, evs, countof(evs), block ? -1 : 0);
+	if (nfds < 0) {
+		if (errno == EINTR)
+			return 0;
+		fprintf(stderr, "*** epoll_wait(): %s.\n", strerror(errno));
+		return -1;
+	}
+
+	gettimeofday(&loop->now, NULL);
+
+	for (i = 0; i < nfds; i++) {
+		struct event_source *src = evs[i].data.ptr;
+		uint64_t expirations;
+		if (src == (void *)&loop->alarmfd) {
+			(void)read(loop->alarmfd, &expirations, sizeof(expirations));
+			need_alarm = loop->alarm_armed;
+		} else if (src) {
+			src->pending = true;
+		} else {
+			(void)read(loop->timerfd, &expirations, sizeof(expirations));
+			need_tick = true;
+		}
+	}
+
+	if (need_tick) {
+		loop->last_tick = loop->now;
+		loop->on_tick(loop, &loop->now);
+	}
+	if (need_alarm) {
+		loop->alarm_armed = false;
+		loop->on_alarm(loop, &loop->now);
+	}
+
+	return 0;
+}
+
+#endif
+
+int event_loop_add(struct event_loop *loop, struct event_source *src)
+{
+	assert(loop->nr_sources < EVENT_MAX_SOURCES);
+
+	if (__event_loop_add(loop, src) < 0)
+		return -1;
+
+	/* Edge-triggered: anything already queued must be picked up now */
+	src->pending = true;
+	loop->sources[loop->nr_sources++] = src;
+	return 0;
+}
+
+void event_loop_del(struct event_loop *loop, struct event_source *src)
+{
+	unsigned i;
+
+	for (i = 0; i < loop->nr_sources; i++) {
+		if (loop->sources[i] == src) {
+			__event_loop_del(loop, src);
+			loop->sources[i] = loop->sources[--loop->nr_sources];
+			src->pending = false;
+			break;
+		}
+	}
+}
+
+/**
+ * Have 'on_alarm' called once, 'ms' from now, from the thread running the
+ * loop. Nothing changes while an alarm is pending already.
+ */
+int event_loop_alarm(struct event_loop *loop, unsigned ms, event_timer_t on_alarm)
+{
+	if (loop->alarm_armed)
+		return 0;
+	if (__event_loop_alarm(loop, ms) < 0)
+		return -1;
+	loop->on_alarm = on_alarm;
+	loop->alarm_armed = true;
+	return 0;
+}
+
+/* Run the handlers of pending sources, returns true if any is left */
+static bool event_loop_dispatch(struct event_loop *loop)
+{
+	bool has_pending = false;
+	unsigned i, n;
+
+	for (i = 0; i < loop->nr_sources; i++) {
+		struct event_source *src = loop->sources[i];
+		for (n = 0; src->pending && n < EVENT_BUDGET_EACH_SOURCE; n++) {
+			if (src->handler(src, &loop->now) < 0)
+				src->pending = false;
+		}
+		if (src->pending)
+			has_pending = true;
+	}
+
+	return has_pending;
+}
+
+/**
+ * One round of the loop without sleeping, for a loop whose descriptor
+ * is watched by another mechanism. Returns 1 if sources are left with
+ * data pending, 0 if not.
+ */
+int event_loop_poll(struct event_loop *loop)
+{
+	if (event_loop_wait(loop, false) < 0)
+		return -1;
+	return event_loop_dispatch(loop) ? 1 : 0;
+}
+
+int event_loop_run(struct event_loop *loop)
+{
+	bool has_pending = true;
+
+	for (;;) {
+		/* Do not sleep while any source still has data queued */
+		if (event_loop_wait(loop, !has_pending) < 0)
+			return -1;
+		has_pending = event_loop_dispatch(loop);
+	}
+
+	return 0;
+}
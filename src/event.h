@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __EVENT_H
+#define __EVENT_H
+
+#include "library.h"
+
+#define EVENT_MAX_SOURCES  16
+
+/* Packets handled from one source before yielding to the others */
+#define EVENT_BUDGET_EACH_SOURCE  64
+
+struct event_source;
+struct event_loop;
+
+/**
+ * Called when the file descriptor is readable. Returns a negative value
+ * when the descriptor has been drained (EAGAIN), or 0 if more data may
+ * still be pending.
+ */
+typedef int (*event_handler_t)(struct event_source *src,
+		const struct timeval *now);
+
+struct event_source {
+	int fd;
+	bool pending;
+	/* Polled by several loops at once, only one of them is woken. */
+	bool shared;
+	event_handler_t handler;
+};
+
+typedef void (*event_timer_t)(struct event_loop *loop, const struct timeval *now);
+
+/**
+ * Edge-triggered readiness loop with a periodic tick. Backed by epoll and
+ * timerfd on Linux, and by select() on the other platforms. The tick is
+ * disabled when 'on_tick' is NULL. A one-shot alarm can be set on top,
+ * see event_loop_alarm().
+ */
+struct event_loop {
+	int epfd;
+	int timerfd;
+	unsigned tick_ms;
+	struct timeval last_tick;
+	event_timer_t on_tick;
+	int alarmfd;
+	bool alarm_armed;
+	struct timeval alarm_at;
+	event_timer_t on_alarm;
+	struct event_source *sources[EVENT_MAX_SOURCES];
+	unsigned nr_sources;
+	struct timeval now;
+};
+
+int event_loop_init(struct event_loop *loop, unsigned tick_ms, event_timer_t on_tick);
+int event_loop_alarm(struct event_loop *loop, unsigned ms, event_timer_t on_alarm);
+int event_loop_add(struct event_loop *loop, struct event_source *src);
+void event_loop_del(struct event_loop *loop, struct event_source *src);
+int event_loop_poll(struct event_loop *loop);
+int event_loop_run(struct event_loop *loop);
+
+#endif /* __EVENT_H */
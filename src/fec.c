@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "minivtun.h"
+
+/**
+ * Forward error correction by a systematic Reed-Solomon code over
+ * GF(2^8). Data shards go out as they are, with a trailer naming their
+ * group, and each group of up to FEC_MAX_DATA of them is followed by
+ * a few parity shards. Parity shard 'j' sums the data shards, the i-th
+ * one multiplied by 1 / (i ^ (FEC_MAX_DATA + j)). That is a Cauchy
+ * matrix, every square part of which can be inverted, so any data shards
+ * lost can be rebuilt from as many parity shards. The coefficients do
+ * not depend on the size of the group, which may be closed early.
+ *
+ * Shards are coded as their length in two bytes followed by the data,
+ * padded with zeroes to the longest one of the group.
+ */
+
+/* Groups a decoder keeps shards of, the oldest one makes room */
+#define FEC_WINDOW  8
+
+#define FEC_MAX_SHARDS  (FEC_MAX_DATA + FEC_MAX_PARITY)
+
+static __u8 gf_exp[512];
+static __u8 gf_log[256];
+static __u8 gf_mul_table[256][256];
+static __u8 fec_coefs[FEC_MAX_PARITY][FEC_MAX_DATA];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static inline __u8 gf_mul(__u8 a, __u8 b)
+{
+	return gf_mul_table[a][b];
+}
+
+static inline __u8 gf_inv(__u8 a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+/* Tables of GF(2^8) by the polynomial x^8 + x^4 + x^3 + x^2 + 1 */
+static void gf_init(void)
+{
+	unsigned i, j, x = 1;
+
+	for (i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= 0x11d;
+	}
+	for (i = 1; i < 256; i++) {
+		for (j = 1; j < 256; j++)
+			gf_mul_table[i][j] = gf_exp[gf_log[i] + gf_log[j]];
+	}
+	for (j = 0; j < FEC_MAX_PARITY; j++) {
+		for (i = 0; i < FEC_MAX_DATA; i++)
+			fec_coefs[j][i] = gf_inv(i ^ (FEC_MAX_DATA + j));
+	}
+}
+
+/* dst += c * src, over 'len' bytes */
+static void gf_mul_add(__u8 *dst, const __u8 *src, __u8 c, size_t len)
+{
+	const __u8 *row = gf_mul_table[c];
+	size_t i;
+
+	if (c == 0)
+		return;
+	if (c == 1) {
+		for (i = 0; i < len; i++)
+			dst[i] ^= src[i];
+		return;
+	}
+	for (i = 0; i < len; i++)
+		dst[i] ^= row[src[i]];
+}
+
+/* Gauss-Jordan inversion of the n x n matrix 'a', which is destroyed */
+static bool gf_invert(__u8 a[][FEC_MAX_PARITY], __u8 inv[][FEC_MAX_PARITY], unsigned n)
+{
+	unsigned r, c, i;
+	__u8 f, t;
+
+	memset(inv, 0x0, sizeof(inv[0]) * n);
+	for (i = 0; i < n; i++)
+		inv[i][i] = 1;
+
+	for (c = 0; c < n; c++) {
+		for (r = c; r < n && !a[r][c]; r++)
+			;
+		if (r == n)
+			return false;
+		for (i = 0; r != c && i < n; i++) {
+			t = a[r][i], a[r][i] = a[c][i], a[c][i] = t;
+			t = inv[r][i], inv[r][i] = inv[c][i], inv[c][i] = t;
+		}
+		f = gf_inv(a[c][c]);
+		for (i = 0; i < n; i++) {
+			a[c][i] = gf_mul(a[c][i], f);
+			inv[c][i] = gf_mul(inv[c][i], f);
+		}
+		for (r = 0; r < n; r++) {
+			if (r == c || !(f = a[r][c]))
+				continue;
+			for (i = 0; i < n; i++) {
+				a[r][i] ^= gf_mul(f, a[c][i]);
+				inv[r][i] ^= gf_mul(f, inv[c][i]);
+			}
+		}
+	}
+	return true;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+/* Parity of the group being sent, updated with each data shard */
+struct fec_encoder {
+	__u32 group;
+	unsigned count, k, m;
+	size_t len; /* longest coded shard so far */
+	__u8 parity[FEC_MAX_PARITY][FEC_SYMBOL_MAX];
+};
+
+/**
+ * Encoder for one sending thread. 'stream' tells its groups apart from
+ * those of the other threads sending to the same peer.
+ */
+struct fec_encoder *fec_encoder_new(unsigned stream)
+{
+	struct fec_encoder *enc;
+
+	pthread_once(&gf_once, gf_init);
+	if ((enc = calloc(1, sizeof(*enc))) == NULL)
+		return NULL;
+	enc->group = (__u32)stream << 24 | (rand() & 0xffffff);
+	return enc;
+}
+
+void fec_encoder_free(struct fec_encoder *enc)
+{
+	free(enc);
+}
+
+/* Whether a group has been started and not closed yet */
+bool fec_encoder_busy(const struct fec_encoder *enc)
+{
+	return enc->count > 0;
+}
+
+static void fec_fill_trailer(struct fec_trailer *tr, __u32 group, size_t len,
+		unsigned index, unsigned k, unsigned m)
+{
+	tr->group = htonl(group);
+	tr->len = htons(len);
+	tr->index = index;
+	tr->k = k;
+	tr->m = m;
+	tr->rsv = 0;
+}
+
+/**
+ * Add 'len' bytes of 'shard' to the open group, or to a new one of 'k'
+ * data and 'm' parity shards, and fill in its trailer. Returns true once
+ * the group is complete, for fec_encode_parity().
+ */
+bool fec_encode(struct fec_encoder *enc, const void *shard, size_t len,
+		unsigned k, unsigned m, struct fec_trailer *tr)
+{
+	__u8 hdr[2] = { len >> 8, len & 0xff };
+	unsigned i, j;
+
+	if (enc->count == 0) {
+		enc->group = (enc->group & 0xff000000) | ((enc->group + 1) & 0x00ffffff);
+		enc->k = k;
+		enc->m = m;
+		enc->len = 0;
+	}
+
+	/* Zero the parity only as far as the shards reach. */
+	if (len + 2 > enc->len) {
+		for (j = 0; j < enc->m; j++)
+			memset(enc->parity[j] + enc->len, 0x0, len + 2 - enc->len);
+		enc->len = len + 2;
+	}
+
+	i = enc->count++;
+	for (j = 0; j < enc->m; j++) {
+		gf_mul_add(enc->parity[j], hdr, fec_coefs[j][i], 2);
+		gf_mul_add(enc->parity[j] + 2, shard, fec_coefs[j][i], len);
+	}
+	fec_fill_trailer(tr, enc->group, len, i, enc->k, enc->m);
+
+	return enc->count == enc->k;
+}
+
+/* Number of parity shards to send for the open group */
+unsigned fec_parity_count(const struct fec_encoder *enc)
+{
+	return enc->count ? enc->m : 0;
+}
+
+/**
+ * Write parity shard 'j' of the open group to 'out', and fill in its
+ * trailer, which has the number of data shards the group was closed
+ * with. Returns the length written, at most FEC_SYMBOL_MAX.
+ */
+size_t fec_encode_parity(struct fec_encoder *enc, unsigned j, void *out,
+		struct fec_trailer *tr)
+{
+	memcpy(out, enc->parity[j], enc->len);
+	fec_fill_trailer(tr, enc->group, enc->len, j, enc->count, enc->m);
+	return enc->len;
+}
+
+void fec_encoder_close(struct fec_encoder *enc)
+{
+	enc->count = 0;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+struct fec_group {
+	__u32 id;
+	bool used;
+	bool done;   /* nothing is left to rebuild */
+	bool closed; /* 'k' is final, told by a parity shard */
+	unsigned k;
+	__u64 have;  /* data shard i at bit i, parity shard j at FEC_MAX_DATA + j */
+	unsigned long serial;
+	unsigned short lens[FEC_MAX_SHARDS];
+};
+
+/**
+ * Shards received of the last few groups. Several threads may receive
+ * from the same peer, the lock is only held while storing a shard and
+ * rebuilding the missing ones.
+ */
+struct fec_decoder {
+	pthread_mutex_t lock;
+	unsigned long serial;
+	struct fec_group groups[FEC_WINDOW];
+	__u8 shards[FEC_WINDOW][FEC_MAX_SHARDS][FEC_SYMBOL_MAX];
+};
+
+/* Bytes of a decoder, for those who keep them in a pool of their own */
+size_t fec_decoder_size(void)
+{
+	return sizeof(struct fec_decoder);
+}
+
+/**
+ * Set up a decoder in 'mem' of fec_decoder_size() bytes. The shards are
+ * left alone, each is written before it is read, so memory that is
+ * mapped on demand is only taken as far as the shards received reach.
+ */
+struct fec_decoder *fec_decoder_init(void *mem)
+{
+	struct fec_decoder *dec = mem;
+
+	pthread_once(&gf_once, gf_init);
+	memset(dec, 0x0, offsetof(struct fec_decoder, shards));
+	pthread_mutex_init(&dec->lock, NULL);
+	return dec;
+}
+
+void fec_decoder_destroy(struct fec_decoder *dec)
+{
+	pthread_mutex_destroy(&dec->lock);
+}
+
+struct fec_decoder *fec_decoder_new(void)
+{
+	void *mem;
+
+	/* Large enough to be mapped on demand, unused shards cost nothing. */
+	if ((mem = calloc(1, fec_decoder_size())) == NULL)
+		return NULL;
+	return fec_decoder_init(mem);
+}
+
+void fec_decoder_free(struct fec_decoder *dec)
+{
+	fec_decoder_destroy(dec);
+	free(dec);
+}
+
+static struct fec_group *fec_group_get(struct fec_decoder *dec, __u32 id)
+{
+	struct fec_group *g, *victim = NULL;
+	unsigned i;
+
+	for (i = 0; i < FEC_WINDOW; i++) {
+		g = &dec->groups[i];
+		if (g->used && g->id == id)
+			return g;
+		if (!victim || (victim->used && (!g->used || g->serial < victim->serial)))
+			victim = g;
+	}
+
+	memset(victim, 0x0, offsetof(struct fec_group, lens));
+	victim->id = id;
+	victim->used = true;
+	victim->serial = ++dec->serial;
+	return victim;
+}
+
+/* Rebuild the missing data shards of 'g' once enough parity is there */
+static void fec_try_recover(struct fec_decoder *dec, struct fec_group *g,
+		struct fec_recovered *rec)
+{
+	__u8 (*shards)[FEC_SYMBOL_MAX] = dec->shards[g - dec->groups];
+	__u8 a[FEC_MAX_PARITY][FEC_MAX_PARITY], inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+	unsigned lost[FEC_MAX_PARITY], rows[FEC_MAX_PARITY];
+	unsigned nr_lost = 0, nr_rows = 0, i, j, r, c;
+	size_t len;
+
+	if (!g->closed)
+		return;
+	for (i = 0; i < g->k; i++) {
+		if (g->have & (1ULL << i))
+			continue;
+		if (nr_lost == FEC_MAX_PARITY)
+			return;
+		lost[nr_lost++] = i;
+	}
+	if (nr_lost == 0) {
+		g->done = true;
+		return;
+	}
+	for (j = 0; j < FEC_MAX_PARITY && nr_rows < nr_lost; j++) {
+		if (g->have & (1ULL << (FEC_MAX_DATA + j)))
+			rows[nr_rows++] = j;
+	}
+	if (nr_rows < nr_lost)
+		return;
+
+	g->done = true;
+	len = g->lens[FEC_MAX_DATA + rows[0]];
+	for (r = 1; r < nr_rows; r++) {
+		if (g->lens[FEC_MAX_DATA + rows[r]] != len)
+			return;
+	}
+
+	/* Take the shards received out of the parity, leaving the lost ones. */
+	for (r = 0; r < nr_rows; r++) {
+		__u8 *p = shards[FEC_MAX_DATA + rows[r]];
+		for (i = 0; i < g->k; i++) {
+			if (!(g->have & (1ULL << i)))
+				continue;
+			if (g->lens[i] > len)
+				return;
+			gf_mul_add(p, shards[i], fec_coefs[rows[r]][i], g->lens[i]);
+		}
+		for (c = 0; c < nr_lost; c++)
+			a[r][c] = fec_coefs[rows[r]][lost[c]];
+	}
+	if (!gf_invert(a, inv, nr_lost))
+		return;
+
+	for (c = 0; c < nr_lost; c++) {
+		__u8 *out = (__u8 *)rec->bufs[rec->nr] + MINIVTUN_MSG_BASIC_HLEN - 2;
+		size_t dlen;
+
+		memset(out, 0x0, len);
+		for (r = 0; r < nr_rows; r++)
+			gf_mul_add(out, shards[FEC_MAX_DATA + rows[r]], inv[c][r], len);
+		dlen = out[0] << 8 | out[1];
+		if (dlen + 2 > len)
+			continue;
+		rec->lens[rec->nr++] = MINIVTUN_MSG_BASIC_HLEN + dlen;
+	}
+}
+
+/**
+ * Take in a data or parity shard, as long as its trailer tells. Data
+ * shards lost in its group and rebuilt with it are put in 'rec', as
+ * messages whose body is where an IPDATA message would have it.
+ * Returns false for a shard already received or rebuilt, or malformed.
+ */
+bool fec_decode(struct fec_decoder *dec, bool parity, const struct fec_trailer *tr,
+		const void *shard, struct fec_recovered *rec)
+{
+	unsigned idx = parity ? FEC_MAX_DATA + tr->index : tr->index;
+	size_t len = ntohs(tr->len);
+	size_t slen = parity ? len : len + 2;
+	struct fec_group *g;
+	bool fresh = false;
+
+	rec->nr = 0;
+	if (tr->k == 0 || tr->k > FEC_MAX_DATA || tr->m > FEC_MAX_PARITY ||
+		tr->index >= (parity ? tr->m : tr->k) || slen < 2 || slen > FEC_SYMBOL_MAX)
+		return false;
+
+	pthread_mutex_lock(&dec->lock);
+
+	g = fec_group_get(dec, ntohl(tr->group));
+	if (g->done || (g->have & (1ULL << idx)))
+		goto out;
+	g->have |= 1ULL << idx;
+	fresh = true;
+
+	if (parity) {
+		memcpy(dec->shards[g - dec->groups][idx], shard, len);
+		g->k = tr->k;
+		g->closed = true;
+	} else if (tr->m) {
+		__u8 *sym = dec->shards[g - dec->groups][idx];
+		sym[0] = len >> 8;
+		sym[1] = len & 0xff;
+		memcpy(sym + 2, shard, len);
+		if (!g->closed)
+			g->k = tr->k;
+	}
+	g->lens[idx] = slen;
+
+	fec_try_recover(dec, g, rec);
+out:
+	pthread_mutex_unlock(&dec->lock);
+	return fresh;
+}
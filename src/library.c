@@ -13,8 +13,13 @@
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#endif
 #include <openssl/evp.h>
 #include <openssl/md5.h>
+#include <openssl/rand.h>
 
 #include "library.h"
 
@@ -24,6 +29,11 @@ struct name_cipher_pair cipher_pairs[] = {
 	{ "des", EVP_des_cbc, },
 	{ "desx", EVP_desx_cbc, },
 	{ "rc4", EVP_rc4, },
+	{ "aes-128-gcm", EVP_aes_128_gcm, },
+	{ "aes-256-gcm", EVP_aes_256_gcm, },
+#ifndef OPENSSL_NO_CHACHA
+	{ "chacha20-poly1305", EVP_chacha20_poly1305, },
+#endif
 	{ NULL, NULL, },
 };
 
@@ -65,52 +75,210 @@ static const char crypto_ivec_initdata[CRYPTO_MAX_BLOCK_SIZE] = {
 		} \
 	} while(0)
 
-void datagram_encrypt(const void *key, const void *cptype, void *in,
+/**
+ * Cipher state kept across datagrams: the key schedule is expanded once
+ * and only the IV is reset per datagram.
+ *
+ * AEAD ciphers (GCM, ChaCha20-Poly1305) carry a per-datagram nonce and an
+ * authentication tag instead, and leave the in-band authentication field
+ * [auth_off, auth_off + auth_len) of the plaintext out of the datagram:
+ *   nonce (12) | ciphertext (without auth field) | tag (16)
+ */
+struct crypto_context {
+	const EVP_CIPHER *cptype;
+	EVP_CIPHER_CTX *enc_ctx;
+	EVP_CIPHER_CTX *dec_ctx;
+	unsigned char key[CRYPTO_MAX_KEY_SIZE];
+	size_t block_size;
+	bool has_iv;
+
+	bool is_aead;
+	size_t auth_off;
+	size_t auth_len;
+	unsigned char nonce_salt[CRYPTO_AEAD_NONCE_LEN - 4];
+	__u32 nonce_seq;
+};
+
+static bool crypto_ctx_rewind(struct crypto_context *c, EVP_CIPHER_CTX *ctx, int enc)
+{
+	/* Ciphers without an IV (e.g. RC4) must be re-keyed for a fresh keystream */
+	if (c->has_iv) {
+		return EVP_CipherInit_ex(ctx, NULL, NULL, NULL,
+				(const unsigned char *)crypto_ivec_initdata, enc);
+	} else {
+		return EVP_CipherInit_ex(ctx, NULL, NULL, c->key, NULL, enc);
+	}
+}
+
+/**
+ * Nonces are a random salt followed by a counter, the salt being renewed
+ * whenever the counter wraps. Peers share the key, so the salt is what
+ * keeps nonces of different senders apart.
+ */
+static void crypto_next_nonce(struct crypto_context *c, unsigned char *nonce)
+{
+	__be32 seq;
+
+	if (c->nonce_seq == 0)
+		assert(RAND_bytes(c->nonce_salt, sizeof(c->nonce_salt)) == 1);
+	seq = htonl(c->nonce_seq++);
+	memcpy(nonce, c->nonce_salt, sizeof(c->nonce_salt));
+	memcpy(nonce + sizeof(c->nonce_salt), &seq, sizeof(seq));
+}
+
+struct crypto_context *crypto_init(const void *cptype, const void *key,
+		size_t auth_off, size_t auth_len)
+{
+	struct crypto_context *c;
+	const unsigned char *iv = (const unsigned char *)crypto_ivec_initdata;
+
+	if ((c = malloc(sizeof(*c))) == NULL)
+		return NULL;
+	memset(c, 0x0, sizeof(*c));
+
+	c->cptype = cptype;
+	memcpy(c->key, key, CRYPTO_MAX_KEY_SIZE);
+	c->has_iv = EVP_CIPHER_iv_length(c->cptype) > 0;
+	c->block_size = c->has_iv ? EVP_CIPHER_iv_length(c->cptype) : 16;
+	c->is_aead = (EVP_CIPHER_flags(c->cptype) & EVP_CIPH_FLAG_AEAD_CIPHER) != 0;
+	c->auth_off = auth_off;
+	c->auth_len = auth_len;
+	if (c->is_aead) {
+		assert(EVP_CIPHER_iv_length(c->cptype) == CRYPTO_AEAD_NONCE_LEN);
+		assert(auth_len >= CRYPTO_AEAD_NONCE_LEN);
+		iv = NULL;
+	}
+
+	c->enc_ctx = EVP_CIPHER_CTX_new();
+	c->dec_ctx = EVP_CIPHER_CTX_new();
+	if (!c->enc_ctx || !c->dec_ctx)
+		goto fail;
+	if (!EVP_CipherInit_ex(c->enc_ctx, c->cptype, NULL, c->key, iv, 1) ||
+		!EVP_CipherInit_ex(c->dec_ctx, c->cptype, NULL, c->key, iv, 0))
+		goto fail;
+	EVP_CIPHER_CTX_set_padding(c->enc_ctx, 0);
+	EVP_CIPHER_CTX_set_padding(c->dec_ctx, 0);
+
+	return c;
+
+fail:
+	crypto_free(c);
+	return NULL;
+}
+
+void crypto_free(struct crypto_context *c)
+{
+	EVP_CIPHER_CTX_free(c->enc_ctx);
+	EVP_CIPHER_CTX_free(c->dec_ctx);
+	free(c);
+}
+
+bool crypto_is_aead(const struct crypto_context *c)
+{
+	return c->is_aead;
+}
+
+/**
+ * Encryption and decryption may work in place, with the datagram on the
+ * wire starting this many bytes after the plaintext message. This is
+ * non-zero for AEAD ciphers, which replace the auth field with a nonce.
+ */
+size_t crypto_wire_shift(const struct crypto_context *c)
+{
+	return c->is_aead ? c->auth_len - CRYPTO_AEAD_NONCE_LEN : 0;
+}
+
+static void datagram_encrypt_aead(struct crypto_context *c, void *in,
+		void *out, size_t *dlen)
+{
+	unsigned char *ip = in, *op = out;
+	size_t auth_end = c->auth_off + c->auth_len;
+	int outl = 0;
+
+	assert(*dlen >= auth_end);
+
+	crypto_next_nonce(c, op);
+	assert(EVP_EncryptInit_ex(c->enc_ctx, NULL, NULL, NULL, op));
+	op += CRYPTO_AEAD_NONCE_LEN;
+
+	assert(EVP_EncryptUpdate(c->enc_ctx, op, &outl, ip, c->auth_off));
+	op += outl;
+	assert(EVP_EncryptUpdate(c->enc_ctx, op, &outl, ip + auth_end, *dlen - auth_end));
+	op += outl;
+	assert(EVP_EncryptFinal_ex(c->enc_ctx, op, &outl));
+	op += outl;
+	assert(EVP_CIPHER_CTX_ctrl(c->enc_ctx, EVP_CTRL_AEAD_GET_TAG,
+			CRYPTO_AEAD_TAG_LEN, op));
+	op += CRYPTO_AEAD_TAG_LEN;
+
+	*dlen = (size_t)(op - (unsigned char *)out);
+}
+
+static int datagram_decrypt_aead(struct crypto_context *c, void *in,
 		void *out, size_t *dlen)
 {
-	size_t iv_len = EVP_CIPHER_iv_length((const EVP_CIPHER *)cptype);
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	unsigned char iv[CRYPTO_MAX_KEY_SIZE];
+	unsigned char *ip = in, *op = out;
+	size_t auth_end = c->auth_off + c->auth_len, clen;
 	int outl = 0, outl2 = 0;
 
-	if (iv_len == 0)
-		iv_len = 16;
+	if (*dlen < CRYPTO_AEAD_NONCE_LEN + c->auth_off + CRYPTO_AEAD_TAG_LEN)
+		return -1;
+	clen = *dlen - CRYPTO_AEAD_NONCE_LEN - CRYPTO_AEAD_TAG_LEN;
+
+	if (!EVP_DecryptInit_ex(c->dec_ctx, NULL, NULL, NULL, ip))
+		return -1;
+	ip += CRYPTO_AEAD_NONCE_LEN;
 
-	memcpy(iv, crypto_ivec_initdata, iv_len);
-	CRYPTO_DATA_PADDING(in, dlen, iv_len);
-	EVP_CIPHER_CTX_init(ctx);
-	assert(EVP_EncryptInit_ex(ctx, cptype, NULL, key, iv));
-	EVP_CIPHER_CTX_set_padding(ctx, 0);
-	assert(EVP_EncryptUpdate(ctx, out, &outl, in, *dlen));
-	assert(EVP_EncryptFinal_ex(ctx, (unsigned char *)out + outl, &outl2));
-	EVP_CIPHER_CTX_cleanup(ctx);
-	EVP_CIPHER_CTX_free(ctx);
+	/* Header first: in place, the auth field overlays the consumed nonce */
+	if (!EVP_DecryptUpdate(c->dec_ctx, op, &outl, ip, c->auth_off))
+		return -1;
+	memset(op + c->auth_off, 0x0, c->auth_len);
+	if (!EVP_DecryptUpdate(c->dec_ctx, op + auth_end, &outl, ip + c->auth_off,
+		clen - c->auth_off))
+		return -1;
+
+	/* Forged or corrupted datagrams stop here */
+	if (!EVP_CIPHER_CTX_ctrl(c->dec_ctx, EVP_CTRL_AEAD_SET_TAG,
+		CRYPTO_AEAD_TAG_LEN, ip + clen))
+		return -1;
+	if (EVP_DecryptFinal_ex(c->dec_ctx, op + auth_end + outl, &outl2) <= 0)
+		return -1;
+
+	*dlen = auth_end + (size_t)(outl + outl2);
+	return 0;
+}
+
+void datagram_encrypt(struct crypto_context *c, void *in, void *out, size_t *dlen)
+{
+	int outl = 0, outl2 = 0;
+
+	if (c->is_aead) {
+		datagram_encrypt_aead(c, in, out, dlen);
+		return;
+	}
+
+	CRYPTO_DATA_PADDING(in, dlen, c->block_size);
+	assert(crypto_ctx_rewind(c, c->enc_ctx, 1));
+	assert(EVP_EncryptUpdate(c->enc_ctx, out, &outl, in, *dlen));
+	assert(EVP_EncryptFinal_ex(c->enc_ctx, (unsigned char *)out + outl, &outl2));
 
 	*dlen = (size_t)(outl + outl2);
 }
 
-void datagram_decrypt(const void *key, const void *cptype, void *in,
-		void *out, size_t *dlen)
+int datagram_decrypt(struct crypto_context *c, void *in, void *out, size_t *dlen)
 {
-	size_t iv_len = EVP_CIPHER_iv_length((const EVP_CIPHER *)cptype);
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	unsigned char iv[CRYPTO_MAX_KEY_SIZE];
 	int outl = 0, outl2 = 0;
 
-	if (iv_len == 0)
-		iv_len = 16;
+	if (c->is_aead)
+		return datagram_decrypt_aead(c, in, out, dlen);
 
-	memcpy(iv, crypto_ivec_initdata, iv_len);
-	CRYPTO_DATA_PADDING(in, dlen, iv_len);
-	EVP_CIPHER_CTX_init(ctx);
-	assert(EVP_DecryptInit_ex(ctx, cptype, NULL, key, iv));
-	EVP_CIPHER_CTX_set_padding(ctx, 0);
-	assert(EVP_DecryptUpdate(ctx, out, &outl, in, *dlen));
-	assert(EVP_DecryptFinal_ex(ctx, (unsigned char *)out + outl, &outl2));
-	EVP_CIPHER_CTX_cleanup(ctx);
-	EVP_CIPHER_CTX_free(ctx);
+	CRYPTO_DATA_PADDING(in, dlen, c->block_size);
+	assert(crypto_ctx_rewind(c, c->dec_ctx, 0));
+	assert(EVP_DecryptUpdate(c->dec_ctx, out, &outl, in, *dlen));
+	assert(EVP_DecryptFinal_ex(c->dec_ctx, (unsigned char *)out + outl, &outl2));
 
 	*dlen = (size_t)(outl + outl2);
+	return 0;
 }
 
 void fill_with_string_md5sum(const char *in, void *out, size_t outlen)
@@ -198,7 +366,47 @@ int get_sockaddr_inx_pair(const char *pair, struct sockaddr_inx *sa,
 	return 0;
 }
 
-int resolve_and_connect(const char *peer_addr_pair, struct sockaddr_inx *peer_addr)
+/**
+ * Bind a socket to 'local', a literal IPv4 or IPv6 address or the name
+ * of an interface. Returns -EINVAL if it is neither or does not fit the
+ * socket, or -EAGAIN if the address or interface is not there for now.
+ */
+static int bind_to_local(int sockfd, int af, const char *local)
+{
+	struct sockaddr_inx sa;
+
+	memset(&sa, 0x0, sizeof(sa));
+	if (inet_pton(AF_INET, local, &sa.in.sin_addr) == 1) {
+		sa.sa.sa_family = AF_INET;
+	} else if (inet_pton(AF_INET6, local, &sa.in6.sin6_addr) == 1) {
+		sa.sa.sa_family = AF_INET6;
+	} else {
+#ifdef __linux__
+		if (setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE, local, strlen(local)) < 0) {
+			if (errno == ENODEV)
+				return -EAGAIN;
+			fprintf(stderr, "*** Cannot bind to interface '%s': %s.\n", local, strerror(errno));
+			return -1;
+		}
+		return 0;
+#else
+		return -EINVAL;
+#endif
+	}
+
+	if (sa.sa.sa_family != af)
+		return -EINVAL;
+	if (bind(sockfd, (struct sockaddr *)&sa, sizeof_sockaddr(&sa)) < 0)
+		return -EAGAIN;
+	return 0;
+}
+
+/**
+ * Open a UDP socket connected to 'peer_addr_pair', sending from 'local'
+ * unless it is NULL, see bind_to_local().
+ */
+int resolve_and_connect(const char *peer_addr_pair, const char *local,
+		struct sockaddr_inx *peer_addr)
 {
 	int sockfd, rc;
 	bool is_random_port = false;
@@ -210,6 +418,10 @@ int resolve_and_connect(const char *peer_addr_pair, struct sockaddr_inx *peer_ad
 		fprintf(stderr, "*** socket() failed: %s.\n", strerror(errno));
 		return -1;
 	}
+	if (local && (rc = bind_to_local(sockfd, peer_addr->sa.sa_family, local)) < 0) {
+		close(sockfd);
+		return rc;
+	}
 	if (connect(sockfd, (struct sockaddr *)peer_addr, sizeof_sockaddr(peer_addr)) < 0) {
 		close(sockfd);
 		return -EAGAIN;
@@ -219,12 +431,16 @@ int resolve_and_connect(const char *peer_addr_pair, struct sockaddr_inx *peer_ad
 	return sockfd;
 }
 
-int tun_alloc(char *dev, bool tap_mode)
+int tun_alloc(char *dev, bool tap_mode, bool multi_queue, bool offload)
 {
 	int fd = -1, err;
 #if defined(__APPLE__) || defined(__FreeBSD__)
 	int b_enable = 1, i;
 
+	if (multi_queue || offload) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
 	for (i = 0; i < 8; i++) {
 		char dev_path[20];
 		sprintf(dev_path, "/dev/tun%d", i);
@@ -254,6 +470,12 @@ int tun_alloc(char *dev, bool tap_mode)
 	} else {
 		ifr.ifr_flags = IFF_TUN;
 	}
+	/* Each open with the same name attaches one more queue. */
+	if (multi_queue)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	/* Frames carry a virtio-net header, for checksum and TSO offloads */
+	if (offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
 	if (dev[0])
 		strncpy(ifr.ifr_name, dev, IFNAMSIZ);
 	if ((err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
@@ -261,11 +483,616 @@ int tun_alloc(char *dev, bool tap_mode)
 		return err;
 	}
 	strcpy(dev, ifr.ifr_name);
+	if (offload && (err = ioctl(fd, TUNSETOFFLOAD,
+		TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6)) < 0) {
+		close(fd);
+		return err;
+	}
 #endif
 
 	return fd;
 }
 
+#if defined(__APPLE__)
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags, struct timespec *timeout)
+{
+	unsigned int i;
+	ssize_t rc;
+
+	for (i = 0; i < vlen; i++) {
+		if ((rc = recvmsg(sockfd, &msgvec[i].msg_hdr, flags)) < 0)
+			return i ? (int)i : -1;
+		msgvec[i].msg_len = (unsigned int)rc;
+	}
+	return (int)i;
+}
+
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags)
+{
+	unsigned int i;
+	ssize_t rc;
+
+	for (i = 0; i < vlen; i++) {
+		if ((rc = sendmsg(sockfd, &msgvec[i].msg_hdr, flags)) < 0)
+			return i ? (int)i : -1;
+		msgvec[i].msg_len = (unsigned int)rc;
+	}
+	return (int)i;
+}
+#endif
+
+int msg_ring_init(struct msg_ring *ring, unsigned size, size_t buf_size)
+{
+	unsigned i;
+
+	ring->size = size;
+	ring->count = 0;
+	ring->buf_size = buf_size;
+	ring->msgs = calloc(size, sizeof(*ring->msgs));
+	ring->iovs = calloc(size, sizeof(*ring->iovs));
+	ring->addrs = calloc(size, sizeof(*ring->addrs));
+	ring->bufs = malloc(size * (MSG_RING_HEADROOM + buf_size + MSG_RING_TAILROOM));
+	ring->gso_max = 0;
+	ring->trains = NULL;
+	ring->ctrl = NULL;
+	if (!ring->msgs || !ring->iovs || !ring->addrs || !ring->bufs) {
+		free(ring->msgs);
+		free(ring->iovs);
+		free(ring->addrs);
+		free(ring->bufs);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < size; i++) {
+		ring->iovs[i].iov_base = msg_ring_slot(ring, i);
+		ring->iovs[i].iov_len = buf_size;
+		ring->msgs[i].msg_hdr.msg_iov = &ring->iovs[i];
+		ring->msgs[i].msg_hdr.msg_iovlen = 1;
+		ring->msgs[i].msg_hdr.msg_name = &ring->addrs[i];
+		ring->msgs[i].msg_hdr.msg_namelen = sizeof(ring->addrs[i]);
+	}
+
+	return 0;
+}
+
+#ifdef __linux__
+#ifndef SOL_UDP
+	#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+	#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+	#define UDP_GRO 104
+#endif
+#endif
+
+#define MSG_RING_CTRL_SIZE  CMSG_SPACE(sizeof(int))
+
+/* Limits of one UDP_SEGMENT send, by the kernel and the IP length field */
+#define MSG_RING_GSO_SEGS  64
+#define MSG_RING_GSO_BYTES  (65535 - 40 - 8)
+
+/**
+ * Let a ring send runs of datagrams with UDP_SEGMENT, or receive trains
+ * coalesced by UDP_GRO, which needs buffers of 64 KiB. The socket must
+ * have been set up with udp_set_offload().
+ */
+int msg_ring_enable_offload(struct msg_ring *ring)
+{
+#ifdef __linux__
+	ring->trains = calloc(ring->size, sizeof(*ring->trains));
+	ring->ctrl = calloc(ring->size, MSG_RING_CTRL_SIZE);
+	if (!ring->trains || !ring->ctrl) {
+		free(ring->trains);
+		free(ring->ctrl);
+		ring->trains = NULL;
+		ring->ctrl = NULL;
+		return -ENOMEM;
+	}
+	ring->gso_max = MSG_RING_GSO_BYTES;
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+/**
+ * Check that the kernel can segment UDP datagrams, and have it deliver
+ * coalesced trains to this socket, each as one datagram.
+ */
+int udp_set_offload(int sockfd)
+{
+#ifdef __linux__
+	int val = 0;
+	socklen_t len = sizeof(val);
+
+	/* The segment size is given per send, only probe for support. */
+	if (getsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &val, &len) < 0)
+		return -1;
+	val = 1;
+	return setsockopt(sockfd, SOL_UDP, UDP_GRO, &val, sizeof(val));
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/**
+ * Receive as many queued datagrams as the ring holds. Returns the number
+ * of datagrams received, or -1 with errno set (EAGAIN if none queued).
+ */
+int msg_ring_recv(int sockfd, struct msg_ring *ring)
+{
+	unsigned i;
+
+	for (i = 0; i < ring->size; i++) {
+		ring->msgs[i].msg_hdr.msg_namelen = sizeof(ring->addrs[i]);
+		if (ring->ctrl) {
+			ring->msgs[i].msg_hdr.msg_control = ring->ctrl + i * MSG_RING_CTRL_SIZE;
+			ring->msgs[i].msg_hdr.msg_controllen = MSG_RING_CTRL_SIZE;
+		}
+	}
+
+	return recvmmsg(sockfd, ring->msgs, ring->size, MSG_DONTWAIT, NULL);
+}
+
+/**
+ * Size of the datagrams received in slot 'i'. A train coalesced by
+ * UDP_GRO holds several of this size, but the last may be shorter.
+ */
+size_t msg_ring_segment_size(struct msg_ring *ring, unsigned i)
+{
+#ifdef __linux__
+	struct msghdr *mh = &ring->msgs[i].msg_hdr;
+	struct cmsghdr *cm;
+	int size;
+
+	if (!ring->ctrl)
+		return ring->msgs[i].msg_len;
+
+	for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+			memcpy(&size, CMSG_DATA(cm), sizeof(size));
+			if (size > 0)
+				return (size_t)size;
+		}
+	}
+#endif
+	return ring->msgs[i].msg_len;
+}
+
+#ifdef __linux__
+/**
+ * Group the queued datagrams from 'start' on into trains, each sent by
+ * the kernel as separate datagrams of the size of the first: runs to the
+ * same peer, in which only the last datagram may be shorter. The iovecs
+ * of a ring are contiguous, so a train just spans several. Returns the
+ * number of trains, a datagram that cannot join others is one itself.
+ */
+static unsigned msg_ring_build_trains(struct msg_ring *ring, unsigned start)
+{
+	unsigned nr = 0, i = start, j;
+
+	while (i < ring->count) {
+		struct msghdr *mh = &ring->msgs[i].msg_hdr;
+		struct msghdr *th = &ring->trains[nr].msg_hdr;
+		size_t seg = mh->msg_iov->iov_len, total = seg;
+
+		for (j = i + 1; j < ring->count && seg <= ring->gso_max &&
+				j - i < MSG_RING_GSO_SEGS; j++) {
+			struct msghdr *next = &ring->msgs[j].msg_hdr;
+			size_t len = next->msg_iov->iov_len;
+
+			if (len > seg || total + len > MSG_RING_GSO_BYTES ||
+				next->msg_namelen != mh->msg_namelen ||
+				(mh->msg_namelen && !is_sockaddr_equal(&ring->addrs[i], &ring->addrs[j])))
+				break;
+			total += len;
+			if (len < seg) {
+				j++;
+				break;
+			}
+		}
+
+		*th = *mh;
+		th->msg_iovlen = j - i;
+		if (j - i > 1) {
+			struct cmsghdr *cm;
+			__u16 gso_size = (__u16)seg;
+
+			th->msg_control = ring->ctrl + nr * MSG_RING_CTRL_SIZE;
+			th->msg_controllen = CMSG_SPACE(sizeof(gso_size));
+			cm = CMSG_FIRSTHDR(th);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(gso_size));
+			memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+		} else {
+			th->msg_control = NULL;
+			th->msg_controllen = 0;
+		}
+		nr++;
+		i = j;
+	}
+
+	return nr;
+}
+#endif
+
+/**
+ * Messages to send the datagrams queued from 'start' on with, as trains
+ * when offloaded. Returns the number of messages.
+ */
+unsigned msg_ring_messages(struct msg_ring *ring, unsigned start,
+		struct mmsghdr **msgs)
+{
+#ifdef __linux__
+	if (ring->gso_max) {
+		*msgs = ring->trains;
+		return msg_ring_build_trains(ring, start);
+	}
+#endif
+	*msgs = ring->msgs + start;
+	return ring->count - start;
+}
+
+/**
+ * Called when a message failed with 'err'. If it was a train the kernel
+ * cannot segment (EIO: no checksum offload, EINVAL: larger than the path
+ * MTU), stop building trains of that size and return true.
+ */
+bool msg_ring_gso_failed(struct msg_ring *ring, const struct msghdr *mh, int err)
+{
+	if (mh->msg_iovlen < 2 || (err != EIO && err != EINVAL && err != EMSGSIZE))
+		return false;
+	ring->gso_max = err == EIO ? 0 : mh->msg_iov->iov_len - 1;
+	return true;
+}
+
+/**
+ * Flush all queued datagrams. A datagram that is refused is skipped,
+ * while the remaining ones are dropped once the socket buffer is full.
+ * With offloads, runs of datagrams go out as trains, a train that fails
+ * is sent again as separate datagrams. Returns the number sent.
+ */
+int msg_ring_send(int sockfd, struct msg_ring *ring)
+{
+	unsigned done = 0, sent = 0, nr, i;
+	struct mmsghdr *msgs;
+	int rc;
+
+	while (done < ring->count) {
+		nr = msg_ring_messages(ring, done, &msgs);
+		rc = sendmmsg(sockfd, msgs, nr, MSG_DONTWAIT);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				break;
+			if (msg_ring_gso_failed(ring, &msgs->msg_hdr, errno))
+				continue;
+			done += msgs->msg_hdr.msg_iovlen;
+			continue;
+		}
+		for (i = 0; i < (unsigned)rc; i++) {
+			done += msgs[i].msg_hdr.msg_iovlen;
+			sent += msgs[i].msg_hdr.msg_iovlen;
+		}
+	}
+	ring->count = 0;
+
+	return (int)sent;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+/**
+ * Internet checksum arithmetic on words as they are laid out in memory,
+ * which gives the right result in either byte order. Only the last
+ * block summed may have an odd length.
+ */
+__u64 csum_add(__u64 sum, const void *data, size_t len)
+{
+	const __u8 *p = data;
+	__u32 w32;
+	__u16 w16;
+
+	for (; len >= 4; p += 4, len -= 4) {
+		memcpy(&w32, p, 4);
+		sum += w32;
+	}
+	if (len >= 2) {
+		memcpy(&w16, p, 2);
+		sum += w16;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		__u8 tail[2] = { *p, 0 };
+		memcpy(&w16, tail, 2);
+		sum += w16;
+	}
+	return sum;
+}
+
+__u16 csum_fold(__u64 sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (__u16)sum;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+static int obj_pool_grow(struct obj_pool *pool, unsigned nr)
+{
+	char *slab;
+	unsigned i;
+
+	if (posix_memalign((void **)&slab, CACHE_LINE_SIZE, pool->obj_size * nr))
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		void **obj = (void **)(slab + i * pool->obj_size);
+		*obj = pool->free_list;
+		pool->free_list = obj;
+	}
+	pool->nr_objs += nr;
+
+	return 0;
+}
+
+int obj_pool_init(struct obj_pool *pool, size_t obj_size, unsigned limit)
+{
+	memset(pool, 0x0, sizeof(*pool));
+	pool->obj_size = (obj_size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+	pool->limit = limit;
+
+	if (limit)
+		return obj_pool_grow(pool, limit);
+	return obj_pool_grow(pool, OBJ_POOL_SLAB_OBJS);
+}
+
+/* Returns NULL with errno set to ENOSPC if the limit is reached */
+void *obj_pool_alloc(struct obj_pool *pool)
+{
+	void **obj;
+
+	if (pool->free_list == NULL) {
+		if (pool->limit) {
+			errno = ENOSPC;
+			return NULL;
+		}
+		if (obj_pool_grow(pool, OBJ_POOL_SLAB_OBJS) < 0) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	obj = pool->free_list;
+	pool->free_list = *obj;
+	pool->nr_used++;
+
+	return obj;
+}
+
+void obj_pool_free(struct obj_pool *pool, void *obj)
+{
+	assert(pool->nr_used > 0);
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+	pool->nr_used--;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+void replay_window_init(struct replay_window *rw)
+{
+	memset(rw, 0x0, sizeof(*rw));
+	pthread_mutex_init(&rw->lock, NULL);
+}
+
+/* Start over with the next number received, keeping the counters */
+void replay_window_reset(struct replay_window *rw)
+{
+	pthread_mutex_lock(&rw->lock);
+	rw->top = 0;
+	rw->stamped = false;
+	pthread_mutex_unlock(&rw->lock);
+}
+
+void replay_window_destroy(struct replay_window *rw)
+{
+	pthread_mutex_destroy(&rw->lock);
+}
+
+/* Mark 'seq' as received, with the lock held. Returns false if it was before. */
+static bool replay_window_mark(struct replay_window *rw, __u64 seq)
+{
+	__u64 word = seq / 64, top_word = rw->top / 64, bit = 1ULL << (seq % 64), i;
+
+	if (rw->top == 0 || (seq > rw->top && seq - rw->top > REPLAY_WINDOW_SPAN)) {
+		/* Whatever came before the first one is not expected. */
+		if (rw->top)
+			rw->lost += seq - rw->top - 1; /* too many to wait for */
+		for (i = 0; i < REPLAY_WINDOW_WORDS; i++)
+			rw->bitmap[i] = ~0ULL;
+		rw->bitmap[word % REPLAY_WINDOW_WORDS] = bit - 1;
+		rw->top = seq;
+	} else if (seq > rw->top) {
+		/* Slide forward, clearing the words taken over. */
+		for (i = top_word + 1; i <= word; i++)
+			rw->bitmap[i % REPLAY_WINDOW_WORDS] = 0;
+		rw->lost += seq - rw->top - 1;
+		rw->top = seq;
+	} else if (top_word - word >= REPLAY_WINDOW_WORDS) {
+		return false;
+	}
+
+	if (rw->bitmap[word % REPLAY_WINDOW_WORDS] & bit)
+		return false;
+	rw->bitmap[word % REPLAY_WINDOW_WORDS] |= bit;
+	rw->received++;
+	if (seq < rw->top) {
+		rw->lost--;
+		rw->reordered++;
+		if (rw->top - seq > rw->reorder_depth)
+			rw->reorder_depth = rw->top - seq;
+	}
+	return true;
+}
+
+/* Smooth the variation of the transit time of a stamped datagram, lock held */
+static void replay_window_transit(struct replay_window *rw, __u32 stamp)
+{
+	__u32 transit = replay_stamp() - stamp;
+	__s64 d = (__s32)(transit - rw->transit);
+
+	if (rw->stamped)
+		rw->jitter += ((d < 0 ? -d : d) - (__s64)rw->jitter) / 16;
+	rw->transit = transit;
+	rw->stamped = true;
+}
+
+/**
+ * Mark 'seq' as received, sent at 'stamp' by replay_stamp() of the peer
+ * or 0 if unknown. Returns false if it was before, or is too old to tell,
+ * for the datagram to be dropped.
+ */
+bool replay_window_check(struct replay_window *rw, __u64 seq, __u32 stamp)
+{
+	bool fresh;
+
+	if (seq == 0)
+		return false;
+
+	pthread_mutex_lock(&rw->lock);
+	if ((fresh = replay_window_mark(rw, seq))) {
+		if (stamp)
+			replay_window_transit(rw, stamp);
+	} else {
+		rw->replayed++;
+	}
+	pthread_mutex_unlock(&rw->lock);
+	return fresh;
+}
+
+/* Deepest a datagram came late since the last call, in numbers */
+__u64 replay_window_take_depth(struct replay_window *rw)
+{
+	__u64 depth;
+
+	pthread_mutex_lock(&rw->lock);
+	depth = rw->reorder_depth;
+	rw->reorder_depth = 0;
+	pthread_mutex_unlock(&rw->lock);
+	return depth;
+}
+
+/* Start over with the next number received, keeping the counters */
+void seq_track_reset(struct seq_track_head *h)
+{
+	__atomic_store_n(&h->head, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->unnumbered, false, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->gen, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Mark a datagram numbered as 'seq' received by the worker of 't'. One
+ * far behind the head is taken for the numbering having jumped ahead.
+ * Older senders numbered after the encryption, leaving 0 on the wire,
+ * which is skipped; one far from the head stops tracking until the next
+ * reset.
+ */
+void seq_track_mark(struct seq_track_head *h, struct seq_track *t, __u16 seq)
+{
+	unsigned gen = __atomic_load_n(&h->gen, __ATOMIC_ACQUIRE);
+	__u64 head = __atomic_load_n(&h->head, __ATOMIC_RELAXED), wide;
+
+	if (__atomic_load_n(&h->unnumbered, __ATOMIC_RELAXED))
+		return;
+	wide = head + (__s16)(seq - (__u16)head);
+	if (seq == 0) {
+		if (head && (wide > head ? wide - head : head - wide) > REPLAY_WINDOW_SPAN)
+			__atomic_store_n(&h->unnumbered, true, __ATOMIC_RELAXED);
+		return;
+	}
+	if (t->gen != gen) {
+		__atomic_store_n(&t->top, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->gen, gen, __ATOMIC_RELAXED);
+	}
+	if (head == 0) {
+		/* The first of the numbering, unless another worker was quicker */
+		wide = 1ULL << 16 | seq;
+		if (!__atomic_compare_exchange_n(&h->head, &head, wide, false,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			wide = head + (__s16)(seq - (__u16)head);
+	} else if (wide + REPLAY_WINDOW_SPAN <= head) {
+		wide += 1 << 16;
+	}
+
+	if (wide > t->top) {
+		__atomic_store_n(&t->top, wide, __ATOMIC_RELAXED);
+		while (wide >= head + SEQ_TRACK_STRIDE && !__atomic_compare_exchange_n(&h->head,
+				&head, wide, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	} else if (wide < t->top) {
+		__atomic_store_n(&t->reordered, t->reordered + 1, __ATOMIC_RELAXED);
+		if (t->top - wide > __atomic_load_n(&t->reorder_depth, __ATOMIC_RELAXED))
+			__atomic_store_n(&t->reorder_depth, t->top - wide, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&t->received, t->received + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sum the counters of the 'nr' workers into those of 'rw', which is not
+ * checked against meanwhile. Numbers skipped by all workers count as lost,
+ * but for the 0 the peer skips when its 16 bits wrap.
+ */
+void seq_track_sum(struct seq_track_head *h, struct seq_track *tracks, unsigned nr,
+		struct replay_window *rw)
+{
+	unsigned gen = __atomic_load_n(&h->gen, __ATOMIC_ACQUIRE), i;
+	__u64 top = 0, received = 0, reordered = 0, depth = 0, span, lost;
+
+	if (__atomic_load_n(&h->unnumbered, __ATOMIC_RELAXED))
+		return;
+	for (i = 0; i < nr; i++) {
+		struct seq_track *t = &tracks[i];
+		__u64 v;
+
+		if (__atomic_load_n(&t->gen, __ATOMIC_RELAXED) == gen &&
+			(v = __atomic_load_n(&t->top, __ATOMIC_RELAXED)) > top)
+			top = v;
+		received += __atomic_load_n(&t->received, __ATOMIC_RELAXED);
+		reordered += __atomic_load_n(&t->reordered, __ATOMIC_RELAXED);
+		if ((v = __atomic_exchange_n(&t->reorder_depth, 0, __ATOMIC_RELAXED)) > depth)
+			depth = v;
+	}
+
+	pthread_mutex_lock(&rw->lock);
+	if (h->base_gen != gen || h->base_top == 0) {
+		/* Counted from the first sum of a numbering on */
+		h->base_gen = gen;
+		h->base_top = top;
+		h->base_received = received;
+		h->base_lost = rw->lost;
+	} else {
+		span = top - h->base_top - ((top >> 16) - (h->base_top >> 16));
+		lost = received - h->base_received;
+		rw->lost = h->base_lost + (span > lost ? span - lost : 0);
+	}
+	rw->received = received;
+	rw->reordered = reordered;
+	if (depth > rw->reorder_depth)
+		rw->reorder_depth = depth;
+	pthread_mutex_unlock(&rw->lock);
+}
+
 void ip_addr_add_ipv4(const char *ifname, struct in_addr *local,
 		struct in_addr *peer, int prefix)
 {
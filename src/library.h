@@ -9,11 +9,14 @@
 
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stddef.h>
 #include <fcntl.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 
 typedef uint32_t __be32;
 typedef uint16_t __be16;
@@ -101,8 +104,9 @@ static inline bool is_sockaddr_equal(const struct sockaddr_inx *a1,
 
 int get_sockaddr_inx_pair(const char *pair, struct sockaddr_inx *sa,
 		bool *is_random_port);
-int resolve_and_connect(const char *peer_addr_pair, struct sockaddr_inx *peer_addr);
-int tun_alloc(char *dev, bool tap_mode);
+int resolve_and_connect(const char *peer_addr_pair, const char *local,
+		struct sockaddr_inx *peer_addr);
+int tun_alloc(char *dev, bool tap_mode, bool multi_queue, bool offload);
 
 void ip_addr_add_ipv4(const char *ifname, struct in_addr *local,
 		struct in_addr *peer, int prefix);
@@ -184,23 +188,188 @@ static inline bool is_valid_unicast_mac(struct mac_addr *mac)
 	#define osx_ether_to_af(x)
 #endif
 
+#if defined(__APPLE__)
+	/* Batched socket I/O, emulated with one syscall per datagram */
+	struct mmsghdr {
+		struct msghdr msg_hdr;
+		unsigned int msg_len;
+	};
+	int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags, struct timespec *timeout);
+	int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags);
+#endif
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+/**
+ * Pre-allocated datagram buffers for receiving a batch of datagrams
+ * with one recvmmsg() call, or queuing datagrams (count) to be flushed
+ * with one sendmmsg() call. Each buffer has head and tail room so that
+ * datagrams can be encrypted or decrypted in place.
+ */
+#define MSG_RING_HEADROOM  32
+#define MSG_RING_TAILROOM  32
+
+struct msg_ring {
+	unsigned size;
+	unsigned count;
+	size_t buf_size;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct sockaddr_inx *addrs;
+	char *bufs;
+
+	/* UDP offloads, see msg_ring_enable_offload() */
+	size_t gso_max; /* largest datagram sent in a GSO train, 0 if off */
+	struct mmsghdr *trains;
+	char *ctrl;
+};
+
+int msg_ring_init(struct msg_ring *ring, unsigned size, size_t buf_size);
+int msg_ring_enable_offload(struct msg_ring *ring);
+int msg_ring_recv(int sockfd, struct msg_ring *ring);
+int msg_ring_send(int sockfd, struct msg_ring *ring);
+unsigned msg_ring_messages(struct msg_ring *ring, unsigned start,
+		struct mmsghdr **msgs);
+bool msg_ring_gso_failed(struct msg_ring *ring, const struct msghdr *mh, int err);
+size_t msg_ring_segment_size(struct msg_ring *ring, unsigned i);
+int udp_set_offload(int sockfd);
+
+static inline void *msg_ring_slot(struct msg_ring *ring, unsigned i)
+{
+	return ring->bufs + i * (MSG_RING_HEADROOM + ring->buf_size +
+			MSG_RING_TAILROOM) + MSG_RING_HEADROOM;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+/* Internet checksum: sum blocks with csum_add(), then ~csum_fold() */
+__u64 csum_add(__u64 sum, const void *data, size_t len);
+__u16 csum_fold(__u64 sum);
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+/**
+ * Pool of fixed-size objects, each aligned to a cache line. Objects are
+ * carved from slabs and recycled through a free list, slabs are never
+ * returned. With a limit, all slabs are allocated up front and no more
+ * than 'limit' objects can be in use. Not thread safe.
+ */
+#define CACHE_LINE_SIZE  64
+#define OBJ_POOL_SLAB_OBJS  64
+
+struct obj_pool {
+	size_t obj_size;
+	unsigned limit;
+	unsigned nr_objs;
+	unsigned nr_used;
+	void *free_list;
+};
+
+int obj_pool_init(struct obj_pool *pool, size_t obj_size, unsigned limit);
+void *obj_pool_alloc(struct obj_pool *pool);
+void obj_pool_free(struct obj_pool *pool, void *obj);
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+/**
+ * Sliding window over the 64-bit sequence numbers received from a peer,
+ * telling replayed or duplicated datagrams from new ones, after RFC 6479.
+ * Numbers skipped over count as lost until they turn up late, which
+ * counts them as reordered, and those a jump beyond the window skips
+ * count as lost for good. Thread safe.
+ */
+#define REPLAY_WINDOW_WORDS  32 /* of 64 bits, at least 1984 numbers back */
+#define REPLAY_WINDOW_SPAN  (REPLAY_WINDOW_WORDS * 64)
+
+struct replay_window {
+	pthread_mutex_t lock;
+	__u64 top; /* highest number accepted, 0 before the first */
+	__u64 bitmap[REPLAY_WINDOW_WORDS];
+	__u64 received;
+	__u64 lost;
+	__u64 reordered;
+	__u64 replayed; /* also those too old for the window */
+	__u64 reorder_depth; /* deepest since replay_window_take_depth() */
+	__u64 jitter; /* of the transit time in microseconds, after RFC 3550 */
+	__u32 transit; /* of the last stamped datagram */
+	bool stamped;
+};
+
+/* Microseconds of the monotonic clock, wrapping, as stamped by senders */
+static inline __u32 replay_stamp(void)
+{
+	struct timespec ts;
+	__u32 us;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	us = (__u32)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	return us ? us : 1;
+}
+
+void replay_window_init(struct replay_window *rw);
+void replay_window_reset(struct replay_window *rw);
+void replay_window_destroy(struct replay_window *rw);
+bool replay_window_check(struct replay_window *rw, __u64 seq, __u32 stamp);
+__u64 replay_window_take_depth(struct replay_window *rw);
+
+/**
+ * Loss counters of a peer that numbers its datagrams by 16 bits, kept by
+ * each worker receiving them in a 'struct seq_track' of its own, without
+ * a lock, and summed up now and then by seq_track_sum(). The numbers are
+ * widened around the head the workers share, which they move on every
+ * SEQ_TRACK_STRIDE numbers. Duplicates are not told apart, and those
+ * late to another worker count neither as reordered nor as lost.
+ */
+#define SEQ_TRACK_STRIDE  1024
+
+struct seq_track_head {
+	__u64 head; /* a widened number lately received, 0 before the first */
+	unsigned gen; /* of the numbering, bumped by seq_track_reset() */
+	bool unnumbered; /* the peer numbers nothing */
+	/* Where the numbering started, by seq_track_sum() alone */
+	unsigned base_gen;
+	__u64 base_top, base_received, base_lost;
+};
+
+struct seq_track {
+	__u64 top; /* highest widened number of the worker, 0 before the first */
+	__u64 received;
+	__u64 reordered;
+	__u64 reorder_depth; /* deepest since the last seq_track_sum() */
+	unsigned gen;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+void seq_track_reset(struct seq_track_head *h);
+void seq_track_mark(struct seq_track_head *h, struct seq_track *t, __u16 seq);
+void seq_track_sum(struct seq_track_head *h, struct seq_track *tracks, unsigned nr,
+		struct replay_window *rw);
+
 /* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
 
 #define CRYPTO_DEFAULT_ALGORITHM  "aes-128"
 #define CRYPTO_MAX_KEY_SIZE  32
 #define CRYPTO_MAX_BLOCK_SIZE  32
+#define CRYPTO_AEAD_NONCE_LEN  12
+#define CRYPTO_AEAD_TAG_LEN  16
 
 struct name_cipher_pair {
 	const char *name;
 	const void *cipher;
 };
 
+struct crypto_context;
+
 extern struct name_cipher_pair cipher_pairs[];
 const void *get_crypto_type(const char *name);
-void datagram_encrypt(const void *key, const void *cptype, void *in,
-		void *out, size_t *dlen);
-void datagram_decrypt(const void *key, const void *cptype, void *in,
-		void *out, size_t *dlen);
+struct crypto_context *crypto_init(const void *cptype, const void *key,
+		size_t auth_off, size_t auth_len);
+void crypto_free(struct crypto_context *c);
+bool crypto_is_aead(const struct crypto_context *c);
+size_t crypto_wire_shift(const struct crypto_context *c);
+void datagram_encrypt(struct crypto_context *c, void *in, void *out, size_t *dlen);
+int datagram_decrypt(struct crypto_context *c, void *in, void *out, size_t *dlen);
 void fill_with_string_md5sum(const char *in, void *out, size_t outlen);
 
 /* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
@@ -0,0 +1,629 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+/**
+ * Microbenchmarks of the datapath primitives: datagram encryption and
+ * decryption, error correction, replay windows and replays from other
+ * peers, client address hashing, client table lookups and route lookups.
+ * Built with "make microbench", not installed.
+ *
+ * The server internals are static, so server.c is compiled in here.
+ */
+#include "server.c"
+
+#include <time.h>
+#include <getopt.h>
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+#endif
+
+struct minivtun_config config = {
+	.ifname = "bench",
+	.crypto_passwd = "",
+	.reconnect_timeo = 47,
+	.nr_queues = 1,
+};
+
+struct state_variables state = {
+	.sockfd = -1,
+};
+
+int run_workers(void)
+{
+	return -1;
+}
+
+#define MAX_LIST_ITEMS  16
+
+/* Addresses looked up in turn, a power of 2 */
+#define NR_LOOKUP_KEYS  65536
+
+static unsigned long nr_ops = 1000000;
+
+/* Keeps the results of the measured calls alive */
+static volatile __u32 bench_sink;
+
+static __u64 clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Reference cycles of the time stamp counter, where there is one */
+static inline __u64 read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void report(const char *name, unsigned long ops, __u64 ns, __u64 cycles)
+{
+	if (cycles) {
+		printf("%-44s %10.1f %10.1f\n", name, (double)ns / ops, (double)cycles / ops);
+	} else {
+		printf("%-44s %10.1f %10s\n", name, (double)ns / ops, "-");
+	}
+}
+
+/**
+ * Run 'stmt' 'nr' times with 'i' counting, after a tenth of that to warm
+ * up the caches and branch predictors, and report the average cost.
+ */
+#define MEASURE(name, nr, i, stmt) \
+	do { \
+		__u64 __t0, __c0; \
+		for (i = 0; i < (nr) / 10 + 1; i++) { stmt; } \
+		__t0 = clock_ns(); \
+		__c0 = read_cycles(); \
+		for (i = 0; i < (nr); i++) { stmt; } \
+		report(name, nr, clock_ns() - __t0, read_cycles() - __c0); \
+	} while (0)
+
+static unsigned parse_list(const char *s, unsigned long *vals)
+{
+	unsigned n = 0;
+	char *ep;
+
+	while (*s && n < MAX_LIST_ITEMS) {
+		vals[n] = strtoul(s, &ep, 10);
+		if (ep == s || (*ep && *ep != ',') || vals[n] == 0) {
+			fprintf(stderr, "*** Invalid number list: %s.\n", s);
+			exit(1);
+		}
+		n++;
+		s = *ep ? ep + 1 : ep;
+	}
+	return n;
+}
+
+/* Tables only grow between the rounds, so take the counts in order */
+static void sort_list(unsigned long *vals, unsigned n)
+{
+	unsigned i, j;
+
+	for (i = 1; i < n; i++) {
+		unsigned long v = vals[i];
+		for (j = i; j > 0 && vals[j - 1] > v; j--)
+			vals[j] = vals[j - 1];
+		vals[j] = v;
+	}
+}
+
+static void bench_crypto(const unsigned long *sizes, unsigned nr_sizes)
+{
+	static char plain[sizeof(struct minivtun_msg) + MSG_RING_TAILROOM];
+	static char cipher[sizeof(struct minivtun_msg) + MSG_RING_TAILROOM];
+	static char out[sizeof(struct minivtun_msg) + MSG_RING_HEADROOM];
+	struct crypto_context *c;
+	const void *cptype;
+	unsigned long i;
+	unsigned k, s;
+	size_t dlen, clen;
+	char name[64];
+
+	fill_with_string_md5sum("minivtun-bench", config.crypto_key, CRYPTO_MAX_KEY_SIZE);
+
+	for (k = 0; cipher_pairs[k].name; k++) {
+		if (!(cptype = get_crypto_type(cipher_pairs[k].name)) ||
+			!(c = crypto_init(cptype, config.crypto_key,
+				offsetof(struct minivtun_msg, hdr.auth_key),
+				sizeof(((struct minivtun_msg *)0)->hdr.auth_key)))) {
+			printf("%-44s %10s\n", cipher_pairs[k].name, "n/a");
+			continue;
+		}
+
+		for (s = 0; s < nr_sizes; s++) {
+			size_t msg_len = MINIVTUN_MSG_IPDATA_OFFSET + sizes[s];
+
+			if (sizes[s] > NM_PI_BUFFER_SIZE)
+				continue;
+
+			memset(plain, 0x5a, sizeof(plain));
+
+			/* In place, as the send path does */
+			snprintf(name, sizeof(name), "datagram_encrypt %s %lu", cipher_pairs[k].name, sizes[s]);
+			MEASURE(name, nr_ops, i, {
+				dlen = msg_len;
+				datagram_encrypt(c, plain, plain + crypto_wire_shift(c), &dlen);
+			});
+
+			/* From a kept copy, as decrypting in place destroys the input */
+			memset(plain, 0x5a, sizeof(plain));
+			clen = msg_len;
+			datagram_encrypt(c, plain, cipher, &clen);
+			snprintf(name, sizeof(name), "datagram_decrypt %s %lu", cipher_pairs[k].name, sizes[s]);
+			MEASURE(name, nr_ops, i, {
+				dlen = clen;
+				bench_sink += datagram_decrypt(c, cipher, out, &dlen);
+			});
+		}
+
+		crypto_free(c);
+	}
+}
+
+/* Data and parity shards in the measured groups, as '--fec 16/2' */
+#define BENCH_FEC_K  16
+#define BENCH_FEC_M  2
+
+/**
+ * Error correction cost for each data shard: encoding with the parity of
+ * its group, and decoding groups which lost as many shards as they have
+ * parity, rebuilding those.
+ */
+static void bench_fec(const unsigned long *sizes, unsigned nr_sizes)
+{
+	static char shards[BENCH_FEC_K][FEC_SYMBOL_MAX];
+	static char parity[BENCH_FEC_M][FEC_SYMBOL_MAX];
+	static struct fec_recovered rec;
+	struct fec_trailer tr[BENCH_FEC_K], ptr[BENCH_FEC_M];
+	struct fec_encoder *enc = fec_encoder_new(0);
+	struct fec_decoder *dec = fec_decoder_new();
+	struct fec_trailer t;
+	unsigned long i;
+	unsigned s, j;
+	char name[64];
+
+	if (!enc || !dec) {
+		fprintf(stderr, "*** Cannot allocate FEC state.\n");
+		exit(1);
+	}
+
+	for (s = 0; s < nr_sizes; s++) {
+		size_t len = 4 + sizes[s];
+
+		if (len > FEC_SHARD_MAX)
+			continue;
+		memset(shards, 0x5a, sizeof(shards));
+
+		snprintf(name, sizeof(name), "fec_encode %u+%u %lu", BENCH_FEC_K, BENCH_FEC_M, sizes[s]);
+		MEASURE(name, nr_ops, i, {
+			if (fec_encode(enc, shards[i % BENCH_FEC_K], len, BENCH_FEC_K, BENCH_FEC_M, &t)) {
+				for (j = 0; j < BENCH_FEC_M; j++)
+					fec_encode_parity(enc, j, parity[j], &t);
+				fec_encoder_close(enc);
+			}
+		});
+
+		/* One group, renumbered as it is fed again */
+		fec_encoder_close(enc);
+		for (j = 0; j < BENCH_FEC_K; j++)
+			fec_encode(enc, shards[j], len, BENCH_FEC_K, BENCH_FEC_M, &tr[j]);
+		for (j = 0; j < BENCH_FEC_M; j++)
+			fec_encode_parity(enc, j, parity[j], &ptr[j]);
+		fec_encoder_close(enc);
+
+		snprintf(name, sizeof(name), "fec_decode %u+%u %lu, %u lost", BENCH_FEC_K,
+				BENCH_FEC_M, sizes[s], BENCH_FEC_M);
+		MEASURE(name, nr_ops, i, {
+			unsigned n = i % BENCH_FEC_K;
+			__be32 group = htonl(s << 24 | (__u32)(i / BENCH_FEC_K));
+			if (n >= BENCH_FEC_M) {
+				tr[n].group = group;
+				bench_sink += fec_decode(dec, false, &tr[n], shards[n], &rec);
+			}
+			if (n == BENCH_FEC_K - 1) {
+				for (j = 0; j < BENCH_FEC_M; j++) {
+					ptr[j].group = group;
+					bench_sink += fec_decode(dec, true, &ptr[j], parity[j], &rec);
+				}
+				bench_sink += rec.nr;
+			}
+		});
+	}
+
+	fec_encoder_free(enc);
+	fec_decoder_free(dec);
+}
+
+/**
+ * Sequence numbers in order, swapped in pairs, each twice, in order with
+ * a time stamp for the jitter, and by 16 bits for the counters alone
+ */
+static void bench_replay(void)
+{
+	static struct replay_window rw;
+	static struct seq_track_head head;
+	static struct seq_track track;
+	__u64 seq = (__u64)1 << 32;
+	__u32 stamp = replay_stamp();
+	unsigned long i;
+
+	replay_window_init(&rw);
+	MEASURE("replay_window_check in order", nr_ops, i,
+			bench_sink += replay_window_check(&rw, ++seq, 0));
+	MEASURE("replay_window_check reordered", nr_ops, i,
+			bench_sink += replay_window_check(&rw, ++seq ^ 1, 0));
+	seq *= 2;
+	MEASURE("replay_window_check duplicated", nr_ops, i,
+			bench_sink += replay_window_check(&rw, ++seq / 2, 0));
+	seq *= 2;
+	MEASURE("replay_window_check stamped", nr_ops, i,
+			bench_sink += replay_window_check(&rw, ++seq, stamp));
+	MEASURE("seq_track_mark", nr_ops, i,
+			seq_track_mark(&head, &track, (__u16)++seq));
+	seq_track_sum(&head, &track, 1, &rw);
+	bench_sink += rw.lost + rw.replayed;
+	replay_window_destroy(&rw);
+}
+
+static void bench_hash(void)
+{
+	struct sockaddr_inx ra4[256], ra6[256];
+	struct tun_addr va4[256], va6[256];
+	unsigned long i;
+
+	for (i = 0; i < 256; i++) {
+		memset(&ra4[i], 0x0, sizeof(ra4[i]));
+		ra4[i].in.sin_family = AF_INET;
+		ra4[i].in.sin_addr.s_addr = htonl(0xc0a80000 + rand() % 65536);
+		ra4[i].in.sin_port = htons(1024 + rand() % 60000);
+		memset(&ra6[i], 0x0, sizeof(ra6[i]));
+		ra6[i].in6.sin6_family = AF_INET6;
+		ra6[i].in6.sin6_addr.s6_addr[0] = 0x20;
+		ra6[i].in6.sin6_addr.s6_addr[1] = 0x01;
+		ra6[i].in6.sin6_addr.s6_addr32[3] = rand();
+		ra6[i].in6.sin6_port = htons(1024 + rand() % 60000);
+
+		memset(&va4[i], 0x0, sizeof(va4[i]));
+		va4[i].af = AF_INET;
+		va4[i].in.s_addr = htonl(0x0a000000 + rand() % 65536);
+		memset(&va6[i], 0x0, sizeof(va6[i]));
+		va6[i].af = AF_INET6;
+		va6[i].in6 = ra6[i].in6.sin6_addr;
+	}
+
+	MEASURE("real_addr_hash ipv4", nr_ops, i, bench_sink += real_addr_hash(&ra4[i & 255]));
+	MEASURE("real_addr_hash ipv6", nr_ops, i, bench_sink += real_addr_hash(&ra6[i & 255]));
+	MEASURE("tun_addr_hash ipv4", nr_ops, i, bench_sink += tun_addr_hash(&va4[i & 255]));
+	MEASURE("tun_addr_hash ipv6", nr_ops, i, bench_sink += tun_addr_hash(&va6[i & 255]));
+}
+
+static void bench_clients(const unsigned long *counts, unsigned nr_counts)
+{
+	struct tun_addr *hits, *misses, vaddr;
+	struct sockaddr_inx raddr;
+	struct tun_client *ce;
+	unsigned long i, nr = 0;
+	unsigned k;
+	char name[64];
+
+	hits = malloc(sizeof(struct tun_addr) * NR_LOOKUP_KEYS);
+	misses = malloc(sizeof(struct tun_addr) * NR_LOOKUP_KEYS);
+	assert(hits && misses);
+
+	/* The table grows from here, as it would with clients coming in */
+	if (init_va_ra_maps(16, 0) < 0) {
+		fprintf(stderr, "*** Cannot allocate client tables.\n");
+		exit(1);
+	}
+
+	memset(&vaddr, 0x0, sizeof(vaddr));
+	vaddr.af = AF_INET;
+
+	for (k = 0; k < nr_counts; k++) {
+		/* Clients 10.0.0.0 onwards, each behind a real address of its own */
+		for (i = nr; i < counts[k]; i++) {
+			vaddr.in.s_addr = htonl(0x0a000000 + i);
+			memset(&raddr, 0x0, sizeof(raddr));
+			raddr.in.sin_family = AF_INET;
+			raddr.in.sin_addr.s_addr = htonl(0xc0000000 + i);
+			raddr.in.sin_port = htons(1414);
+			ce = tun_client_get_or_create(&vaddr, &raddr, 0);
+			assert(ce);
+		}
+		if (counts[k] > nr)
+			nr = counts[k];
+		/* Measure the steady state, not a table half way through growing */
+		hash_table_rehash(&va_map, ~0u);
+		hash_table_rehash(&ra_set, ~0u);
+
+		/* Random picks, so that lookups do not walk memory linearly */
+		for (i = 0; i < NR_LOOKUP_KEYS; i++) {
+			hits[i] = vaddr;
+			hits[i].in.s_addr = htonl(0x0a000000 + (unsigned long)rand() % counts[k]);
+			misses[i] = vaddr;
+			misses[i].in.s_addr = htonl(0x0b000000 + (unsigned long)rand() % counts[k]);
+		}
+
+		snprintf(name, sizeof(name), "tun_client_try_get hit %lu", counts[k]);
+		MEASURE(name, nr_ops, i,
+			bench_sink += (tun_client_try_get(&hits[i & (NR_LOOKUP_KEYS - 1)]) != NULL));
+		snprintf(name, sizeof(name), "tun_client_try_get miss %lu", counts[k]);
+		MEASURE(name, nr_ops, i,
+			bench_sink += (tun_client_try_get(&misses[i & (NR_LOOKUP_KEYS - 1)]) != NULL));
+	}
+
+	free(hits);
+	free(misses);
+}
+
+/**
+ * Build a numbered IPDATA message from 10.9.0.1 over 'path' at 'buf',
+ * which has head room before it, returns its length.
+ */
+static size_t bench_client_datagram(char *buf, __u64 seq, unsigned path)
+{
+	char msg[MSG_RING_HEADROOM + MINIVTUN_MSG_IPDATA_OFFSET + 20];
+	struct minivtun_msg *nmsg = (void *)(msg + MSG_RING_HEADROOM);
+	size_t len = MINIVTUN_MSG_IPDATA_OFFSET + 20;
+
+	memset(msg, 0x0, sizeof(msg));
+	nmsg->hdr.opcode = MINIVTUN_MSG_IPDATA;
+	nmsg->hdr.seq = htons(seq);
+	memcpy(nmsg->hdr.auth_key, config.crypto_key, sizeof(nmsg->hdr.auth_key));
+	nmsg->ipdata.proto = htons(ETH_P_IP);
+	nmsg->ipdata.ip_dlen = htons(20);
+	nmsg->ipdata.data[0] = 0x45;
+	nmsg->ipdata.data[12] = 10;
+	nmsg->ipdata.data[13] = 9;
+	nmsg->ipdata.data[15] = 1;
+	if (seq)
+		nmsg = netmsg_push_seq(nmsg, &len, seq, path);
+	memcpy(buf, nmsg, len);
+	return len;
+}
+
+/**
+ * Numbered datagrams of a client taken in, and the first of them replayed
+ * from another source port. The replay must neither get to the TUN queue
+ * nor move the client's virtual address, which is checked as well. Then
+ * the client sends over a second path along with the first, which must
+ * keep the real addresses of both. An unnumbered datagram from its host
+ * must be refused while it is up, and taken back once its paths have gone
+ * silent, as from the client restarted without '-W' on a new port.
+ */
+static void bench_replay_peer(void)
+{
+	static char buf[MSG_RING_HEADROOM + sizeof(struct minivtun_msg)];
+	static char first[sizeof(struct minivtun_msg)];
+	static struct worker w;
+	char *data = buf + MSG_RING_HEADROOM;
+	struct sockaddr_inx peer, replayer, second;
+	struct tun_addr vaddr;
+	struct tun_client *ce;
+	struct timeval now;
+	__u64 seq = initial_xmit_seq(), seq2 = seq, tun_tx, replayed;
+	unsigned long i;
+	size_t len;
+
+	if ((w.tunfd = open("/dev/null", O_WRONLY)) < 0 ||
+		(init_va_ra_maps(16, 0) < 0)) {
+		fprintf(stderr, "*** Cannot set up a worker.\n");
+		exit(1);
+	}
+	init_va_ra_lock();
+	gettimeofday(&now, NULL);
+
+	memset(&peer, 0x0, sizeof(peer));
+	peer.in.sin_family = AF_INET;
+	peer.in.sin_addr.s_addr = htonl(0xc6336401);
+	peer.in.sin_port = htons(40000);
+	replayer = peer;
+	replayer.in.sin_port = htons(40001);
+	second = peer;
+	second.in.sin_addr.s_addr = htonl(0xcb007101);
+	memset(&vaddr, 0x0, sizeof(vaddr));
+	vaddr.af = AF_INET;
+	vaddr.in.s_addr = htonl(0x0a090001);
+
+	len = bench_client_datagram(first, seq, 0);
+
+	pthread_rwlock_rdlock(&va_ra_lock);
+	MEASURE("handle_netmsg numbered", nr_ops, i, {
+		bench_client_datagram(data, ++seq, 0);
+		handle_netmsg(&w, data, len, &peer, &now);
+	});
+	tun_tx = w.stats.tun_tx_packets;
+	MEASURE("handle_netmsg replayed from another port", nr_ops, i, {
+		memcpy(data, first, len);
+		handle_netmsg(&w, data, len, &replayer, &now);
+	});
+	replayed = w.stats.drops[DROP_REPLAYED];
+	if (w.stats.tun_tx_packets != tun_tx || replayed != nr_ops + nr_ops / 10 + 1 ||
+		(ce = tun_client_try_get(&vaddr)) == NULL ||
+		!tun_client_at_path(ce, 0, &peer)) {
+		fprintf(stderr, "*** A replayed datagram was taken in.\n");
+		exit(1);
+	}
+	MEASURE("handle_netmsg over two paths", nr_ops, i, {
+		if (i & 1) {
+			bench_client_datagram(data, ++seq2, 1);
+			handle_netmsg(&w, data, len, &second, &now);
+		} else {
+			bench_client_datagram(data, ++seq, 0);
+			handle_netmsg(&w, data, len, &peer, &now);
+		}
+	});
+	pthread_rwlock_unlock(&va_ra_lock);
+
+	if (w.stats.drops[DROP_REPLAYED] != replayed ||
+		(ce = tun_client_try_get(&vaddr)) == NULL ||
+		!tun_client_at_path(ce, 0, &peer) || !tun_client_at_path(ce, 1, &second)) {
+		fprintf(stderr, "*** A path of the client was dropped or moved.\n");
+		exit(1);
+	}
+
+	pthread_rwlock_rdlock(&va_ra_lock);
+	len = bench_client_datagram(data, 0, 0);
+	handle_netmsg(&w, data, len, &replayer, &now);
+	pthread_rwlock_unlock(&va_ra_lock);
+	if (w.stats.drops[DROP_REPLAYED] != replayed + 1 ||
+		(ce = tun_client_try_get(&vaddr)) == NULL || !ce->numbered ||
+		!tun_client_at_path(ce, 0, &peer) || !tun_client_at_path(ce, 1, &second)) {
+		fprintf(stderr, "*** An unnumbered replay turned the client's numbering off.\n");
+		exit(1);
+	}
+
+	now.tv_sec += config.reconnect_timeo + 1;
+	pthread_rwlock_rdlock(&va_ra_lock);
+	len = bench_client_datagram(data, 0, 0);
+	handle_netmsg(&w, data, len, &replayer, &now);
+	pthread_rwlock_unlock(&va_ra_lock);
+	if ((ce = tun_client_try_get(&vaddr)) == NULL || ce->numbered ||
+		!tun_client_at_path(ce, 0, &replayer) || ce->paths[1]) {
+		fprintf(stderr, "*** The client restarted unnumbered was not taken back.\n");
+		exit(1);
+	}
+	close(w.tunfd);
+}
+
+static void bench_routes(const unsigned long *counts, unsigned nr_counts)
+{
+	struct vt_route **rts = NULL, *rt;
+	struct in_addr *dsts;
+	unsigned long i, nr = 0;
+	unsigned k;
+	char name[64];
+
+	dsts = malloc(sizeof(struct in_addr) * NR_LOOKUP_KEYS);
+	assert(dsts);
+
+	for (k = 0; k < nr_counts; k++) {
+		if (counts[k] > nr) {
+			rts = realloc(rts, sizeof(struct vt_route *) * counts[k]);
+			assert(rts);
+		}
+
+		/* Random IPv4 prefixes of /8 to /28, all via one gateway */
+		for (i = nr; i < counts[k]; i++) {
+			rt = calloc(1, sizeof(struct vt_route));
+			assert(rt);
+			rt->af = AF_INET;
+			rt->prefix = 8 + rand() % 21;
+			rt->network.in.s_addr = htonl(((__u32)rand() << 1) & (~0u << (32 - rt->prefix)));
+			rt->gateway.in.s_addr = htonl(0x0a000001);
+			rt->next = config.vt_routes;
+			config.vt_routes = rts[i] = rt;
+		}
+		if (counts[k] > nr)
+			nr = counts[k];
+
+		/* The tries are only ever built once, so the old ones leak here */
+		vt_route_trie4 = NULL;
+		init_vt_route_tries();
+
+		/* Half of the lookups go to a routed network */
+		for (i = 0; i < NR_LOOKUP_KEYS; i++) {
+			if (i & 1) {
+				dsts[i].s_addr = htonl(rand());
+			} else {
+				rt = rts[(unsigned long)rand() % counts[k]];
+				dsts[i].s_addr = rt->network.in.s_addr |
+						htonl(rand() & ~(~0u << (32 - rt->prefix)));
+			}
+		}
+
+		snprintf(name, sizeof(name), "vt_route_lookup %lu", counts[k]);
+		MEASURE(name, nr_ops, i,
+			bench_sink += (vt_route_lookup(AF_INET, &dsts[i & (NR_LOOKUP_KEYS - 1)]) != NULL));
+	}
+
+	free(dsts);
+	free(rts);
+}
+
+static void print_help(int argc, char *argv[])
+{
+	printf("Microbenchmarks of the minivtun datapath primitives\n");
+	printf("Usage:\n");
+	printf("  %s [options]\n", argv[0]);
+	printf("Options:\n");
+	printf("  -n, --ops <N>                       operations measured each, default: %lu\n", nr_ops);
+	printf("  -s, --sizes <N>[,<N>...]            IP packet sizes for the ciphers, default: 64,512,1400\n");
+	printf("  -c, --clients <N>[,<N>...]          client table sizes, default: 100,10000,100000\n");
+	printf("  -r, --routes <N>[,<N>...]           route counts, default: 10,1000,100000\n");
+	printf("  -h, --help                          print this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long sizes[MAX_LIST_ITEMS] = { 64, 512, 1400 };
+	unsigned long clients[MAX_LIST_ITEMS] = { 100, 10000, 100000 };
+	unsigned long routes[MAX_LIST_ITEMS] = { 10, 1000, 100000 };
+	unsigned nr_sizes = 3, nr_clients = 3, nr_routes = 3;
+	int opt;
+
+	static struct option long_opts[] = {
+		{ "ops", required_argument, 0, 'n', },
+		{ "sizes", required_argument, 0, 's', },
+		{ "clients", required_argument, 0, 'c', },
+		{ "routes", required_argument, 0, 'r', },
+		{ "help", no_argument, 0, 'h', },
+		{ 0, 0, 0, 0, },
+	};
+
+	while ((opt = getopt_long(argc, argv, "n:s:c:r:h", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_ops = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			nr_sizes = parse_list(optarg, sizes);
+			break;
+		case 'c':
+			nr_clients = parse_list(optarg, clients);
+			break;
+		case 'r':
+			nr_routes = parse_list(optarg, routes);
+			break;
+		case 'h':
+			print_help(argc, argv);
+			exit(0);
+			break;
+		case '?':
+			exit(1);
+		}
+	}
+	if (nr_ops == 0) {
+		fprintf(stderr, "*** Nothing to measure with '--ops 0'.\n");
+		exit(1);
+	}
+
+	sort_list(clients, nr_clients);
+	sort_list(routes, nr_routes);
+
+	srand(time(NULL));
+	hash_initval = rand();
+	/* Client creation is logged, which is not what is measured */
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	printf("%-44s %10s %10s\n", "primitive", "ns/op", "cycles/op");
+	bench_crypto(sizes, nr_sizes);
+	bench_fec(sizes, nr_sizes);
+	bench_replay();
+	bench_hash();
+	bench_clients(clients, nr_clients);
+	bench_replay_peer();
+	bench_routes(routes, nr_routes);
+
+	return 0;
+}
@@ -32,19 +32,65 @@ struct minivtun_config config = {
 	.reconnect_timeo = 47,
 	.max_droprate = 100,
 	.max_rtt = 0,
+	.standby_paths = false,
 	.keepalive_interval = 7,
 	.health_assess_interval = 60,
 	.nr_stats_buckets = 3,
 	.health_file = NULL,
 	.vt_metric = 0,
 	.vt_table = "",
+	.nr_queues = 1,
+	.reuseport = REUSEPORT_NONE,
+	.hash_size = 16,
+	.max_clients = 0,
+	.max_fec_clients = 64,
+	.stats_socket = NULL,
+	.drop_log_interval = 0,
+	.tun_offload = false,
+	.udp_offload = false,
+	.io_uring = false,
+	.xdp_ifname = NULL,
 };
 
 struct state_variables state = {
-	.tunfd = -1,
 	.sockfd = -1,
 };
 
+/* Run the datapath of a worker on io_uring if asked for and available */
+static int worker_run(struct worker *w)
+{
+	if (config.io_uring && uring_init(w) == 0)
+		return uring_run(w);
+	return event_loop_run(&w->loop);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+
+	if (worker_run(w) < 0)
+		exit(1);
+	return NULL;
+}
+
+/* Run the loops of all workers, the first one in the calling thread */
+int run_workers(void)
+{
+	unsigned i;
+	int rc;
+
+	for (i = 1; i < config.nr_queues; i++) {
+		struct worker *w = &state.workers[i];
+		if ((rc = pthread_create(&w->thread, NULL, worker_thread, w))) {
+			fprintf(stderr, "*** pthread_create() failed: %s.\n", strerror(rc));
+			exit(1);
+		}
+	}
+	state.workers[0].thread = pthread_self();
+
+	return worker_run(&state.workers[0]);
+}
+
 static void vt_route_add(short af, void *n, int prefix, void *g)
 {
 	union {
@@ -142,6 +188,21 @@ static void parse_virtual_route(const char *arg)
 	vt_route_add(af, &network, prefix, &gateway);
 }
 
+/* Parse the count given to option 'name', exits unless within 1~'max' */
+static unsigned long parse_count(const char *arg, const char *name, unsigned long max)
+{
+	unsigned long val;
+	char *endp;
+
+	errno = 0;
+	val = strtoul(arg, &endp, 10);
+	if (endp == arg || *endp || errno == ERANGE || val < 1 || val > max) {
+		fprintf(stderr, "*** Acceptable '--%s' values: 1~%lu.\n", name, max);
+		exit(1);
+	}
+	return val;
+}
+
 static void print_help(int argc, char *argv[])
 {
 	int i;
@@ -152,6 +213,7 @@ static void print_help(int argc, char *argv[])
 	printf("Options:\n");
 	printf("  -l, --local <ip:port>               local IP:port for server to listen\n");
 	printf("  -r, --remote <host:port>            host:port of server to connect (brace with [] for bare IPv6)\n");
+	printf("               <host:port@local>      connecting from a local IP or interface, repeat for multipath\n");
 	printf("  -n, --ifname <ifname>               virtual interface name\n");
 	printf("  -m, --mtu <mtu>                     set MTU size, default: %u.\n", config.tun_mtu);
 	printf("  -a, --ipv4-addr <tun_lip/tun_rip>   pointopoint IPv4 pair of the virtual interface\n");
@@ -170,11 +232,27 @@ static void print_help(int argc, char *argv[])
 	printf("  -x, --exit-after <N>                force the client to exit after N seconds\n");
 	printf("  -H, --health-file <file_path>       file for writing real-time health data\n");
 	printf("  -R, --reconnect-timeo <N>           maximum inactive time (seconds) before reconnect, default: %u\n", config.reconnect_timeo);
-	printf("  -K, --keepalive <N>                 seconds between keep-alive tests, default: %u\n", config.keepalive_interval);
+	printf("  -K, --keepalive <N>                 seconds between keep-alive tests of a single path, default: %u\n", config.keepalive_interval);
 	printf("  -S, --health-assess <N>             seconds between health assess, default: %u\n", config.health_assess_interval);
 	printf("  -B, --stats-buckets <N>             health data buckets, default: %u\n", config.nr_stats_buckets);
 	printf("  -P, --max-droprate <1~100>          maximum allowed packet drop percentage, default: %u%%\n", config.max_droprate);
 	printf("  -X, --max-rtt <N>                   maximum allowed echo delay (ms), default: unlimited\n");
+	printf("  -y, --standby                       keep the paths after the first as warm standbys rather than bonding them\n");
+	printf("  -f, --fec <K>[/<M>]                 add M or more parity packets, default: 1, to every K for rebuilding losses\n");
+	printf("  -W, --replay-window                 number datagrams by 64 bits both ways and drop replayed ones, implied by several paths\n");
+	printf("  -Q, --queues <N>                    TUN queues, each served by a thread, default: %u\n", config.nr_queues);
+	printf("  -U, --reuseport <hash|addr>         server socket for each queue, balanced by flow hash or client IP\n");
+	printf("  -b, --buckets <N>                   initial buckets of the server's client tables, default: %u\n", config.hash_size);
+	printf("  -C, --max-clients <N>               maximum real and virtual client addresses each, default: unlimited\n");
+	printf("  -k, --fec-clients <N>               maximum client addresses the server corrects errors of, default: %u\n", config.max_fec_clients);
+	printf("  -s, --stats-socket <path>           Unix socket dumping traffic counters, on request 'json' or 'prometheus'\n");
+	printf("  -L, --log-drops <N>                 log a summary of dropped packets at most every N seconds, default: off\n");
+	printf("  -O, --offload                       TUN checksum and TCP segmentation offloads, TUN mode only\n");
+	printf("  -G, --udp-offload                   send and receive datagrams in trains with UDP GSO and GRO\n");
+	printf("  -I, --io-uring                      run the datapath on io_uring, if the kernel supports it\n");
+	printf("  -F, --xdp <ifname>                  server: move datagrams through AF_XDP on this interface, bypassing the socket layer\n");
+	printf("  -z, --bench <size>[,<size>...]      run a loopback benchmark of every cipher with these packet sizes\n");
+	printf("  -N, --bench-packets <N>             packets sent for each cipher and size, default: 100000\n");
 	printf("  -h, --help                          print this help\n");
 	printf("Supported encryption algorithms:\n");
 	printf("  ");
@@ -186,9 +264,16 @@ static void print_help(int argc, char *argv[])
 int main(int argc, char *argv[])
 {
 	const char *tun_ip_config = NULL, *tun_ip6_config = NULL;
-	const char *loc_addr_pair = NULL, *peer_addr_pair = NULL;
+	const char *loc_addr_pair = NULL, *peer_addr_pairs[MAX_CLIENT_PATHS];
+	unsigned nr_peer_addrs = 0;
 	const char *crypto_type = CRYPTO_DEFAULT_ALGORITHM;
+	const char *bench_sizes = NULL;
+	unsigned long bench_packets = 100000;
 	int override_mtu = 0, opt;
+	unsigned long fec_data, fec_parity;
+	const char *fec_arg;
+	char *endp;
+	unsigned i;
 	struct timeval current;
 
 	static struct option long_opts[] = {
@@ -214,20 +299,41 @@ int main(int argc, char *argv[])
 		{ "health-file", required_argument, 0, 'H', },
 		{ "max-droprate", required_argument, 0, 'P', },
 		{ "max-rtt", required_argument, 0, 'X', },
+		{ "standby", no_argument, 0, 'y', },
+		{ "fec", required_argument, 0, 'f', },
+		{ "replay-window", no_argument, 0, 'W', },
 		{ "metric", required_argument, 0, 'M', },
 		{ "table", required_argument, 0, 'T', },
+		{ "queues", required_argument, 0, 'Q', },
+		{ "reuseport", required_argument, 0, 'U', },
+		{ "buckets", required_argument, 0, 'b', },
+		{ "max-clients", required_argument, 0, 'C', },
+		{ "fec-clients", required_argument, 0, 'k', },
+		{ "stats-socket", required_argument, 0, 's', },
+		{ "log-drops", required_argument, 0, 'L', },
+		{ "offload", no_argument, 0, 'O', },
+		{ "udp-offload", no_argument, 0, 'G', },
+		{ "io-uring", no_argument, 0, 'I', },
+		{ "xdp", required_argument, 0, 'F', },
+		{ "bench", required_argument, 0, 'z', },
+		{ "bench-packets", required_argument, 0, 'N', },
 		{ "help", no_argument, 0, 'h', },
 		{ 0, 0, 0, 0, },
 	};
 
-	while ((opt = getopt_long(argc, argv, "r:l:a:A:m:n:p:e:t:v:x:R:K:S:B:H:P:X:M:T:DEdwh",
+	while ((opt = getopt_long(argc, argv, "r:l:a:A:m:n:p:e:t:v:x:R:K:S:B:H:P:X:f:M:T:Q:U:b:C:k:s:L:z:N:F:OGIDEdwyWh",
 			long_opts, NULL)) != -1) {
 		switch (opt) {
 		case 'l':
 			loc_addr_pair = optarg;
 			break;
 		case 'r':
-			peer_addr_pair = optarg;
+			if (nr_peer_addrs == MAX_CLIENT_PATHS) {
+				fprintf(stderr, "*** No more than %u remote paths are supported.\n",
+						MAX_CLIENT_PATHS);
+				exit(1);
+			}
+			peer_addr_pairs[nr_peer_addrs++] = optarg;
 			break;
 		case 'a':
 			tun_ip_config = optarg;
@@ -294,6 +400,31 @@ int main(int argc, char *argv[])
 		case 'X':
 			config.max_rtt = strtoul(optarg, NULL, 10);
 			break;
+		case 'y':
+			config.standby_paths = true;
+			break;
+		case 'f':
+			/* '<data>' or '<data>/<parity>', each part all digits */
+			errno = 0;
+			fec_arg = optarg;
+			fec_data = strtoul(fec_arg, &endp, 10);
+			fec_parity = 1;
+			if (endp != fec_arg && *endp == '/') {
+				fec_arg = endp + 1;
+				fec_parity = strtoul(fec_arg, &endp, 10);
+			}
+			if (endp == fec_arg || *endp || errno == ERANGE || fec_data < 1 ||
+				fec_data > FEC_MAX_DATA || fec_parity > FEC_MAX_PARITY) {
+				fprintf(stderr, "*** Acceptable '--fec' values: 1~%u data, 0~%u parity.\n",
+						FEC_MAX_DATA, FEC_MAX_PARITY);
+				exit(1);
+			}
+			config.fec_data = fec_data;
+			config.fec_parity = fec_parity;
+			break;
+		case 'W':
+			config.replay_window = true;
+			break;
 		case 'M':
 			config.vt_metric = strtoul(optarg, NULL, 10);
 			break;
@@ -301,6 +432,55 @@ int main(int argc, char *argv[])
 			strncpy(config.vt_table, optarg, sizeof(config.vt_table));
 			config.vt_table[sizeof(config.vt_table) - 1] = '\0';
 			break;
+		case 'Q':
+			config.nr_queues = parse_count(optarg, "queues", MAX_TUN_QUEUES);
+			break;
+		case 'U':
+			if (strcmp(optarg, "hash") == 0) {
+				config.reuseport = REUSEPORT_HASH;
+			} else if (strcmp(optarg, "addr") == 0) {
+				config.reuseport = REUSEPORT_ADDR;
+			} else {
+				fprintf(stderr, "*** Acceptable '--reuseport' values: hash, addr.\n");
+				exit(1);
+			}
+			break;
+		case 'b':
+			config.hash_size = parse_count(optarg, "buckets", 1 << 20);
+			/* Round up to a power of 2 */
+			while (config.hash_size & (config.hash_size - 1))
+				config.hash_size += config.hash_size & -config.hash_size;
+			break;
+		case 'C':
+			config.max_clients = parse_count(optarg, "max-clients", 1 << 24);
+			break;
+		case 'k':
+			config.max_fec_clients = parse_count(optarg, "fec-clients", 4096);
+			break;
+		case 's':
+			config.stats_socket = optarg;
+			break;
+		case 'L':
+			config.drop_log_interval = parse_count(optarg, "log-drops", 86400);
+			break;
+		case 'O':
+			config.tun_offload = true;
+			break;
+		case 'G':
+			config.udp_offload = true;
+			break;
+		case 'I':
+			config.io_uring = true;
+			break;
+		case 'F':
+			config.xdp_ifname = optarg;
+			break;
+		case 'z':
+			bench_sizes = optarg;
+			break;
+		case 'N':
+			bench_packets = parse_count(optarg, "bench-packets", 1000000000);
+			break;
 		case 'h':
 			print_help(argc, argv);
 			exit(0);
@@ -310,6 +490,22 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (config.tun_offload && config.tap_mode) {
+		fprintf(stderr, "*** TUN offloads are not supported in TAP mode.\n");
+		exit(1);
+	}
+	if (config.xdp_ifname && !loc_addr_pair) {
+		fprintf(stderr, "*** AF_XDP is only supported by the server.\n");
+		exit(1);
+	}
+	if (config.io_uring && nr_peer_addrs > 1) {
+		fprintf(stderr, "*** io_uring is not supported with several paths.\n");
+		exit(1);
+	}
+	/* The server tells the paths of a client apart by their numbers. */
+	if (nr_peer_addrs > 1)
+		config.replay_window = true;
+
 	if (override_mtu) {
 		config.tun_mtu = override_mtu;
 	} else {
@@ -322,11 +518,28 @@ int main(int argc, char *argv[])
 	gettimeofday(&current, NULL);
 	srand(current.tv_sec ^ current.tv_usec ^ getpid());
 
+	/* No TUN device is needed for the benchmark */
+	if (bench_sizes)
+		exit(run_bench(bench_sizes, bench_packets) < 0 ? 1 : 0);
+
 	if (config.ifname[0] == '\0')
 		strcpy(config.ifname, "mv%d");
-	if ((state.tunfd = tun_alloc(config.ifname, config.tap_mode)) < 0) {
-		fprintf(stderr, "*** open_tun() failed: %s.\n", strerror(errno));
-		exit(1);
+	state.workers = calloc(config.nr_queues, sizeof(struct worker));
+	assert(state.workers);
+	for (i = 0; i < config.nr_queues; i++) {
+		struct worker *w = &state.workers[i];
+		w->id = i;
+		w->sockfd = -1;
+		if ((w->tunfd = tun_alloc(config.ifname, config.tap_mode,
+			config.nr_queues > 1, config.tun_offload)) < 0) {
+			fprintf(stderr, "*** open_tun() failed: %s.\n", strerror(errno));
+			exit(1);
+		}
+		set_nonblock(w->tunfd);
+		if (config.tun_offload && tun_offload_init(w) < 0) {
+			fprintf(stderr, "*** Cannot enable TUN offloads: %s.\n", strerror(errno));
+			exit(1);
+		}
 	}
 
 	openlog(config.ifname, LOG_PID | LOG_PERROR | LOG_NDELAY, LOG_USER);
@@ -408,6 +621,17 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "*** No such encryption type defined: %s.\n", crypto_type);
 			exit(1);
 		}
+		/* AEAD ciphers authenticate by tag and leave 'hdr.auth_key' out. */
+		for (i = 0; i < config.nr_queues; i++) {
+			struct worker *w = &state.workers[i];
+			w->crypto_ctx = crypto_init(config.crypto_type, config.crypto_key,
+					offsetof(struct minivtun_msg, hdr.auth_key),
+					sizeof(((struct minivtun_msg *)0)->hdr.auth_key));
+			if (w->crypto_ctx == NULL) {
+				fprintf(stderr, "*** Encryption type '%s' is not available.\n", crypto_type);
+				exit(1);
+			}
+		}
 	} else {
 		memset(config.crypto_key, 0x0, CRYPTO_MAX_KEY_SIZE);
 		fprintf(stderr, "*** WARNING: Transmission will not be encrypted.\n");
@@ -415,8 +639,8 @@ int main(int argc, char *argv[])
 
 	if (loc_addr_pair) {
 		run_server(loc_addr_pair);
-	} else if (peer_addr_pair) {
-		run_client(peer_addr_pair);
+	} else if (nr_peer_addrs) {
+		run_client(peer_addr_pairs, nr_peer_addrs);
 	} else {
 		fprintf(stderr, "*** No valid local or peer address specified.\n");
 		exit(1);
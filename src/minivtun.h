@@ -7,7 +7,14 @@
 #ifndef __MINIVTUN_H
 #define __MINIVTUN_H
 
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
 #include "library.h"
+#include "event.h"
+#include "jhash.h"
 
 extern struct minivtun_config config;
 extern struct state_variables state;
@@ -56,14 +63,207 @@ struct minivtun_config {
 	unsigned reconnect_timeo;
 	unsigned max_droprate;
 	unsigned max_rtt;
+	bool standby_paths;
+	unsigned fec_data;   /* data shards in a group, 0 without error correction */
+	unsigned fec_parity; /* parity shards of a group, at least */
+	bool replay_window;  /* number datagrams with 'struct minivtun_seq_ext' */
 	unsigned keepalive_interval;
 	unsigned health_assess_interval;
 	unsigned nr_stats_buckets;
 	const char *health_file;
 	unsigned vt_metric;
 	char vt_table[32];
+	unsigned nr_queues;
+	unsigned reuseport;
+	unsigned hash_size;
+	unsigned max_clients;
+	unsigned max_fec_clients; /* real addresses the server decodes FEC of */
+	const char *stats_socket;
+	unsigned drop_log_interval;
+	bool tun_offload;
+	bool udp_offload;
+	bool io_uring;
+	const char *xdp_ifname;
+};
+
+/* How server datagrams are spread over the workers */
+enum {
+	REUSEPORT_NONE, /* one socket shared by all workers */
+	REUSEPORT_HASH, /* a socket each, picked by the kernel flow hash */
+	REUSEPORT_ADDR, /* a socket each, picked by the client IP address */
+};
+
+/* Upper limit of TUN queues, as imposed by the kernel */
+#define MAX_TUN_QUEUES  256
+
+/* Why a datagram or frame was dropped, see 'drop_reason_names' */
+enum {
+	DROP_DECRYPT,      /* failed decryption or authentication tag */
+	DROP_SHORT_MSG,    /* shorter than the message header */
+	DROP_BAD_AUTH,     /* wrong authentication key */
+	DROP_BAD_OPCODE,   /* message type not expected here */
+	DROP_SHORT_PACKET, /* shorter than an IP header or Ethernet frame */
+	DROP_BAD_PROTO,    /* neither IPv4 nor IPv6 */
+	DROP_TRUNCATED,    /* IP packet longer than the datagram carrying it */
+	DROP_REPLAYED,     /* sequence number seen before, or too old */
+	DROP_BAD_PATH,     /* path number a client cannot have */
+	DROP_NO_CLIENT,    /* client table full */
+	DROP_NO_ROUTE,     /* no client or route for the destination */
+	DROP_TUN_WRITE,    /* refused by the virtual interface */
+	DROP_NET_SEND,     /* refused by the socket, or no buffer space */
+	__DROP_MAX,
+};
+
+extern const char *const drop_reason_names[];
+
+/**
+ * Traffic counters of a worker. Only its own thread writes them, so they
+ * are bumped without atomic operations, and read by the stats socket
+ * without locks.
+ */
+struct traffic_stats {
+	__u64 net_rx_packets;
+	__u64 net_rx_bytes;
+	__u64 net_tx_packets;
+	__u64 net_tx_bytes;
+	__u64 tun_rx_packets;
+	__u64 tun_rx_bytes;
+	__u64 tun_tx_packets;
+	__u64 tun_tx_bytes;
+	__u64 fec_recovered;
+	__u64 drops[__DROP_MAX];
+};
+
+/* Describes a 64-bit counter in a statistics structure, for dumping */
+struct stats_field {
+	const char *name;
+	size_t offset;
+	const char *help;
+};
+
+extern const struct stats_field traffic_stats_fields[];
+
+/* Bump a counter that has a single writer */
+static inline void stats_add(__u64 *counter, __u64 n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* Bump a counter that may be written by several workers */
+static inline void stats_add_shared(__u64 *counter, __u64 n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_drop(struct traffic_stats *st, int reason)
+{
+	stats_add(&st->drops[reason], 1);
+}
+
+static inline __u64 stats_value(const void *stats, const struct stats_field *f)
+{
+	return __atomic_load_n((const __u64 *)((const char *)stats + f->offset),
+			__ATOMIC_RELAXED);
+}
+
+struct tun_offload;
+struct uring;
+struct xsk;
+struct minivtun_msg;
+
+/**
+ * Datapath resources owned by one worker thread: a TUN queue, the
+ * datagram rings and a cipher context. The UDP socket may be shared.
+ */
+struct worker {
+	unsigned id;
+	pthread_t thread;
+	int tunfd;
+	int sockfd;
+	struct crypto_context *crypto_ctx;
+	struct tun_offload *offload; /* NULL unless '--offload' */
+	struct uring *uring; /* NULL unless '--io-uring' */
+	bool uring_sock; /* socket read by io_uring rather than 'sock_source' */
+	bool uring_tun;  /* TUN queue read by io_uring rather than 'tun_source' */
+	struct xsk *xsk; /* NULL unless '--xdp' */
+	struct msg_ring rx_ring;
+	struct msg_ring tx_ring;
+	struct event_loop loop;
+	struct event_source sock_source;
+	struct event_source tun_source;
+	struct event_source xsk_source;
+	struct traffic_stats stats __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+int tun_offload_init(struct worker *w);
+ssize_t tun_offload_read(struct worker *w, void *buf, size_t len);
+int tun_offload_write(struct worker *w, struct tun_pi *pi, void *data, size_t len);
+int tun_offload_flush(struct worker *w);
+
+int uring_init(struct worker *w);
+int uring_run(struct worker *w);
+void uring_watch_socket(struct worker *w);
+int uring_recv(struct worker *w, struct msg_ring *ring);
+ssize_t uring_tun_read(struct worker *w, struct minivtun_msg **nmsg);
+int uring_tun_write(struct worker *w, struct tun_pi *pi, void *data, size_t len);
+int uring_send(struct worker *w, struct msg_ring *ring);
+
+int xdp_init(const char *ifname);
+int xsk_recv(struct worker *w, struct msg_ring **ring);
+void xsk_recv_done(struct worker *w);
+int xsk_send(struct worker *w, struct msg_ring *ring);
+
+/* Read one frame from the worker's TUN queue, 'struct tun_pi' first */
+static inline ssize_t tun_read_frame(struct worker *w, void *buf, size_t len)
+{
+	if (w->offload)
+		return tun_offload_read(w, buf, len);
+	return read(w->tunfd, buf, len);
+}
+
+/**
+ * Write a packet to the worker's TUN queue, returns -1 if it is refused.
+ * With offloads it may be held back until tun_flush_frames(). On io_uring
+ * the write completes later, and the 'struct tun_pi' is copied into the
+ * four bytes before 'data', which must be free.
+ */
+static inline int tun_write_frame(struct worker *w, struct tun_pi *pi,
+		void *data, size_t len)
+{
+	struct iovec iov[2];
+
+	if (w->offload)
+		return tun_offload_write(w, pi, data, len);
+	if (w->uring)
+		return uring_tun_write(w, pi, data, len);
+
+	iov[0].iov_base = pi;
+	iov[0].iov_len = sizeof(*pi);
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+	return writev(w->tunfd, iov, 2) < 0 ? -1 : 0;
+}
+
+/* Write what tun_write_frame() held back, at the end of a batch */
+static inline int tun_flush_frames(struct worker *w)
+{
+	return w->offload ? tun_offload_flush(w) : 0;
+}
+
+enum {
+	STATS_FORMAT_PROMETHEUS,
+	STATS_FORMAT_JSON,
 };
 
+/**
+ * Writes the client part of a stats dump. For JSON it continues the
+ * top-level object, starting with a comma.
+ */
+typedef void (*stats_dump_fn)(FILE *fp, int format);
+
+int stats_socket_init(const char *path, stats_dump_fn dump_clients);
+void stats_log_drops(const struct timeval *now);
+
 /* Statistics data for health assess */
 struct stats_data {
 	unsigned total_echo_sent;
@@ -78,30 +278,68 @@ static inline void zero_stats_data(struct stats_data *st)
 	st->total_rtt_ms = 0;
 }
 
-/* Status variables during VPN running */
-struct state_variables {
-	int tunfd;
-	int sockfd;
+/* Upper limit of client paths, one for each '-r' */
+#define MAX_CLIENT_PATHS  8
 
-	/* *** Client specific *** */
+/**
+ * A server endpoint, or a local uplink to it, that the client holds a
+ * socket to. Each path is probed and assessed on its own, and carries
+ * the flows scheduled to it by its weight.
+ */
+struct client_path {
+	const char *addr_pair; /* host:port of the server */
+	const char *local;     /* local address or interface, NULL for any */
+	int sockfd;
 	struct sockaddr_inx peer_addr;
-	__u16 xmit_seq;
-	struct timeval last_recv;
+	unsigned sock_gen; /* bumped when 'sockfd' is replaced */
+	bool need_reconnect;
+	struct timeval next_connect;
 	struct timeval last_echo_sent;
 	struct timeval last_echo_recv;
 	struct timeval last_health_assess;
-	bool is_link_ok;
-	bool health_based_link_up;
+	bool is_healthy; /* passed the last health assess */
+	struct timeval usable_since; /* zero while it cannot take packets */
 
 	/* Health assess data */
 	bool has_pending_echo;
 	__be32 pending_echo_id;
+	unsigned echo_misses; /* echoes unanswered in a row */
 	struct stats_data *stats_buckets;
 	unsigned current_bucket;
 
+	/* Result of the last health assess */
+	unsigned sent, rcvd, drop_percent, rtt_average;
+	unsigned data_rcvd, data_lost; /* datagrams from the server in the interval */
+	unsigned jitter; /* microseconds, with '--replay-window' */
+	unsigned reorder_depth;
+	unsigned weight;
+	__u64 last_received, last_lost; /* counters of 'replay' at the assess */
+
+	__u64 tx_packets;
+	__u64 rx_packets;
+
+	/* Sequence numbers of the datagrams sent, and of those received */
+	__u64 xmit_seq;
+	struct replay_window replay;
+	/* Without '--replay-window', one for each worker, summed into 'replay' */
+	struct seq_track_head track_head;
+	struct seq_track *tracks;
+};
+
+/* Status variables during VPN running */
+struct state_variables {
+	int sockfd;
+	struct worker *workers;
+
+	/* *** Client specific *** */
+	struct client_path *paths;
+	unsigned nr_paths;
+	unsigned fec_parity; /* by the loss measured on the paths */
+	bool is_link_ok;
+	bool health_based_link_up;
+
 	/* *** Server specific *** */
 	struct sockaddr_inx local_addr;
-	struct timeval last_walk;
 };
 
 enum {
@@ -109,15 +347,23 @@ enum {
 	MINIVTUN_MSG_IPDATA,
 	MINIVTUN_MSG_DISCONNECT,
 	MINIVTUN_MSG_ECHO_ACK,
+	MINIVTUN_MSG_FEC_DATA,   /* IPDATA followed by a 'struct fec_trailer' */
+	MINIVTUN_MSG_FEC_PARITY, /* parity shard followed by a 'struct fec_trailer' */
 };
 
 #define NM_PI_BUFFER_SIZE  (1024 * 8)
 
+/* Datagrams moved by one recvmmsg() or sendmmsg() call */
+#define NM_BATCH_SIZE  32
+
+/* Receive buffer for a train of datagrams coalesced by UDP_GRO */
+#define NM_GRO_BUFFER_SIZE  65535
+
 struct minivtun_msg {
 	struct {
 		__u8 opcode;
-		__u8 rsv;
-		__be16 seq;
+		__u8 flags;  /* MINIVTUN_FLAG_* */
+		__be16 seq;  /* low bits of the sequence number */
 		__u8 auth_key[16];
 	} __attribute__((packed)) hdr; /* 20 */
 
@@ -143,27 +389,400 @@ struct minivtun_msg {
 #define MINIVTUN_MSG_BASIC_HLEN  (sizeof(((struct minivtun_msg *)0)->hdr))
 #define MINIVTUN_MSG_IPDATA_OFFSET  (offsetof(struct minivtun_msg, ipdata.data))
 
+/* The header is followed by a 'struct minivtun_seq_ext' */
+#define MINIVTUN_FLAG_SEQ64  0x01
+
+/**
+ * Full sequence number of a datagram, between the header and the body
+ * of messages flagged MINIVTUN_FLAG_SEQ64. Each sender numbers from the
+ * current time in the upper half, so a restarted peer starts ahead of
+ * the replay window kept by the other end. Each path of a client numbers
+ * on its own and tells which it is. Being 16 bytes, it keeps the length
+ * of messages modulo the cipher block, which FEC trailers need.
+ */
+struct minivtun_seq_ext {
+	__be32 seq_hi;
+	__be32 seq_lo;
+	__be32 stamp; /* replay_stamp() of the sender, 0 if left out */
+	__u8 path; /* of the client, below MAX_CLIENT_PATHS, 0 from the server */
+	__u8 rsv[3];
+} __attribute__((packed));
+
+/* What a received datagram carries in its 'struct minivtun_seq_ext' */
+struct netmsg_seq {
+	__u64 seq; /* 0 if the sender leaves it out */
+	__u32 stamp;
+	unsigned path;
+};
+
 #define enabled_encryption()  (config.crypto_passwd[0])
 
-static inline void local_to_netmsg(void *in, void **out, size_t *dlen)
+/* Limits of the forward error correction groups, see fec.c */
+#define FEC_MAX_DATA  32
+#define FEC_MAX_PARITY  8
+
+/* Longest IPDATA body sent as a data shard, larger ones go as they are */
+#define FEC_SHARD_MAX  2048
+#define FEC_SYMBOL_MAX  (2 + FEC_SHARD_MAX)
+
+/* Milliseconds a group may wait for more data before its parity is sent */
+#define FEC_GROUP_MS  10
+
+/**
+ * Ends every FEC_DATA and FEC_PARITY message, at a multiple of 16 bytes
+ * from its start, where the padding of block ciphers cannot move it.
+ */
+#define FEC_TRAILER_ALIGN  16
+
+struct fec_trailer {
+	__be32 group;
+	__be16 len; /* of the shard, which starts behind the message header */
+	__u8 index; /* of the data or parity shard */
+	__u8 k;     /* data shards, final in parity shards */
+	__u8 m;     /* parity shards */
+	__u8 rsv;
+} __attribute__((packed));
+
+/* Data shards rebuilt by fec_decode(), as messages */
+struct fec_recovered {
+	unsigned nr;
+	size_t lens[FEC_MAX_PARITY];
+	char bufs[FEC_MAX_PARITY][MINIVTUN_MSG_BASIC_HLEN + FEC_SHARD_MAX];
+};
+
+struct fec_encoder;
+struct fec_decoder;
+
+struct fec_encoder *fec_encoder_new(unsigned stream);
+void fec_encoder_free(struct fec_encoder *enc);
+bool fec_encoder_busy(const struct fec_encoder *enc);
+bool fec_encode(struct fec_encoder *enc, const void *shard, size_t len,
+		unsigned k, unsigned m, struct fec_trailer *tr);
+unsigned fec_parity_count(const struct fec_encoder *enc);
+size_t fec_encode_parity(struct fec_encoder *enc, unsigned j, void *out,
+		struct fec_trailer *tr);
+void fec_encoder_close(struct fec_encoder *enc);
+
+size_t fec_decoder_size(void);
+struct fec_decoder *fec_decoder_init(void *mem);
+void fec_decoder_destroy(struct fec_decoder *dec);
+struct fec_decoder *fec_decoder_new(void);
+void fec_decoder_free(struct fec_decoder *dec);
+bool fec_decode(struct fec_decoder *dec, bool parity, const struct fec_trailer *tr,
+		const void *shard, struct fec_recovered *rec);
+
+/**
+ * Encrypt a message in place, returns the start of the datagram to send.
+ * AEAD datagrams begin a few bytes after the message, within its tail
+ * room, so the buffer must extend CRYPTO_MAX_BLOCK_SIZE past it.
+ */
+static inline void *local_to_netmsg(struct worker *w, void *nmsg, size_t *dlen)
 {
+	void *out = nmsg;
+
 	if (enabled_encryption()) {
-		datagram_encrypt(config.crypto_key, config.crypto_type, in, *out, dlen);
-	} else {
-		*out = in;
+		out = (char *)nmsg + crypto_wire_shift(w->crypto_ctx);
+		datagram_encrypt(w->crypto_ctx, nmsg, out, dlen);
 	}
+	return out;
 }
-static inline void netmsg_to_local(void *in, void **out, size_t *dlen)
+
+/**
+ * Decrypt and authenticate a datagram in place, returns the message or
+ * NULL if it is malformed or not from a peer sharing our key. The
+ * message may start before the datagram, hence the buffer needs
+ * MSG_RING_HEADROOM bytes of head room. The numbering by the sender is
+ * taken out to 'ns'.
+ */
+static inline struct minivtun_msg *netmsg_to_local(struct worker *w,
+		void *data, size_t *dlen, struct netmsg_seq *ns)
 {
+	struct minivtun_msg *nmsg = data;
+	struct minivtun_seq_ext ext;
+
 	if (enabled_encryption()) {
-		datagram_decrypt(config.crypto_key, config.crypto_type, in, *out, dlen);
+		nmsg = (void *)((char *)data - crypto_wire_shift(w->crypto_ctx));
+		if (datagram_decrypt(w->crypto_ctx, data, nmsg, dlen) < 0) {
+			stats_drop(&w->stats, DROP_DECRYPT);
+			return NULL;
+		}
+	}
+
+	if (*dlen < MINIVTUN_MSG_BASIC_HLEN) {
+		stats_drop(&w->stats, DROP_SHORT_MSG);
+		return NULL;
+	}
+
+	/* Verify password, unless already done by the AEAD tag. */
+	if (!(enabled_encryption() && crypto_is_aead(w->crypto_ctx)) &&
+		memcmp(nmsg->hdr.auth_key, config.crypto_key, sizeof(nmsg->hdr.auth_key)) != 0) {
+		stats_drop(&w->stats, DROP_BAD_AUTH);
+		return NULL;
+	}
+
+	/* Take out the sequence number, 0 if the sender leaves it out. */
+	memset(ns, 0x0, sizeof(*ns));
+	if (nmsg->hdr.flags & MINIVTUN_FLAG_SEQ64) {
+		if (*dlen < MINIVTUN_MSG_BASIC_HLEN + sizeof(ext)) {
+			stats_drop(&w->stats, DROP_SHORT_MSG);
+			return NULL;
+		}
+		memcpy(&ext, (char *)nmsg + MINIVTUN_MSG_BASIC_HLEN, sizeof(ext));
+		ns->seq = (__u64)ntohl(ext.seq_hi) << 32 | ntohl(ext.seq_lo);
+		ns->stamp = ntohl(ext.stamp);
+		ns->path = ext.path;
+		nmsg = memmove((char *)nmsg + sizeof(ext), nmsg, MINIVTUN_MSG_BASIC_HLEN);
+		*dlen -= sizeof(ext);
+	}
+
+	return nmsg;
+}
+
+/**
+ * Number a message built in place with 'seq' of 'path', moving its header
+ * into the head room of the buffer to make way for a 'struct
+ * minivtun_seq_ext'. Returns where the message starts now, 'dlen' grows
+ * accordingly.
+ */
+static inline struct minivtun_msg *netmsg_push_seq(struct minivtun_msg *nmsg,
+		size_t *dlen, __u64 seq, unsigned path)
+{
+	struct minivtun_seq_ext ext = { htonl(seq >> 32), htonl((__u32)seq),
+			htonl(replay_stamp()), path, { 0 } };
+	struct minivtun_msg *out = (void *)((char *)nmsg - sizeof(ext));
+
+	memmove(out, nmsg, MINIVTUN_MSG_BASIC_HLEN);
+	out->hdr.flags |= MINIVTUN_FLAG_SEQ64;
+	memcpy((char *)out + MINIVTUN_MSG_BASIC_HLEN, &ext, sizeof(ext));
+	*dlen += sizeof(ext);
+	return out;
+}
+
+/**
+ * Send all datagrams queued on the worker's ring, counting those lost.
+ * With AF_XDP, what it cannot take goes through the socket.
+ */
+static inline void netmsg_ring_flush(struct worker *w)
+{
+	unsigned count = w->tx_ring.count;
+	int sent = w->xsk ? xsk_send(w, &w->tx_ring) : 0;
+
+	sent += w->uring ? uring_send(w, &w->tx_ring) :
+			msg_ring_send(w->sockfd, &w->tx_ring);
+
+	if ((unsigned)sent < count)
+		stats_add(&w->stats.drops[DROP_NET_SEND], count - sent);
+}
+
+/**
+ * Buffer of the next free slot in the worker's send ring, for building a
+ * message in place. The ring is flushed first if it is full.
+ */
+static inline struct minivtun_msg *netmsg_ring_next(struct worker *w)
+{
+	if (w->tx_ring.count == w->tx_ring.size)
+		netmsg_ring_flush(w);
+	return msg_ring_slot(&w->tx_ring, w->tx_ring.count);
+}
+
+/**
+ * Encrypt a message built by netmsg_ring_next() or tun_read_netmsg() in
+ * place and queue it for sending. 'dst' is NULL on connected sockets.
+ */
+static inline void netmsg_ring_commit(struct worker *w, struct minivtun_msg *nmsg,
+		size_t dlen, const struct sockaddr_inx *dst)
+{
+	struct msg_ring *ring = &w->tx_ring;
+	struct mmsghdr *mh = &ring->msgs[ring->count];
+
+	mh->msg_hdr.msg_iov->iov_base = local_to_netmsg(w, nmsg, &dlen);
+	mh->msg_hdr.msg_iov->iov_len = dlen;
+	stats_add(&w->stats.net_tx_packets, 1);
+	stats_add(&w->stats.net_tx_bytes, dlen);
+
+	if (dst) {
+		ring->addrs[ring->count] = *dst;
+		mh->msg_hdr.msg_namelen = sizeof_sockaddr(dst);
 	} else {
-		*out = in;
+		mh->msg_hdr.msg_namelen = 0;
+	}
+	ring->count++;
+}
+
+/**
+ * Copy a message into the next slot of a send ring and queue it,
+ * numbered with 'seq' of 'path' in full unless that is negative.
+ */
+static inline void queue_netmsg(struct worker *w, const void *nmsg, size_t dlen,
+		__u64 seq, int path, const struct sockaddr_inx *dst)
+{
+	struct minivtun_msg *slot = netmsg_ring_next(w);
+
+	memcpy(slot, nmsg, dlen);
+	if (path >= 0)
+		slot = netmsg_push_seq(slot, &dlen, seq, path);
+	netmsg_ring_commit(w, slot, dlen, dst);
+}
+
+/* Append the trailer to a FEC message of 'dlen' bytes, returns its new length */
+static inline size_t netmsg_fec_trailer(struct minivtun_msg *nmsg, size_t dlen,
+		const struct fec_trailer *tr)
+{
+	size_t off = ((dlen + sizeof(*tr) + FEC_TRAILER_ALIGN - 1) &
+			~(size_t)(FEC_TRAILER_ALIGN - 1)) - sizeof(*tr);
+
+	memset((char *)nmsg + dlen, 0x0, off - dlen);
+	memcpy((char *)nmsg + off, tr, sizeof(*tr));
+	return off + sizeof(*tr);
+}
+
+/**
+ * Build parity shard 'j' of the encoder's open group in a send slot and
+ * queue it, numbered with 'seq' of 'path' in full unless that is negative.
+ */
+static inline void netmsg_queue_parity(struct worker *w, struct fec_encoder *enc,
+		unsigned j, __u64 seq, int path, const struct sockaddr_inx *dst)
+{
+	struct minivtun_msg *nmsg = netmsg_ring_next(w);
+	struct fec_trailer tr;
+	size_t len;
+
+	memset(&nmsg->hdr, 0x0, sizeof(nmsg->hdr));
+	nmsg->hdr.opcode = MINIVTUN_MSG_FEC_PARITY;
+	nmsg->hdr.seq = htons(seq);
+	memcpy(nmsg->hdr.auth_key, config.crypto_key, sizeof(nmsg->hdr.auth_key));
+	len = fec_encode_parity(enc, j, (char *)nmsg + MINIVTUN_MSG_BASIC_HLEN, &tr);
+	len = netmsg_fec_trailer(nmsg, MINIVTUN_MSG_BASIC_HLEN + len, &tr);
+	if (path >= 0)
+		nmsg = netmsg_push_seq(nmsg, &len, seq, path);
+	netmsg_ring_commit(w, nmsg, len, dst);
+}
+
+/**
+ * Pass a received FEC_DATA or FEC_PARITY message to the decoder, with
+ * its trailer copied to 'tr'. Returns the length of the IPDATA message
+ * in a data shard not seen before, 0 for a parity shard, or -1 if the
+ * shard is to be dropped. Data shards rebuilt with it are put in 'rec'.
+ * Without a decoder, data shards are taken as they are.
+ */
+static inline int netmsg_fec_decode(struct worker *w, struct fec_decoder *dec,
+		struct minivtun_msg *nmsg, size_t dlen, struct fec_trailer *tr,
+		struct fec_recovered *rec)
+{
+	bool parity = (nmsg->hdr.opcode == MINIVTUN_MSG_FEC_PARITY);
+	size_t len;
+
+	rec->nr = 0;
+	if (dlen < MINIVTUN_MSG_BASIC_HLEN + sizeof(*tr)) {
+		stats_drop(&w->stats, DROP_SHORT_MSG);
+		return -1;
+	}
+	memcpy(tr, (char *)nmsg + dlen - sizeof(*tr), sizeof(*tr));
+	len = ntohs(tr->len);
+	if (MINIVTUN_MSG_BASIC_HLEN + len + sizeof(*tr) > dlen) {
+		stats_drop(&w->stats, DROP_TRUNCATED);
+		return -1;
+	}
+	if (dec && !fec_decode(dec, parity, tr, (char *)nmsg + MINIVTUN_MSG_BASIC_HLEN, rec))
+		return -1;
+	stats_add(&w->stats.fec_recovered, rec->nr);
+
+	return parity ? 0 : (int)(MINIVTUN_MSG_BASIC_HLEN + len);
+}
+
+/* Receive a batch of datagrams into the worker's ring, see msg_ring_recv() */
+static inline int netmsg_ring_recv(struct worker *w)
+{
+	if (w->uring_sock)
+		return uring_recv(w, &w->rx_ring);
+	return msg_ring_recv(w->sockfd, &w->rx_ring);
+}
+
+/**
+ * Read a frame from the worker's TUN queue into a message buffer, behind
+ * the message header, with its 'struct tun_pi' overlaying the 'ipdata'
+ * header. The buffer is the next send slot, or one filled by io_uring.
+ */
+static inline ssize_t tun_read_netmsg(struct worker *w, struct minivtun_msg **nmsg)
+{
+	if (w->uring_tun)
+		return uring_tun_read(w, nmsg);
+	*nmsg = netmsg_ring_next(w);
+	return tun_read_frame(w, (char *)*nmsg + MINIVTUN_MSG_IPDATA_OFFSET -
+			sizeof(struct tun_pi), NM_PI_BUFFER_SIZE);
+}
+
+/* Allocate the datagram rings of a worker, with UDP offloads if enabled */
+static inline int netmsg_rings_init(struct worker *w)
+{
+	if (msg_ring_init(&w->rx_ring, NM_BATCH_SIZE,
+			config.udp_offload ? NM_GRO_BUFFER_SIZE : NM_PI_BUFFER_SIZE) < 0 ||
+		msg_ring_init(&w->tx_ring, NM_BATCH_SIZE, sizeof(struct minivtun_msg)) < 0)
+		return -1;
+	if (config.udp_offload &&
+		(msg_ring_enable_offload(&w->rx_ring) < 0 ||
+		 msg_ring_enable_offload(&w->tx_ring) < 0))
+		return -1;
+	return 0;
+}
+
+/* First sequence number of a flow, see 'struct minivtun_seq_ext' */
+static inline __u64 initial_xmit_seq(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (__u64)now.tv_sec << 32;
+}
+
+/* Sequence number for the next datagram of a flow, from any worker */
+static inline __u64 next_xmit_seq(__u64 *seq)
+{
+	return __atomic_fetch_add(seq, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Hash of the flow a frame belongs to: addresses, protocol and ports of
+ * IPv4 and IPv6 packets, or the MAC addresses of other Ethernet frames.
+ * Keeping a flow on one path keeps its packets in order.
+ */
+static inline __u32 flow_hash(__be16 proto, const __u8 *data, size_t len)
+{
+	const __u8 *eth = data;
+	__u32 addrs[8], ports = 0;
+
+	if (config.tap_mode) {
+		if (len < 14)
+			return 0;
+		memcpy(&proto, data + 12, sizeof(proto));
+		data += 14;
+		len -= 14;
+	}
+
+	if (proto == htons(ETH_P_IP) && len >= 20) {
+		size_t hlen = (data[0] & 0x0f) * 4;
+		/* All fragments hash alike, only the first one has the ports */
+		if ((data[9] == IPPROTO_TCP || data[9] == IPPROTO_UDP) &&
+			!(data[6] & 0x3f) && !data[7] && len >= hlen + 4)
+			memcpy(&ports, data + hlen, sizeof(ports));
+		memcpy(addrs, data + 12, 8);
+		return jhash_3words(addrs[0], addrs[1], ports ^ data[9], 0);
+	} else if (proto == htons(ETH_P_IPV6) && len >= 40) {
+		if ((data[6] == IPPROTO_TCP || data[6] == IPPROTO_UDP) && len >= 44)
+			memcpy(&ports, data + 40, sizeof(ports));
+		memcpy(addrs, data + 8, 32);
+		return jhash_2words(ports, data[6], jhash2(addrs, 8, 0));
+	} else if (config.tap_mode) {
+		memcpy(addrs, eth, 12);
+		return jhash2(addrs, 3, 0);
 	}
+	return 0;
 }
 
-int run_client(const char *peer_addr_pair);
+int run_workers(void);
+int run_client(const char *const *peer_addr_pairs, unsigned nr_pairs);
 int run_server(const char *loc_addr_pair);
+int run_bench(const char *sizes, unsigned long count);
 
 #endif /* __MINIVTUN_H */
 
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "minivtun.h"
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+
+int tun_offload_init(struct worker *w)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+ssize_t tun_offload_read(struct worker *w, void *buf, size_t len)
+{
+	return read(w->tunfd, buf, len);
+}
+
+int tun_offload_write(struct worker *w, struct tun_pi *pi, void *data, size_t len)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int tun_offload_flush(struct worker *w)
+{
+	return 0;
+}
+
+#else
+
+#include <linux/virtio_net.h>
+
+/**
+ * With IFF_VNET_HDR, every frame on the TUN queue carries a virtio-net
+ * header between 'struct tun_pi' and the packet. It describes TCP
+ * super-packets of up to 64 KiB, which the kernel hands out once
+ * TUNSETOFFLOAD allows it. They are cut back to MSS sized segments
+ * before being tunnelled, while TCP segments coming out of the tunnel
+ * are merged into super-packets again before being written.
+ */
+
+/* Largest IP packet in a TUN frame */
+#define TUN_OFFLOAD_MAX  65535
+
+#define TCP_FLAG_FIN  0x01
+#define TCP_FLAG_SYN  0x02
+#define TCP_FLAG_RST  0x04
+#define TCP_FLAG_PSH  0x08
+#define TCP_FLAG_ACK  0x10
+#define TCP_FLAG_CWR  0x80
+
+struct tun_offload {
+	/* Super-packet read from the TUN queue, being segmented */
+	struct tun_pi rx_pi;
+	__u8 *rx_pkt;
+	size_t rx_len;      /* 0 if nothing is pending */
+	size_t rx_off;      /* payload offset of the next segment */
+	unsigned rx_seg;
+	unsigned rx_iphlen;
+	unsigned rx_hdrlen;
+	unsigned rx_mss;
+
+	/* TCP segments received from the tunnel, being coalesced */
+	struct tun_pi tx_pi;
+	__u8 *tx_pkt;
+	size_t tx_len;      /* 0 if nothing is pending */
+	unsigned tx_iphlen;
+	unsigned tx_hdrlen;
+	unsigned tx_mss;
+	unsigned tx_segs;
+	__u32 tx_next_seq;
+};
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+/* Sum of the TCP pseudo header, 'ip' being an IPv4 or IPv6 header */
+static __u64 tcp_pseudo_csum(const __u8 *ip, size_t tcp_len)
+{
+	__be32 tail[2] = { htonl(tcp_len), htonl(IPPROTO_TCP) };
+	__u64 sum;
+
+	if ((ip[0] >> 4) == 4) {
+		sum = csum_add(0, ip + 12, 8);
+	} else {
+		sum = csum_add(0, ip + 8, 32);
+	}
+	return csum_add(sum, tail, sizeof(tail));
+}
+
+static void ipv4_set_csum(__u8 *ip, unsigned iphlen)
+{
+	__u16 csum;
+
+	memset(ip + 10, 0x0, 2);
+	csum = ~csum_fold(csum_add(0, ip, iphlen));
+	memcpy(ip + 10, &csum, 2);
+}
+
+/* Set the IPv4 total or IPv6 payload length of a packet of 'len' bytes */
+static void ip_set_len(__u8 *ip, unsigned iphlen, size_t len)
+{
+	__be16 n;
+
+	if ((ip[0] >> 4) == 4) {
+		n = htons(len);
+		memcpy(ip + 2, &n, 2);
+		ipv4_set_csum(ip, iphlen);
+	} else {
+		n = htons(len - 40);
+		memcpy(ip + 4, &n, 2);
+	}
+}
+
+/**
+ * Header lengths of a TCP packet as accepted for segmenting or merging:
+ * IPv4 without fragmentation or IPv6 without extension headers.
+ * Returns false for anything else.
+ */
+static bool tcp_packet_hdrlen(const __u8 *ip, size_t len, unsigned *iphlen,
+		unsigned *hdrlen)
+{
+	if (len < 20)
+		return false;
+
+	if ((ip[0] >> 4) == 4) {
+		*iphlen = (ip[0] & 0x0f) * 4;
+		if (*iphlen < 20 || ip[9] != IPPROTO_TCP ||
+			((ip[6] & 0x3f) | ip[7]) != 0 /* MF or fragment offset */)
+			return false;
+	} else if ((ip[0] >> 4) == 6) {
+		*iphlen = 40;
+		if (ip[6] != IPPROTO_TCP)
+			return false;
+	} else {
+		return false;
+	}
+
+	if (len < *iphlen + 20)
+		return false;
+	*hdrlen = *iphlen + (ip[*iphlen + 12] >> 4) * 4;
+	return *hdrlen >= *iphlen + 20 && *hdrlen <= len;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+int tun_offload_init(struct worker *w)
+{
+	struct tun_offload *o;
+
+	if ((o = calloc(1, sizeof(*o))) == NULL)
+		return -1;
+	o->rx_pkt = malloc(TUN_OFFLOAD_MAX);
+	o->tx_pkt = malloc(TUN_OFFLOAD_MAX);
+	if (!o->rx_pkt || !o->tx_pkt) {
+		free(o->rx_pkt);
+		free(o->tx_pkt);
+		free(o);
+		return -1;
+	}
+	w->offload = o;
+	return 0;
+}
+
+/* Fill in the checksum the kernel left to us */
+static bool complete_csum(__u8 *pkt, size_t len, const struct virtio_net_hdr *vh)
+{
+	__u16 csum;
+
+	if ((size_t)vh->csum_start + vh->csum_offset + 2 > len)
+		return false;
+	/* The checksum field holds the pseudo header sum already. */
+	csum = ~csum_fold(csum_add(0, pkt + vh->csum_start, len - vh->csum_start));
+	/* Same value in one's complement, and the only one valid for UDP */
+	if (csum == 0)
+		csum = 0xffff;
+	memcpy(pkt + vh->csum_start + vh->csum_offset, &csum, 2);
+	return true;
+}
+
+/* Write the next segment of the pending super-packet as a frame */
+static ssize_t next_segment(struct tun_offload *o, void *buf, size_t len)
+{
+	size_t chunk = o->rx_len - o->rx_off, seg_len;
+	__u8 *ip = (__u8 *)buf + sizeof(struct tun_pi), *tcp;
+	__u32 seq;
+	__u16 csum;
+
+	if (chunk > o->rx_mss)
+		chunk = o->rx_mss;
+	seg_len = o->rx_hdrlen + chunk;
+	if (sizeof(struct tun_pi) + seg_len > len) {
+		o->rx_len = 0;
+		return -1;
+	}
+
+	memcpy(buf, &o->rx_pi, sizeof(struct tun_pi));
+	memcpy(ip, o->rx_pkt, o->rx_hdrlen);
+	memcpy(ip + o->rx_hdrlen, o->rx_pkt + o->rx_off, chunk);
+
+	if ((ip[0] >> 4) == 4) {
+		__be16 id;
+		memcpy(&id, ip + 4, 2);
+		id = htons(ntohs(id) + o->rx_seg);
+		memcpy(ip + 4, &id, 2);
+	}
+	ip_set_len(ip, o->rx_iphlen, seg_len);
+
+	tcp = ip + o->rx_iphlen;
+	memcpy(&seq, tcp + 4, 4);
+	seq = htonl(ntohl(seq) + (o->rx_off - o->rx_hdrlen));
+	memcpy(tcp + 4, &seq, 4);
+	if (o->rx_off + chunk < o->rx_len)
+		tcp[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+	if (o->rx_seg)
+		tcp[13] &= ~TCP_FLAG_CWR;
+
+	memset(tcp + 16, 0x0, 2);
+	csum = ~csum_fold(csum_add(tcp_pseudo_csum(ip, seg_len - o->rx_iphlen),
+			tcp, seg_len - o->rx_iphlen));
+	memcpy(tcp + 16, &csum, 2);
+
+	o->rx_off += chunk;
+	o->rx_seg++;
+	if (o->rx_off == o->rx_len)
+		o->rx_len = 0;
+
+	return sizeof(struct tun_pi) + seg_len;
+}
+
+/**
+ * Read a frame like read() does, splitting super-packets into segments.
+ * Packets which fit 'buf' are read in place, only super-packets are
+ * staged and copied out segment by segment.
+ */
+ssize_t tun_offload_read(struct worker *w, void *buf, size_t len)
+{
+	struct tun_offload *o = w->offload;
+	size_t head = len - sizeof(struct tun_pi), pkt_len;
+	struct virtio_net_hdr vh;
+	struct iovec iov[4];
+	__u8 *pkt = (__u8 *)buf + sizeof(struct tun_pi);
+	ssize_t rc;
+
+	for (;;) {
+		if (o->rx_len && (rc = next_segment(o, buf, len)) > 0)
+			return rc;
+
+		iov[0].iov_base = buf;
+		iov[0].iov_len = sizeof(struct tun_pi);
+		iov[1].iov_base = &vh;
+		iov[1].iov_len = sizeof(vh);
+		iov[2].iov_base = pkt;
+		iov[2].iov_len = head;
+		iov[3].iov_base = o->rx_pkt + head;
+		iov[3].iov_len = TUN_OFFLOAD_MAX - head;
+		if ((rc = readv(w->tunfd, iov, 4)) < 0)
+			return rc;
+		if ((size_t)rc < sizeof(struct tun_pi) + sizeof(vh))
+			continue;
+		pkt_len = (size_t)rc - sizeof(struct tun_pi) - sizeof(vh);
+
+		if (vh.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+			if (pkt_len > head)
+				continue;
+			if ((vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+				!complete_csum(pkt, pkt_len, &vh))
+				continue;
+			return sizeof(struct tun_pi) + pkt_len;
+		}
+
+		/* A super-packet, make it whole in the staging buffer */
+		memcpy(o->rx_pkt, pkt, pkt_len < head ? pkt_len : head);
+		memcpy(&o->rx_pi, buf, sizeof(struct tun_pi));
+		if ((vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_TCPV4 &&
+			(vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_TCPV6)
+			continue;
+		if (!tcp_packet_hdrlen(o->rx_pkt, pkt_len, &o->rx_iphlen, &o->rx_hdrlen) ||
+			vh.gso_size == 0 || pkt_len <= o->rx_hdrlen)
+			continue;
+		o->rx_mss = vh.gso_size;
+		o->rx_off = o->rx_hdrlen;
+		o->rx_seg = 0;
+		o->rx_len = pkt_len;
+	}
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+static int write_frame(struct worker *w, struct tun_pi *pi,
+		struct virtio_net_hdr *vh, void *pkt, size_t len)
+{
+	struct iovec iov[3];
+
+	iov[0].iov_base = pi;
+	iov[0].iov_len = sizeof(*pi);
+	iov[1].iov_base = vh;
+	iov[1].iov_len = sizeof(*vh);
+	iov[2].iov_base = pkt;
+	iov[2].iov_len = len;
+	return writev(w->tunfd, iov, 3) < 0 ? -1 : 0;
+}
+
+/* Write the coalesced segments, as one super-packet if there are several */
+int tun_offload_flush(struct worker *w)
+{
+	struct tun_offload *o = w->offload;
+	struct virtio_net_hdr vh;
+	__u8 *ip = o->tx_pkt;
+	__u16 csum;
+	int rc;
+
+	if (o->tx_len == 0)
+		return 0;
+
+	memset(&vh, 0x0, sizeof(vh));
+	if (o->tx_segs > 1) {
+		ip_set_len(ip, o->tx_iphlen, o->tx_len);
+		/* The kernel completes it, starting from the pseudo header sum */
+		csum = csum_fold(tcp_pseudo_csum(ip, o->tx_len - o->tx_iphlen));
+		memcpy(ip + o->tx_iphlen + 16, &csum, 2);
+
+		vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		vh.gso_type = (ip[0] >> 4) == 4 ?
+				VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+		vh.hdr_len = o->tx_hdrlen;
+		vh.gso_size = o->tx_mss;
+		vh.csum_start = o->tx_iphlen;
+		vh.csum_offset = 16;
+	}
+
+	rc = write_frame(w, &o->tx_pi, &vh, o->tx_pkt, o->tx_len);
+	o->tx_len = 0;
+	return rc;
+}
+
+/* Whether 'ip' continues the TCP flow being coalesced */
+static bool gro_can_append(struct tun_offload *o, const __u8 *ip, size_t len,
+		unsigned iphlen, unsigned hdrlen)
+{
+	const __u8 *head = o->tx_pkt, *tcp = ip + iphlen, *htcp = head + iphlen;
+	size_t payload = len - hdrlen;
+	__u32 seq;
+
+	if (iphlen != o->tx_iphlen || hdrlen != o->tx_hdrlen ||
+		payload == 0 || payload > o->tx_mss ||
+		o->tx_len + payload > TUN_OFFLOAD_MAX ||
+		/* Only the last segment may be short */
+		o->tx_len - o->tx_hdrlen != (size_t)o->tx_segs * o->tx_mss)
+		return false;
+
+	if ((ip[0] >> 4) == 4) {
+		/* Version, TOS, DF, TTL, protocol, addresses and options */
+		if (ip[0] != head[0] || ip[1] != head[1] || ip[6] != head[6] ||
+			memcmp(ip + 8, head + 8, 2) != 0 ||
+			memcmp(ip + 12, head + 12, iphlen - 12) != 0)
+			return false;
+	} else {
+		/* Version, traffic class, flow label, hops and addresses */
+		if (memcmp(ip, head, 4) != 0 || memcmp(ip + 6, head + 6, 34) != 0)
+			return false;
+	}
+
+	/* Ports, ACK, flags, window and options; merged headers are one */
+	memcpy(&seq, tcp + 4, 4);
+	if (ntohl(seq) != o->tx_next_seq ||
+		memcmp(tcp, htcp, 4) != 0 || memcmp(tcp + 8, htcp + 8, 5) != 0 ||
+		(tcp[13] & ~TCP_FLAG_PSH) != TCP_FLAG_ACK ||
+		memcmp(tcp + 14, htcp + 14, 2) != 0 ||
+		memcmp(tcp + 20, htcp + 20, hdrlen - iphlen - 20) != 0)
+		return false;
+
+	return true;
+}
+
+/**
+ * Queue a packet for the TUN queue, merged into the pending TCP flow
+ * where possible. Returns -1 if writing a frame failed.
+ */
+int tun_offload_write(struct worker *w, struct tun_pi *pi, void *data, size_t len)
+{
+	struct tun_offload *o = w->offload;
+	struct virtio_net_hdr vh;
+	unsigned iphlen, hdrlen;
+	__u8 *ip = data;
+	__u32 seq;
+	int rc = 0;
+
+	if (!tcp_packet_hdrlen(ip, len, &iphlen, &hdrlen)) {
+		rc = tun_offload_flush(w);
+		memset(&vh, 0x0, sizeof(vh));
+		return write_frame(w, pi, &vh, data, len) < 0 ? -1 : rc;
+	}
+
+	if (o->tx_len && pi->proto == o->tx_pi.proto &&
+		gro_can_append(o, ip, len, iphlen, hdrlen)) {
+		memcpy(o->tx_pkt + o->tx_len, ip + hdrlen, len - hdrlen);
+		o->tx_len += len - hdrlen;
+		o->tx_next_seq += len - hdrlen;
+		o->tx_segs++;
+		if (ip[iphlen + 13] & TCP_FLAG_PSH) {
+			o->tx_pkt[iphlen + 13] |= TCP_FLAG_PSH;
+			return tun_offload_flush(w);
+		}
+		return 0;
+	}
+
+	rc = tun_offload_flush(w);
+
+	/* Start a new flow with a plain ACK carrying data, else pass it on */
+	if (ip[iphlen + 13] != TCP_FLAG_ACK || len == hdrlen) {
+		memset(&vh, 0x0, sizeof(vh));
+		return write_frame(w, pi, &vh, data, len) < 0 ? -1 : rc;
+	}
+
+	memcpy(o->tx_pkt, data, len);
+	o->tx_pi = *pi;
+	o->tx_len = len;
+	o->tx_iphlen = iphlen;
+	o->tx_hdrlen = hdrlen;
+	o->tx_mss = len - hdrlen;
+	o->tx_segs = 1;
+	memcpy(&seq, ip + iphlen + 4, 4);
+	o->tx_next_seq = ntohl(seq) + o->tx_mss;
+
+	return rc;
+}
+
+#endif
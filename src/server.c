@@ -15,66 +15,414 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/uio.h>
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+	#include <linux/filter.h>
+#endif
 
 #include "list.h"
 #include "jhash.h"
+#include "event.h"
 #include "minivtun.h"
 
 static __u32 hash_initval = 0;
 
-static void *vt_route_lookup(short af, const void *a)
+/**
+ * Guards the va_map/ra_set tables shared by all workers. Each worker
+ * holds the read lock across a whole batch of datagrams, and trades it
+ * for the write lock only to add, move or recycle entries, which is rare.
+ * Only timestamps and sequence numbers are touched under the read lock.
+ */
+static pthread_rwlock_t va_ra_lock;
+
+static inline void va_ra_lock_upgrade(void)
+{
+	pthread_rwlock_unlock(&va_ra_lock);
+	pthread_rwlock_wrlock(&va_ra_lock);
+}
+
+static inline void va_ra_lock_downgrade(void)
+{
+	pthread_rwlock_unlock(&va_ra_lock);
+	pthread_rwlock_rdlock(&va_ra_lock);
+}
+
+static void init_va_ra_lock(void)
+{
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	/* Do not let busy readers starve the table walk. */
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&va_ra_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+/**
+ * Binary tries of the attached routes, one for each address family,
+ * built at startup for longest prefix matching in at most 32 or 128
+ * steps. Each node stands for the prefix spelled by the path to it.
+ */
+struct vt_route_node {
+	struct vt_route_node *child[2];
+	struct vt_route *route;
+};
+static struct vt_route_node *vt_route_trie4, *vt_route_trie6;
+
+static inline int addr_bit(const void *addr, int i)
+{
+	return (((const __u8 *)addr)[i / 8] >> (7 - i % 8)) & 1;
+}
+
+static void vt_route_trie_add(struct vt_route_node **root, struct vt_route *rt)
+{
+	struct vt_route_node **np = root;
+	int i;
+
+	for (i = 0; ; i++) {
+		if (*np == NULL) {
+			*np = calloc(1, sizeof(struct vt_route_node));
+			assert(*np);
+		}
+		if (i == rt->prefix)
+			break;
+		np = &(*np)->child[addr_bit(&rt->network, i)];
+	}
+
+	/* The list is newest first, the latest of duplicated routes wins. */
+	if ((*np)->route == NULL)
+		(*np)->route = rt;
+}
+
+static void init_vt_route_tries(void)
 {
-	const union {
-		struct in_addr in;
-		struct in6_addr in6;
-	} *addr = a;
 	struct vt_route *rt;
 
 	for (rt = config.vt_routes; rt; rt = rt->next) {
-		if (rt->af != af)
-			continue;
-		if (af == AF_INET) {
-			if (rt->prefix == 0) {
-				return &rt->gateway.in;
-			} else {
-				in_addr_t m = rt->prefix ? htonl(~((1 << (32 - rt->prefix)) - 1)) : 0;
-				if ((addr->in.s_addr & m) == rt->network.in.s_addr)
-					return &rt->gateway.in;
-			}
-		} else if (af == AF_INET6) {
-			if (rt->prefix == 0) {
-				return &rt->gateway.in6;
-			} else if (rt->prefix < 128) {
-				struct in6_addr n = addr->in6;
-				int i;
-				n.s6_addr[rt->prefix / 8] &= ~((1 << (8 - rt->prefix % 8)) - 1);
-				for (i = rt->prefix / 8 + 1; i < 16; i++)
-					n.s6_addr[i] &= 0x00;
-				if (is_in6_equal(&n, &rt->network.in6))
-					return &rt->gateway.in6;
-			}
+		if (rt->af == AF_INET) {
+			vt_route_trie_add(&vt_route_trie4, rt);
+		} else if (rt->af == AF_INET6) {
+			vt_route_trie_add(&vt_route_trie6, rt);
+		}
+	}
+}
+
+static void *vt_route_lookup(short af, const void *a)
+{
+	struct vt_route_node *n;
+	struct vt_route *best = NULL;
+	int i, nbits;
+
+	if (af == AF_INET) {
+		n = vt_route_trie4;
+		nbits = 32;
+	} else if (af == AF_INET6) {
+		n = vt_route_trie6;
+		nbits = 128;
+	} else {
+		return NULL;
+	}
+
+	for (i = 0; n; i++) {
+		if (n->route)
+			best = n->route;
+		if (i == nbits)
+			break;
+		n = n->child[addr_bit(a, i)];
+	}
+
+	if (best == NULL)
+		return NULL;
+	return af == AF_INET ? (void *)&best->gateway.in : (void *)&best->gateway.in6;
+}
 
+/* -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=- */
+
+/**
+ * Chained hash table that doubles when it gets loaded. The entries are
+ * moved to the new buckets a few chains at a time with each insertion,
+ * so growing never stalls the datapath; until done, lookups also check
+ * the chains that have not been moved yet.
+ */
+struct hash_entry {
+	struct list_head list;
+	__u32 hash;
+};
+
+struct hash_table {
+	struct list_head *buckets;
+	unsigned size;
+	struct list_head *old_buckets;
+	unsigned old_size;
+	unsigned rehash_index;
+	unsigned len;
+};
+
+#define HASH_TABLE_MAX_LOAD  2
+#define HASH_TABLE_MAX_SIZE  (1 << 20)
+/* Old chains moved with each insertion */
+#define HASH_TABLE_REHASH_STEP  4
+
+static struct list_head *alloc_hash_buckets(unsigned size)
+{
+	struct list_head *buckets;
+	unsigned i;
+
+	if ((buckets = malloc(sizeof(struct list_head) * size)) == NULL)
+		return NULL;
+	for (i = 0; i < size; i++)
+		INIT_LIST_HEAD(&buckets[i]);
+	return buckets;
+}
+
+static int hash_table_init(struct hash_table *ht, unsigned size)
+{
+	memset(ht, 0x0, sizeof(*ht));
+	if ((ht->buckets = alloc_hash_buckets(size)) == NULL)
+		return -1;
+	ht->size = size;
+	return 0;
+}
+
+static void hash_table_rehash(struct hash_table *ht, unsigned nr_chains)
+{
+	struct hash_entry *he, *__he;
+
+	while (ht->old_buckets && nr_chains-- > 0) {
+		list_for_each_entry_safe (he, __he, &ht->old_buckets[ht->rehash_index], list) {
+			list_del(&he->list);
+			list_add_tail(&he->list, &ht->buckets[he->hash & (ht->size - 1)]);
+		}
+		if (++ht->rehash_index == ht->old_size) {
+			free(ht->old_buckets);
+			ht->old_buckets = NULL;
 		}
 	}
+}
 
-	return NULL;
+/* Chains that may hold the entry of a hash value, returns the number */
+static inline unsigned hash_table_lookup_chains(struct hash_table *ht,
+		__u32 hash, struct list_head *chains[2])
+{
+	unsigned n = 0;
+
+	if (ht->old_buckets && (hash & (ht->old_size - 1)) >= ht->rehash_index)
+		chains[n++] = &ht->old_buckets[hash & (ht->old_size - 1)];
+	chains[n++] = &ht->buckets[hash & (ht->size - 1)];
+
+	return n;
+}
+
+/* Chains to visit for all entries, indexed by hash_table_chain() */
+static inline unsigned hash_table_nr_chains(const struct hash_table *ht)
+{
+	return ht->size + (ht->old_buckets ? ht->old_size : 0);
+}
+
+static inline struct list_head *hash_table_chain(struct hash_table *ht, unsigned i)
+{
+	return i < ht->size ? &ht->buckets[i] : &ht->old_buckets[i - ht->size];
+}
+
+static void hash_table_add(struct hash_table *ht, struct hash_entry *he, __u32 hash)
+{
+	struct list_head *buckets;
+
+	he->hash = hash;
+	list_add_tail(&he->list, &ht->buckets[hash & (ht->size - 1)]);
+	ht->len++;
+
+	if (ht->old_buckets) {
+		hash_table_rehash(ht, HASH_TABLE_REHASH_STEP);
+	} else if (ht->len > ht->size * HASH_TABLE_MAX_LOAD &&
+		ht->size < HASH_TABLE_MAX_SIZE) {
+		/* Start growing, or retry on next insertion if out of memory */
+		if ((buckets = alloc_hash_buckets(ht->size * 2))) {
+			ht->old_buckets = ht->buckets;
+			ht->old_size = ht->size;
+			ht->rehash_index = 0;
+			ht->buckets = buckets;
+			ht->size *= 2;
+		}
+	}
+}
+
+static inline void hash_table_del(struct hash_table *ht, struct hash_entry *he)
+{
+	list_del(&he->list);
+	ht->len--;
 }
 
 /* -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=- */
 
+/**
+ * Timer wheel of one-second slots for expiring client entries. All
+ * entries share the same timeout, so one revolution covers every
+ * expiry time. Entries are not moved when refreshed, as that happens
+ * under the read lock: a due entry that has been refreshed meanwhile
+ * is simply filed again for its new expiry time.
+ */
+struct timer_wheel {
+	struct list_head *slots;
+	unsigned nr_slots;
+	time_t clock; /* second of the last slot processed */
+};
+
+static int timer_wheel_init(struct timer_wheel *tw, unsigned nr_slots, time_t now)
+{
+	if ((tw->slots = alloc_hash_buckets(nr_slots)) == NULL)
+		return -1;
+	tw->nr_slots = nr_slots;
+	tw->clock = now;
+	return 0;
+}
+
+static inline void timer_wheel_add(struct timer_wheel *tw,
+		struct list_head *timer, time_t expires)
+{
+	if (expires <= tw->clock)
+		expires = tw->clock + 1;
+	list_add_tail(timer, &tw->slots[expires % tw->nr_slots]);
+}
+
+/**
+ * Move the entries of the next due slot onto 'due', returns false once
+ * the wheel has caught up with 'now'.
+ */
+static bool timer_wheel_next(struct timer_wheel *tw, time_t now,
+		struct list_head *due)
+{
+	/* Wall clock set backwards, or far forwards */
+	if (now < tw->clock)
+		tw->clock = now;
+	if (now - tw->clock > tw->nr_slots)
+		tw->clock = now - tw->nr_slots;
+
+	if (tw->clock == now)
+		return false;
+	tw->clock++;
+	list_splice_init(&tw->slots[tw->clock % tw->nr_slots], due);
+	return true;
+}
+
+/* -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=- */
+
+/**
+ * Tunnelled traffic of a client entry, by each worker in a cache line of
+ * its own as the workers may share a client. Summed up when dumped.
+ */
+struct client_stats {
+	__u64 rx_packets;
+	__u64 rx_bytes;
+	__u64 tx_packets;
+	__u64 tx_bytes;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static const struct stats_field client_stats_fields[] = {
+	{ "rx_packets", offsetof(struct client_stats, rx_packets),
+		"Packets received from the client" },
+	{ "rx_bytes", offsetof(struct client_stats, rx_bytes),
+		"Bytes of packets received from the client" },
+	{ "tx_packets", offsetof(struct client_stats, tx_packets),
+		"Packets sent to the client" },
+	{ "tx_bytes", offsetof(struct client_stats, tx_bytes),
+		"Bytes of packets sent to the client" },
+	{ NULL, 0, NULL },
+};
+
+/* Kept for clients which number their datagrams */
+static const struct stats_field replay_stats_fields[] = {
+	{ "lost_packets", offsetof(struct replay_window, lost),
+		"Datagrams from the client skipped in its numbering" },
+	{ "reordered_packets", offsetof(struct replay_window, reordered),
+		"Datagrams from the client received late" },
+	{ "replayed_packets", offsetof(struct replay_window, replayed),
+		"Datagrams from the client dropped as seen before" },
+	{ NULL, 0, NULL },
+};
+
+/* Called by the worker owning 'st' alone */
+static inline void client_stats_rx(struct client_stats *st, size_t len)
+{
+	stats_add(&st->rx_packets, 1);
+	stats_add(&st->rx_bytes, len);
+}
+
+static inline void client_stats_tx(struct client_stats *st, size_t len)
+{
+	stats_add(&st->tx_packets, 1);
+	stats_add(&st->tx_bytes, len);
+}
+
+/* Field 'f' of the counters of a client entry, summed over the workers */
+static __u64 client_stats_value(const struct client_stats *st, const struct stats_field *f)
+{
+	__u64 sum = 0;
+	unsigned i;
+
+	for (i = 0; i < config.nr_queues; i++)
+		sum += stats_value(&st[i], f);
+	return sum;
+}
+
+/* -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=- */
+
+struct ra_entry;
+
+/* Groups sent to a client by one worker, see 'struct ra_fec' */
+struct ra_fec_tx {
+	struct fec_encoder *enc;
+	struct list_head open; /* on the worker's 'fec_open' while a group is */
+	struct ra_entry *re;
+};
+
+/**
+ * Error correction with a client that sends with it. Groups sent back
+ * are as large as the client's, and have as much parity. Each worker
+ * encodes its own, under the read lock.
+ */
+struct ra_fec {
+	struct fec_decoder *rx; /* NULL if none was left for the client */
+	unsigned k, m;
+	struct ra_fec_tx tx[];
+};
+
+/* Encoders of each worker with a group open, for closing them in time */
+static struct list_head *fec_open;
+
+/* Decoders are large, only '--fec-clients' of them are set aside. */
+static struct obj_pool fec_pool;
+
 struct ra_entry {
-	struct list_head list;
+	struct hash_entry node;
+	struct list_head timer;
 	struct sockaddr_inx real_addr;
 	struct timeval last_recv;
-	__u16 xmit_seq;
+	__u64 xmit_seq;
 	int refs;
+	struct ra_fec *fec; /* NULL unless the client sends with '--fec' */
+	struct replay_window *replay; /* NULL unless the client numbers its datagrams */
+	unsigned path; /* of a client it was last taken for, broadcast to the first only */
+	struct client_stats stats[]; /* one for each worker */
 };
 
 /* Hash table for dedicated clients (real addresses). */
-#define RA_SET_HASH_SIZE  (1 << 3)
-#define RA_SET_LIMIT_EACH_WALK  (10)
-static struct list_head ra_set_hbase[RA_SET_HASH_SIZE];
-static unsigned ra_set_len;
+static struct hash_table ra_set;
+static struct obj_pool ra_pool;
+static struct timer_wheel ra_wheel;
+
+/* Second in which the client is regarded inactive if not refreshed */
+static inline time_t client_expires(const struct timeval *last_recv)
+{
+	return last_recv->tv_sec + config.reconnect_timeo + 1;
+}
+
+static inline bool client_expired(const struct timeval *last_recv,
+		const struct timeval *now)
+{
+	return __sub_timeval_ms(now, last_recv) > config.reconnect_timeo * 1000;
+}
 
 static inline __u32 real_addr_hash(const struct sockaddr_inx *sa)
 {
@@ -87,30 +435,47 @@ static inline __u32 real_addr_hash(const struct sockaddr_inx *sa)
 	}
 }
 
+static struct ra_entry *ra_try_get(const struct sockaddr_inx *sa)
+{
+	__u32 hash = real_addr_hash(sa);
+	struct list_head *chains[2];
+	unsigned nr_chains = hash_table_lookup_chains(&ra_set, hash, chains), i;
+	struct ra_entry *re;
+
+	for (i = 0; i < nr_chains; i++) {
+		list_for_each_entry (re, chains[i], node.list) {
+			if (re->node.hash == hash && is_sockaddr_equal(&re->real_addr, sa))
+				return re;
+		}
+	}
+	return NULL;
+}
+
 static struct ra_entry *ra_get_or_create(const struct sockaddr_inx *sa)
 {
-	struct list_head *chain = &ra_set_hbase[
-		real_addr_hash(sa) & (RA_SET_HASH_SIZE - 1)];
 	struct ra_entry *re;
 	char s_real_addr[50];
 
-	list_for_each_entry (re, chain, list) {
-		if (is_sockaddr_equal(&re->real_addr, sa)) {
-			re->refs++;
-			return re;
-		}
+	if ((re = ra_try_get(sa))) {
+		re->refs++;
+		return re;
 	}
 
-	if ((re = malloc(sizeof(*re))) == NULL) {
-		syslog(LOG_ERR, "*** [%s] malloc(): %s.", __FUNCTION__, strerror(errno));
+	if ((re = obj_pool_alloc(&ra_pool)) == NULL) {
+		syslog(LOG_ERR, "*** [%s] obj_pool_alloc(): %s.", __FUNCTION__, strerror(errno));
 		return NULL;
 	}
 
 	re->real_addr = *sa;
-	re->xmit_seq = (__u16)rand();
+	gettimeofday(&re->last_recv, NULL);
+	memset(re->stats, 0x0, sizeof(re->stats[0]) * config.nr_queues);
+	re->xmit_seq = initial_xmit_seq();
 	re->refs = 1;
-	list_add_tail(&re->list, chain);
-	ra_set_len++;
+	re->fec = NULL;
+	re->replay = NULL;
+	re->path = 0;
+	hash_table_add(&ra_set, &re->node, real_addr_hash(sa));
+	timer_wheel_add(&ra_wheel, &re->timer, client_expires(&re->last_recv));
 
 	inet_ntop(re->real_addr.sa.sa_family, addr_of_sockaddr(&re->real_addr),
 			s_real_addr, sizeof(s_real_addr));
@@ -120,6 +485,60 @@ static struct ra_entry *ra_get_or_create(const struct sockaddr_inx *sa)
 	return re;
 }
 
+static void ra_fec_free(struct ra_fec *rf)
+{
+	unsigned i;
+
+	for (i = 0; i < config.nr_queues; i++) {
+		if (!list_empty(&rf->tx[i].open))
+			list_del(&rf->tx[i].open);
+		if (rf->tx[i].enc)
+			fec_encoder_free(rf->tx[i].enc);
+	}
+	if (rf->rx) {
+		fec_decoder_destroy(rf->rx);
+		obj_pool_free(&fec_pool, rf->rx);
+	}
+	free(rf);
+}
+
+/**
+ * Error correction state of a client, called with the write lock held.
+ * With all decoders taken, the client is refused error correction: its
+ * data shards are taken as they are, and none are sent back.
+ */
+static struct ra_fec *ra_fec_create(struct ra_entry *re)
+{
+	struct ra_fec *rf;
+	char s_real_addr[50];
+	void *mem;
+	unsigned i;
+
+	if ((rf = calloc(1, sizeof(*rf) + sizeof(rf->tx[0]) * config.nr_queues)) == NULL)
+		return NULL;
+	for (i = 0; i < config.nr_queues; i++) {
+		INIT_LIST_HEAD(&rf->tx[i].open);
+		rf->tx[i].re = re;
+	}
+	if ((mem = obj_pool_alloc(&fec_pool)) == NULL) {
+		inet_ntop(re->real_addr.sa.sa_family, addr_of_sockaddr(&re->real_addr),
+				s_real_addr, sizeof(s_real_addr));
+		syslog(LOG_WARNING, "*** No error correction for client [%s:%u], %u have it.",
+				s_real_addr, ntohs(port_of_sockaddr(&re->real_addr)), fec_pool.nr_used);
+		return rf;
+	}
+	rf->rx = fec_decoder_init(mem);
+	for (i = 0; i < config.nr_queues; i++) {
+		if ((rf->tx[i].enc = fec_encoder_new(i)) == NULL)
+			goto fail;
+	}
+	return rf;
+
+fail:
+	ra_fec_free(rf);
+	return NULL;
+}
+
 static inline void ra_put_no_free(struct ra_entry *re)
 {
 	assert(re->refs > 0);
@@ -131,15 +550,21 @@ static inline void ra_entry_release(struct ra_entry *re)
 	char s_real_addr[50];
 
 	assert(re->refs == 0);
-	list_del(&re->list);
-	ra_set_len--;
+	hash_table_del(&ra_set, &re->node);
+	list_del(&re->timer);
 
 	inet_ntop(re->real_addr.sa.sa_family, addr_of_sockaddr(&re->real_addr),
 			s_real_addr, sizeof(s_real_addr));
 	syslog(LOG_INFO, "Recycled client [%s:%u]", s_real_addr,
 			ntohs(port_of_sockaddr(&re->real_addr)));
 
-	free(re);
+	if (re->fec)
+		ra_fec_free(re->fec);
+	if (re->replay) {
+		replay_window_destroy(re->replay);
+		free(re->replay);
+	}
+	obj_pool_free(&ra_pool, re);
 }
 
 struct tun_addr {
@@ -150,30 +575,45 @@ struct tun_addr {
 		struct mac_addr mac;
 	};
 };
+/**
+ * A client with several paths numbers its datagrams, telling the path
+ * each came over. It has a real address for each, and is sent to over
+ * those it has lately sent data over. Others have only the first.
+ */
 struct tun_client {
-	struct list_head list;
+	struct hash_entry node;
+	struct list_head timer;
 	struct tun_addr virt_addr;
-	struct ra_entry *ra;
+	struct ra_entry *paths[MAX_CLIENT_PATHS];
+	struct timeval path_recv[MAX_CLIENT_PATHS]; /* last data over each path */
 	struct timeval last_recv;
+	bool numbered; /* the client numbers its datagrams */
+	__u64 seq_floor[MAX_CLIENT_PATHS]; /* highest number taken from each path */
+	struct client_stats stats[]; /* one for each worker */
 };
 
 /* Hash table of virtual address in tunnel. */
-#define VA_MAP_HASH_SIZE  (1 << 4)
-#define VA_MAP_LIMIT_EACH_WALK  (10)
-static struct list_head va_map_hbase[VA_MAP_HASH_SIZE];
-static unsigned va_map_len;
+static struct hash_table va_map;
+static struct obj_pool va_pool;
+static struct timer_wheel va_wheel;
 
-static inline void init_va_ra_maps(void)
+static inline int init_va_ra_maps(unsigned size, unsigned limit)
 {
-	int i;
-
-	for (i = 0; i < VA_MAP_HASH_SIZE; i++)
-		INIT_LIST_HEAD(&va_map_hbase[i]);
-	va_map_len = 0;
+	struct timeval now;
 
-	for (i = 0; i < RA_SET_HASH_SIZE; i++)
-		INIT_LIST_HEAD(&ra_set_hbase[i]);
-	ra_set_len = 0;
+	gettimeofday(&now, NULL);
+	if (hash_table_init(&va_map, size) < 0 ||
+		hash_table_init(&ra_set, size) < 0)
+		return -1;
+	if (timer_wheel_init(&va_wheel, config.reconnect_timeo + 2, now.tv_sec) < 0 ||
+		timer_wheel_init(&ra_wheel, config.reconnect_timeo + 2, now.tv_sec) < 0)
+		return -1;
+	if (obj_pool_init(&va_pool, sizeof(struct tun_client) +
+				sizeof(struct client_stats) * config.nr_queues, limit) < 0 ||
+		obj_pool_init(&ra_pool, sizeof(struct ra_entry) +
+				sizeof(struct client_stats) * config.nr_queues, limit) < 0)
+		return -1;
+	return 0;
 }
 
 static inline __u32 tun_addr_hash(const struct tun_addr *addr)
@@ -240,172 +680,457 @@ static void tun_addr_ntop(const struct tun_addr *a, char *buf, socklen_t bufsz)
 	}
 }
 
+/* Path the client was last heard from over, it always has one */
+static struct ra_entry *tun_client_last_path(const struct tun_client *ce)
+{
+	struct ra_entry *last = NULL;
+	unsigned p;
+
+	for (p = 0; p < MAX_CLIENT_PATHS; p++) {
+		struct ra_entry *re = ce->paths[p];
+		if (re && (last == NULL || timercmp(&re->last_recv, &last->last_recv, >)))
+			last = re;
+	}
+	return last;
+}
+
 #ifdef DUMP_TUN_CLIENTS_ON_WALK
 static inline void tun_client_dump(struct tun_client *ce)
 {
+	struct ra_entry *re = tun_client_last_path(ce);
 	char s_virt_addr[50] = "", s_real_addr[50] = "";
 
 	tun_addr_ntop(&ce->virt_addr, s_virt_addr, sizeof(s_virt_addr));
-	inet_ntop(ce->ra->real_addr.sa.sa_family, addr_of_sockaddr(&ce->ra->real_addr),
+	inet_ntop(re->real_addr.sa.sa_family, addr_of_sockaddr(&re->real_addr),
 			  s_real_addr, sizeof(s_real_addr));
 	printf("[%s] (%s:%u), last_recv: %lu\n", s_virt_addr,
-			s_real_addr, ntohs(port_of_sockaddr(&ce->ra->real_addr)),
+			s_real_addr, ntohs(port_of_sockaddr(&re->real_addr)),
 			(unsigned long)ce->last_recv.tv_sec);
 }
 #endif
 
 static inline void tun_client_release(struct tun_client *ce)
 {
+	struct ra_entry *re = tun_client_last_path(ce);
 	char s_virt_addr[50], s_real_addr[50];
+	unsigned p;
 
 	tun_addr_ntop(&ce->virt_addr, s_virt_addr, sizeof(s_virt_addr));
-	inet_ntop(ce->ra->real_addr.sa.sa_family, addr_of_sockaddr(&ce->ra->real_addr),
+	inet_ntop(re->real_addr.sa.sa_family, addr_of_sockaddr(&re->real_addr),
 			s_real_addr, sizeof(s_real_addr));
 	syslog(LOG_INFO, "Recycled virtual address [%s] at [%s:%u].", s_virt_addr,
-			s_real_addr, ntohs(port_of_sockaddr(&ce->ra->real_addr)));
+			s_real_addr, ntohs(port_of_sockaddr(&re->real_addr)));
+
+	for (p = 0; p < MAX_CLIENT_PATHS; p++) {
+		if (ce->paths[p])
+			ra_put_no_free(ce->paths[p]);
+	}
+
+	hash_table_del(&va_map, &ce->node);
+	list_del(&ce->timer);
 
-	ra_put_no_free(ce->ra);
+	obj_pool_free(&va_pool, ce);
+}
 
-	list_del(&ce->list);
-	va_map_len--;
+/* Let go of the paths other than the latest that have gone quiet */
+static void tun_client_expire_paths(struct tun_client *ce, const struct timeval *now)
+{
+	struct ra_entry *last = tun_client_last_path(ce);
+	unsigned p;
 
-	free(ce);
+	for (p = 0; p < MAX_CLIENT_PATHS; p++) {
+		struct ra_entry *re = ce->paths[p];
+		if (re && re != last && client_expired(&re->last_recv, now)) {
+			ra_put_no_free(re);
+			ce->paths[p] = NULL;
+		}
+	}
 }
 
-static struct tun_client *tun_client_try_get(const struct tun_addr *vaddr)
+static struct tun_client *__tun_client_try_get(const struct tun_addr *vaddr,
+		__u32 hash)
 {
-	struct list_head *chain = &va_map_hbase[
-		tun_addr_hash(vaddr) & (VA_MAP_HASH_SIZE - 1)];
+	struct list_head *chains[2];
+	unsigned nr_chains = hash_table_lookup_chains(&va_map, hash, chains), i;
 	struct tun_client *ce;
 
-	list_for_each_entry (ce, chain, list) {
-		if (tun_addr_comp(&ce->virt_addr, vaddr) == 0)
-			return ce;
+	for (i = 0; i < nr_chains; i++) {
+		list_for_each_entry (ce, chains[i], node.list) {
+			if (ce->node.hash == hash && tun_addr_comp(&ce->virt_addr, vaddr) == 0)
+				return ce;
+		}
 	}
 	return NULL;
 }
 
-static struct tun_client *tun_client_get_or_create(
-		const struct tun_addr *vaddr, const struct sockaddr_inx *raddr)
+static inline struct tun_client *tun_client_try_get(const struct tun_addr *vaddr)
 {
-	struct list_head *chain = &va_map_hbase[
-		tun_addr_hash(vaddr) & (VA_MAP_HASH_SIZE - 1)];
-	struct tun_client *ce, *__ce;
+	return __tun_client_try_get(vaddr, tun_addr_hash(vaddr));
+}
+
+static struct tun_client *tun_client_get_or_create(const struct tun_addr *vaddr,
+		const struct sockaddr_inx *raddr, unsigned path)
+{
+	__u32 hash = tun_addr_hash(vaddr);
+	struct tun_client *ce;
+	struct ra_entry *re;
 	char s_virt_addr[50], s_real_addr[50];
 
-	list_for_each_entry_safe (ce, __ce, chain, list) {
-		if (tun_addr_comp(&ce->virt_addr, vaddr) == 0) {
-			if (!is_sockaddr_equal(&ce->ra->real_addr, raddr)) {
-				/* Real address changed, reassign a new entry for it. */
-				ra_put_no_free(ce->ra);
-				if ((ce->ra = ra_get_or_create(raddr)) == NULL) {
-					tun_client_release(ce);
-					return NULL;
-				}
-			}
-			return ce;
+	if ((ce = __tun_client_try_get(vaddr, hash))) {
+		if (ce->paths[path] == NULL ||
+			!is_sockaddr_equal(&ce->paths[path]->real_addr, raddr)) {
+			/* New path, or its real address changed, assign an entry for it. */
+			if ((re = ra_get_or_create(raddr)) == NULL)
+				return NULL;
+			if (ce->paths[path])
+				ra_put_no_free(ce->paths[path]);
+			ce->paths[path] = re;
+			re->path = path;
+			timerclear(&ce->path_recv[path]);
 		}
+		return ce;
 	}
 
 	/* Not found, always create new entry. */
-	if ((ce = malloc(sizeof(*ce))) == NULL) {
-		syslog(LOG_ERR, "*** [%s] malloc(): %s.", __FUNCTION__, strerror(errno));
+	if ((ce = obj_pool_alloc(&va_pool)) == NULL) {
+		syslog(LOG_ERR, "*** [%s] obj_pool_alloc(): %s.", __FUNCTION__, strerror(errno));
 		return NULL;
 	}
 
 	ce->virt_addr = *vaddr;
+	gettimeofday(&ce->last_recv, NULL);
+	memset(ce->stats, 0x0, sizeof(ce->stats[0]) * config.nr_queues);
+	memset(ce->paths, 0x0, sizeof(ce->paths));
+	memset(ce->path_recv, 0x0, sizeof(ce->path_recv));
+	ce->numbered = false;
+	memset(ce->seq_floor, 0x0, sizeof(ce->seq_floor));
 
 	/* Get real_addr entry before adding to list. */
-	if ((ce->ra = ra_get_or_create(raddr)) == NULL) {
-		free(ce);
+	if ((re = ra_get_or_create(raddr)) == NULL) {
+		obj_pool_free(&va_pool, ce);
 		return NULL;
 	}
-	list_add_tail(&ce->list, chain);
-	va_map_len++;
+	ce->paths[path] = re;
+	re->path = path;
+	hash_table_add(&va_map, &ce->node, hash);
+	timer_wheel_add(&va_wheel, &ce->timer, client_expires(&ce->last_recv));
 
 	tun_addr_ntop(&ce->virt_addr, s_virt_addr, sizeof(s_virt_addr));
-	inet_ntop(ce->ra->real_addr.sa.sa_family, addr_of_sockaddr(&ce->ra->real_addr),
+	inet_ntop(re->real_addr.sa.sa_family, addr_of_sockaddr(&re->real_addr),
 			  s_real_addr, sizeof(s_real_addr));
 	syslog(LOG_INFO, "New virtual address [%s] at [%s:%u].", s_virt_addr,
-			s_real_addr, ntohs(port_of_sockaddr(&ce->ra->real_addr)));
+			s_real_addr, ntohs(port_of_sockaddr(&re->real_addr)));
 
 	return ce;
 }
 
+/* Path of the client a datagram numbered as 'ns' came over */
+static inline unsigned netmsg_client_path(const struct netmsg_seq *ns)
+{
+	return ns->seq ? ns->path : 0;
+}
+
+/* Whether 'raddr' is the real address the client has for 'path' */
+static inline bool tun_client_at_path(const struct tun_client *ce, unsigned path,
+		const struct sockaddr_inx *raddr)
+{
+	return ce->paths[path] && is_sockaddr_equal(&ce->paths[path]->real_addr, raddr);
+}
+
+/* Whether 'raddr' is on the host of one of the client's paths, whatever the port */
+static bool tun_client_at_host(const struct tun_client *ce, const struct sockaddr_inx *raddr)
+{
+	size_t alen = raddr->sa.sa_family == AF_INET6 ? 16 : 4;
+	unsigned p;
+
+	for (p = 0; p < MAX_CLIENT_PATHS; p++) {
+		struct ra_entry *re = ce->paths[p];
+		if (re && re->real_addr.sa.sa_family == raddr->sa.sa_family &&
+			memcmp(addr_of_sockaddr(&re->real_addr), addr_of_sockaddr(raddr), alen) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Whether the client has not been heard from over any path for a reconnect timeout */
+static bool tun_client_silent(const struct tun_client *ce, const struct timeval *now)
+{
+	unsigned p;
+
+	for (p = 0; p < MAX_CLIENT_PATHS; p++) {
+		if (ce->paths[p] && !client_expired(&ce->paths[p]->last_recv, now))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * The client stopped numbering its datagrams, as it has been restarted
+ * without '-W', and is left with its first path. Called with the write
+ * lock held.
+ */
+static void tun_client_unnumber(struct tun_client *ce)
+{
+	unsigned p;
+
+	for (p = 1; p < MAX_CLIENT_PATHS; p++) {
+		if (ce->paths[p]) {
+			ra_put_no_free(ce->paths[p]);
+			ce->paths[p] = NULL;
+		}
+	}
+	ce->numbered = false;
+}
+
+/**
+ * Whether a datagram numbered as 'ns' speaks for 'ce', 'at_path' if it
+ * came from the real address the client has for its path. Once a client
+ * numbers its datagrams, a real address is taken for one of its paths
+ * only with a number above the highest yet from that path, from wherever
+ * it came. A datagram replayed from another address is not, so it can
+ * neither get in nor take the path over; replayed from the same one, its
+ * replay window drops it. Called with the read lock held.
+ */
+static bool tun_client_vouch(struct tun_client *ce, bool at_path,
+		const struct netmsg_seq *ns)
+{
+	__u64 *floor, seq;
+
+	if (ns->seq == 0)
+		return !__atomic_load_n(&ce->numbered, __ATOMIC_RELAXED);
+	if (ns->path >= MAX_CLIENT_PATHS)
+		return false;
+
+	floor = &ce->seq_floor[ns->path];
+	seq = __atomic_load_n(floor, __ATOMIC_RELAXED);
+	if (!at_path && ns->seq <= seq)
+		return false;
+	while (ns->seq > seq && !__atomic_compare_exchange_n(floor, &seq, ns->seq,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	if (!__atomic_load_n(&ce->numbered, __ATOMIC_RELAXED))
+		__atomic_store_n(&ce->numbered, true, __ATOMIC_RELAXED);
+	return true;
+}
+
+/**
+ * Get the entry of a virtual address claimed by a datagram from 'raddr',
+ * numbered as 'ns', moving the path it came over there if need be. An
+ * unnumbered one is taken for a client that numbered its datagrams only
+ * from the host of one of its paths, as from the client restarted without
+ * '-W' on a new port, and only once all its paths have gone silent: an
+ * old capture replayed while the client is up must not turn its numbering
+ * off. Returns NULL, with the drop counted, if the datagram does not speak
+ * for the client or no entry can be had. Called with the write lock held.
+ */
+static struct tun_client *tun_client_claim(struct worker *w, const struct tun_addr *vaddr,
+		const struct sockaddr_inx *raddr, const struct netmsg_seq *ns,
+		const struct timeval *now)
+{
+	unsigned path = netmsg_client_path(ns);
+	struct tun_client *ce;
+	bool restarted = false;
+
+	if (path >= MAX_CLIENT_PATHS) {
+		stats_drop(&w->stats, DROP_BAD_PATH);
+		return NULL;
+	}
+	if ((ce = tun_client_try_get(vaddr))) {
+		restarted = ns->seq == 0 && ce->numbered && tun_client_at_host(ce, raddr) &&
+			tun_client_silent(ce, now);
+		if (!restarted && !tun_client_vouch(ce, tun_client_at_path(ce, path, raddr), ns)) {
+			stats_drop(&w->stats, DROP_REPLAYED);
+			return NULL;
+		}
+	}
+	if ((ce = tun_client_get_or_create(vaddr, raddr, path)) == NULL) {
+		stats_drop(&w->stats, DROP_NO_CLIENT);
+		return NULL;
+	}
+	if (restarted)
+		tun_client_unnumber(ce);
+	/* Sets the floors of a new entry */
+	tun_client_vouch(ce, true, ns);
+	return ce;
+}
+
+/* Account a packet of 'len' bytes from the client over 'path' */
+static inline void tun_client_rx(struct worker *w, struct tun_client *ce, unsigned path,
+		size_t len, const struct timeval *now)
+{
+	struct ra_entry *re = ce->paths[path];
+
+	ce->last_recv = *now;
+	ce->path_recv[path] = *now;
+	re->last_recv = *now;
+	client_stats_rx(&ce->stats[w->id], len);
+	client_stats_rx(&re->stats[w->id], len);
+}
+
+/**
+ * Refresh the entry of a virtual address seen at 'raddr' and account a
+ * packet of 'len' bytes from it, called with the read lock held.
+ * Returns false, with the drop counted, if the packet is not to be
+ * taken from there.
+ */
+static bool tun_client_refresh(struct worker *w, const struct tun_addr *vaddr,
+		const struct sockaddr_inx *raddr, const struct netmsg_seq *ns,
+		size_t len, const struct timeval *now)
+{
+	unsigned path = netmsg_client_path(ns);
+	struct tun_client *ce;
+
+	if (path < MAX_CLIENT_PATHS && (ce = tun_client_try_get(vaddr)) &&
+		tun_client_at_path(ce, path, raddr) && tun_client_vouch(ce, true, ns)) {
+		tun_client_rx(w, ce, path, len, now);
+		return true;
+	}
+
+	/**
+	 * New or moved address, or a client that stopped numbering its
+	 * datagrams, the tables have to be modified.
+	 */
+	va_ra_lock_upgrade();
+	if ((ce = tun_client_claim(w, vaddr, raddr, ns, now)))
+		tun_client_rx(w, ce, path, len, now);
+	va_ra_lock_downgrade();
+
+	return ce != NULL;
+}
+
+/* A path carries frames to the client while it carries data from it */
+#define PATH_ACTIVE_MS  500
+
+/**
+ * Real address to send a frame to the client at: by the flow of the
+ * frame, one of the paths the client has lately sent data over, as it
+ * spreads its own flows or fails over, or else the one it was last heard
+ * from over. Called with the read lock held.
+ */
+static struct ra_entry *tun_client_path(struct tun_client *ce, __be16 proto,
+		const void *data, size_t len, const struct timeval *now)
+{
+	struct ra_entry *active[MAX_CLIENT_PATHS];
+	unsigned p, n = 0;
+
+	for (p = 0; p < MAX_CLIENT_PATHS; p++) {
+		if (ce->paths[p] && __sub_timeval_ms(now, &ce->path_recv[p]) < PATH_ACTIVE_MS)
+			active[n++] = ce->paths[p];
+	}
+	if (n == 0)
+		return tun_client_last_path(ce);
+	if (n == 1)
+		return active[0];
+	return active[flow_hash(proto, data, len) % n];
+}
+
+/**
+ * Entry of a virtual address routed via the client at 'gw', over the
+ * same paths. Called with the write lock held.
+ */
+static struct tun_client *tun_client_route(const struct tun_addr *vaddr,
+		const struct tun_addr *gw)
+{
+	struct tun_client *gce, *ce = NULL;
+	unsigned p;
+
+	if ((ce = tun_client_try_get(vaddr)) || (gce = tun_client_try_get(gw)) == NULL)
+		return ce;
+
+	for (p = 0; p < MAX_CLIENT_PATHS; p++) {
+		if (gce->paths[p] && (ce = tun_client_get_or_create(vaddr,
+				&gce->paths[p]->real_addr, p)) == NULL)
+			return NULL;
+	}
+	memcpy(ce->path_recv, gce->path_recv, sizeof(ce->path_recv));
+	ce->numbered = gce->numbered;
+	memcpy(ce->seq_floor, gce->seq_floor, sizeof(ce->seq_floor));
+	return ce;
+}
+
 /* Send echo reply back to a client */
-static void reply_an_echo_ack(struct minivtun_msg *req, struct ra_entry *re)
+static void reply_an_echo_ack(struct worker *w, struct minivtun_msg *req,
+		struct ra_entry *re)
 {
-	char in_data[64], crypt_buffer[64];
-	struct minivtun_msg *nmsg = (struct minivtun_msg *)in_data;
+	char in_data[MSG_RING_HEADROOM + 64 + MSG_RING_TAILROOM];
+	struct minivtun_msg *nmsg = (void *)(in_data + MSG_RING_HEADROOM);
 	void *out_msg;
 	size_t out_len;
+	__u64 seq = next_xmit_seq(&re->xmit_seq);
 
 	memset(&nmsg->hdr, 0x0, sizeof(nmsg->hdr));
 	nmsg->hdr.opcode = MINIVTUN_MSG_ECHO_ACK;
-	nmsg->hdr.seq = htons(re->xmit_seq++);
+	nmsg->hdr.seq = htons(seq);
 	memcpy(nmsg->hdr.auth_key, config.crypto_key, sizeof(nmsg->hdr.auth_key));
 	nmsg->echo = req->echo;
 
-	out_msg = crypt_buffer;
 	out_len = MINIVTUN_MSG_BASIC_HLEN + sizeof(nmsg->echo);
-	local_to_netmsg(nmsg, &out_msg, &out_len);
+	if (re->replay)
+		nmsg = netmsg_push_seq(nmsg, &out_len, seq, 0);
+	out_msg = local_to_netmsg(w, nmsg, &out_len);
+	stats_add(&w->stats.net_tx_packets, 1);
+	stats_add(&w->stats.net_tx_bytes, out_len);
 
-	(void)sendto(state.sockfd, out_msg, out_len, 0,
+	if (sendto(w->sockfd, out_msg, out_len, 0,
 			(const struct sockaddr *)&re->real_addr,
-			sizeof_sockaddr(&re->real_addr));
+			sizeof_sockaddr(&re->real_addr)) < 0)
+		stats_drop(&w->stats, DROP_NET_SEND);
 }
 
-static void va_ra_walk_continue(void)
+static void va_ra_expire(struct event_loop *loop, const struct timeval *now)
 {
-	static unsigned va_index = 0, ra_index = 0;
-	struct timeval __current;
-	unsigned va_walk_max = VA_MAP_LIMIT_EACH_WALK, va_count = 0;
-	unsigned ra_walk_max = RA_SET_LIMIT_EACH_WALK, ra_count = 0;
-	unsigned __va_index = va_index, __ra_index = ra_index;
+	static unsigned last_va_len = 0, last_ra_len = 0;
 	struct tun_client *ce, *__ce;
 	struct ra_entry *re, *__re;
+	struct list_head due;
 
-	gettimeofday(&__current, NULL);
+	INIT_LIST_HEAD(&due);
 
-	if (va_walk_max > va_map_len)
-		va_walk_max = va_map_len;
-	if (ra_walk_max > ra_set_len)
-		ra_walk_max = ra_set_len;
+	pthread_rwlock_wrlock(&va_ra_lock);
+
+	/* Also move on with growing tables which get no more insertions. */
+	hash_table_rehash(&va_map, HASH_TABLE_REHASH_STEP * 16);
+	hash_table_rehash(&ra_set, HASH_TABLE_REHASH_STEP * 16);
 
 	/* Recycle timeout virtual address entries. */
-	if (va_walk_max > 0) {
-		do {
-			list_for_each_entry_safe (ce, __ce, &va_map_hbase[va_index], list) {
+	while (timer_wheel_next(&va_wheel, now->tv_sec, &due)) {
+		list_for_each_entry_safe (ce, __ce, &due, timer) {
 #ifdef DUMP_TUN_CLIENTS_ON_WALK
-				tun_client_dump(ce);
+			tun_client_dump(ce);
 #endif
-				if (__sub_timeval_ms(&__current, &ce->last_recv) >
-					config.reconnect_timeo * 1000) {
-					tun_client_release(ce);
-				}
-				va_count++;
+			if (client_expired(&ce->last_recv, now)) {
+				tun_client_release(ce);
+			} else {
+				tun_client_expire_paths(ce, now);
+				list_del(&ce->timer);
+				timer_wheel_add(&va_wheel, &ce->timer, client_expires(&ce->last_recv));
 			}
-			va_index = (va_index + 1) & (VA_MAP_HASH_SIZE - 1);
-		} while (va_count < va_walk_max && va_index != __va_index);
+		}
 	}
 
-	/* Recycle or keep-alive real client addresses. */
-	if (ra_walk_max > 0) {
-		do {
-			list_for_each_entry_safe (re, __re, &ra_set_hbase[ra_index], list) {
-				if (__sub_timeval_ms(&__current, &re->last_recv) >
-					config.reconnect_timeo * 1000) {
-					if (re->refs == 0) {
-						ra_entry_release(re);
-					}
-				}
-				ra_count++;
+	/* Recycle real client addresses no longer in use. */
+	while (timer_wheel_next(&ra_wheel, now->tv_sec, &due)) {
+		list_for_each_entry_safe (re, __re, &due, timer) {
+			if (client_expired(&re->last_recv, now) && re->refs == 0) {
+				ra_entry_release(re);
+			} else {
+				/* Retry in a second if still referenced */
+				list_del(&re->timer);
+				timer_wheel_add(&ra_wheel, &re->timer, client_expires(&re->last_recv));
 			}
-			ra_index = (ra_index + 1) & (RA_SET_HASH_SIZE - 1);
-		} while (ra_count < ra_walk_max && ra_index != __ra_index);
+		}
+	}
+
+	if (ra_set.len != last_ra_len || va_map.len != last_va_len) {
+		printf("Online clients: %u, addresses: %u\n", ra_set.len, va_map.len);
+		last_ra_len = ra_set.len;
+		last_va_len = va_map.len;
 	}
 
-	printf("Online clients: %u, addresses: %u\n", ra_set_len, va_map_len);
+	pthread_rwlock_unlock(&va_ra_lock);
+
+	if (config.drop_log_interval)
+		stats_log_drops(now);
 }
 
 static inline void source_addr_of_ipdata(
@@ -447,166 +1172,423 @@ static inline void dest_addr_of_ipdata(
 }
 
 
-static int network_receiving(void)
+/**
+ * Write the packet of an IPDATA message of 'out_dlen' bytes from 'real_peer'
+ * to the TUN queue. Called with the read lock of the client tables held.
+ */
+static void handle_ipdata(struct worker *w, struct minivtun_msg *nmsg, size_t out_dlen,
+		const struct sockaddr_inx *real_peer, const struct netmsg_seq *ns,
+		const struct timeval *now)
 {
-	char read_buffer[NM_PI_BUFFER_SIZE], crypt_buffer[NM_PI_BUFFER_SIZE];
-	struct minivtun_msg *nmsg;
 	struct tun_pi pi;
-	void *out_data;
-	size_t ip_dlen, out_dlen;
+	size_t ip_dlen;
 	unsigned short af = 0;
 	struct tun_addr virt_addr;
-	struct tun_client *ce;
+
+	if (config.tap_mode) {
+		af = AF_MACADDR;
+		/* No ethernet packet is shorter than 12 bytes. */
+		if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 12) {
+			stats_drop(&w->stats, DROP_SHORT_PACKET);
+			return;
+		}
+		nmsg->ipdata.proto = 0;
+		ip_dlen = out_dlen - MINIVTUN_MSG_IPDATA_OFFSET;
+	} else {
+		if (nmsg->ipdata.proto == htons(ETH_P_IP)) {
+			af = AF_INET;
+			/* No valid IP packet is shorter than 20 bytes. */
+			if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 20) {
+				stats_drop(&w->stats, DROP_SHORT_PACKET);
+				return;
+			}
+		} else if (nmsg->ipdata.proto == htons(ETH_P_IPV6)) {
+			af = AF_INET6;
+			if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 40) {
+				stats_drop(&w->stats, DROP_SHORT_PACKET);
+				return;
+			}
+		} else {
+			syslog(LOG_WARNING, "*** Invalid protocol: 0x%x.", ntohs(nmsg->ipdata.proto));
+			stats_drop(&w->stats, DROP_BAD_PROTO);
+			return;
+		}
+		ip_dlen = ntohs(nmsg->ipdata.ip_dlen);
+		/* Drop incomplete IP packets. */
+		if (out_dlen - MINIVTUN_MSG_IPDATA_OFFSET < ip_dlen) {
+			stats_drop(&w->stats, DROP_TRUNCATED);
+			return;
+		}
+	}
+
+	source_addr_of_ipdata(nmsg->ipdata.data, af, &virt_addr);
+	if (!tun_client_refresh(w, &virt_addr, real_peer, ns, ip_dlen, now))
+		return;
+
+	pi.flags = 0;
+	pi.proto = nmsg->ipdata.proto;
+	osx_ether_to_af(&pi.proto);
+	if (tun_write_frame(w, &pi, (char *)nmsg + MINIVTUN_MSG_IPDATA_OFFSET,
+			ip_dlen) < 0) {
+		stats_drop(&w->stats, DROP_TUN_WRITE);
+		return;
+	}
+	stats_add(&w->stats.tun_tx_packets, 1);
+	stats_add(&w->stats.tun_tx_bytes, ip_dlen);
+}
+
+/**
+ * FEC_DATA and FEC_PARITY messages, with the data shards they complete.
+ * The first one from a client sets up error correction with it, in both
+ * directions, if a decoder is left for it. Called with the read lock of
+ * the client tables held.
+ */
+static void handle_fec_netmsg(struct worker *w, struct minivtun_msg *nmsg, size_t dlen,
+		const struct sockaddr_inx *real_peer, const struct netmsg_seq *ns,
+		const struct timeval *now)
+{
+	struct fec_recovered rec;
+	struct fec_trailer tr;
 	struct ra_entry *re;
-	struct sockaddr_inx real_peer;
-	socklen_t real_peer_alen;
-	struct iovec iov[2];
-	struct timeval __current;
+	unsigned i;
 	int rc;
 
-	gettimeofday(&__current, NULL);
-
-	real_peer_alen = sizeof(real_peer);
-	rc = recvfrom(state.sockfd, &read_buffer, NM_PI_BUFFER_SIZE, 0,
-			(struct sockaddr *)&real_peer, &real_peer_alen);
-	if (rc <= 0)
-		return -1;
+	if ((re = ra_try_get(real_peer)) == NULL || re->fec == NULL) {
+		va_ra_lock_upgrade();
+		if ((re = ra_get_or_create(real_peer))) {
+			re->last_recv = *now;
+			if (re->fec == NULL && (re->fec = ra_fec_create(re)) == NULL)
+				syslog(LOG_ERR, "*** [%s] Cannot allocate FEC state.", __FUNCTION__);
+			ra_put_no_free(re);
+		}
+		va_ra_lock_downgrade();
+		/* It might have been recycled while the lock was dropped. */
+		if ((re = ra_try_get(real_peer)) == NULL || re->fec == NULL) {
+			stats_drop(&w->stats, DROP_NO_CLIENT);
+			return;
+		}
+	}
 
-	out_data = crypt_buffer;
-	out_dlen = (size_t)rc;
-	netmsg_to_local(read_buffer, &out_data, &out_dlen);
-	nmsg = out_data;
+	if ((rc = netmsg_fec_decode(w, re->fec->rx, nmsg, dlen, &tr, &rec)) > 0 && re->fec->rx) {
+		/* Mirror the client's groups, its parity follows the loss it sees. */
+		__atomic_store_n(&re->fec->k, tr.k, __ATOMIC_RELAXED);
+		__atomic_store_n(&re->fec->m, tr.m, __ATOMIC_RELAXED);
+	}
 
-	if (out_dlen < MINIVTUN_MSG_BASIC_HLEN)
-		return 0;
+	/**
+	 * The entry is not to be touched from here, the lock may be dropped.
+	 * Rebuilt packets speak for the client as the shard that completed
+	 * their group.
+	 */
+	if (rc > 0)
+		handle_ipdata(w, nmsg, rc, real_peer, ns, now);
+	for (i = 0; i < rec.nr; i++)
+		handle_ipdata(w, (struct minivtun_msg *)rec.bufs[i], rec.lens[i], real_peer, ns, now);
+}
 
-	/* Verify password. */
-	if (memcmp(nmsg->hdr.auth_key, config.crypto_key,
-		sizeof(nmsg->hdr.auth_key)) != 0)
-		return 0;
+/**
+ * Pass a datagram numbered by a client through the replay window kept
+ * for it, which the first one sets up. Returns false if it is to be
+ * dropped. Called with the read lock of the client tables held.
+ */
+static bool ra_replay_check(struct worker *w, const struct sockaddr_inx *real_peer,
+		__u64 seq, const struct timeval *now)
+{
+	struct ra_entry *re;
 
-	switch (nmsg->hdr.opcode) {
-	case MINIVTUN_MSG_ECHO_REQ:
-		/* Keep the real address alive */
-		if ((re = ra_get_or_create(&real_peer))) {
-			re->last_recv = __current;
-			/* Send echo reply */
-			reply_an_echo_ack(nmsg, re);
+	if ((re = ra_try_get(real_peer)) == NULL || re->replay == NULL) {
+		va_ra_lock_upgrade();
+		if ((re = ra_get_or_create(real_peer))) {
+			re->last_recv = *now;
+			if (re->replay == NULL && (re->replay = malloc(sizeof(*re->replay))))
+				replay_window_init(re->replay);
 			ra_put_no_free(re);
 		}
-		if (out_dlen < MINIVTUN_MSG_BASIC_HLEN + sizeof(nmsg->echo))
-			return 0;
-		/* Keep virtual addresses alive */
+		va_ra_lock_downgrade();
+		/* It might have been recycled while the lock was dropped. */
+		if ((re = ra_try_get(real_peer)) == NULL || re->replay == NULL) {
+			stats_drop(&w->stats, DROP_NO_CLIENT);
+			return false;
+		}
+	}
+
+	/* Jitter is measured by clients alone, for their health assess. */
+	if (!replay_window_check(re->replay, seq, 0)) {
+		stats_drop(&w->stats, DROP_REPLAYED);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Answer an echo from a client and keep its real and virtual addresses
+ * alive. Clients with several paths probe each a few times a second, so
+ * the write lock is only taken if an address has to be added or moved.
+ * Called with the read lock of the client tables held.
+ */
+static void handle_echo_req(struct worker *w, struct minivtun_msg *nmsg, size_t dlen,
+		const struct sockaddr_inx *real_peer, const struct netmsg_seq *ns,
+		const struct timeval *now)
+{
+	unsigned path = netmsg_client_path(ns), nr_vaddrs = 0, i;
+	struct tun_addr vaddrs[2];
+	struct tun_client *ce;
+	struct ra_entry *re;
+
+	memset(vaddrs, 0x0, sizeof(vaddrs));
+	if (dlen >= MINIVTUN_MSG_BASIC_HLEN + sizeof(nmsg->echo)) {
 		if (config.tap_mode) {
 			/* TAP mode, handle as MAC address */
 			if (is_valid_unicast_mac(&nmsg->echo.loc_tun_mac)) {
-				virt_addr.af = AF_MACADDR;
-				virt_addr.mac = nmsg->echo.loc_tun_mac;
-				if ((ce = tun_client_get_or_create(&virt_addr, &real_peer)))
-					ce->last_recv = __current;
+				vaddrs[nr_vaddrs].af = AF_MACADDR;
+				vaddrs[nr_vaddrs++].mac = nmsg->echo.loc_tun_mac;
 			}
 		} else {
 			/* TUN mode, handle as IP/IPv6 addresses */
 			if (is_valid_unicast_in(&nmsg->echo.loc_tun_in)) {
-				virt_addr.af = AF_INET;
-				virt_addr.in = nmsg->echo.loc_tun_in;
-				if ((ce = tun_client_get_or_create(&virt_addr, &real_peer)))
-					ce->last_recv = __current;
+				vaddrs[nr_vaddrs].af = AF_INET;
+				vaddrs[nr_vaddrs++].in = nmsg->echo.loc_tun_in;
 			}
 			if (is_valid_unicast_in6(&nmsg->echo.loc_tun_in6)) {
-				virt_addr.af = AF_INET6;
-				virt_addr.in6 = nmsg->echo.loc_tun_in6;
-				if ((ce = tun_client_get_or_create(&virt_addr, &real_peer)))
-					ce->last_recv = __current;
+				vaddrs[nr_vaddrs].af = AF_INET6;
+				vaddrs[nr_vaddrs++].in6 = nmsg->echo.loc_tun_in6;
 			}
 		}
-		break;
-	case MINIVTUN_MSG_IPDATA:
-		if (config.tap_mode) {
-			af = AF_MACADDR;
-			/* No ethernet packet is shorter than 12 bytes. */
-			if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 12)
-				return 0;
-			nmsg->ipdata.proto = 0;
-			ip_dlen = out_dlen - MINIVTUN_MSG_IPDATA_OFFSET;
-		} else {
-			if (nmsg->ipdata.proto == htons(ETH_P_IP)) {
-				af = AF_INET;
-				/* No valid IP packet is shorter than 20 bytes. */
-				if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 20)
-					return 0;
-			} else if (nmsg->ipdata.proto == htons(ETH_P_IPV6)) {
-				af = AF_INET6;
-				if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 40)
-					return 0;
-			} else {
-				syslog(LOG_WARNING, "*** Invalid protocol: 0x%x.", ntohs(nmsg->ipdata.proto));
-				return 0;
-			}
-			ip_dlen = ntohs(nmsg->ipdata.ip_dlen);
-			/* Drop incomplete IP packets. */
-			if (out_dlen - MINIVTUN_MSG_IPDATA_OFFSET < ip_dlen)
-				return 0;
+	}
+
+	/* Mostly, all is in place from the echoes before. */
+	if ((re = ra_try_get(real_peer)) && path < MAX_CLIENT_PATHS) {
+		for (i = 0; i < nr_vaddrs; i++) {
+			if ((ce = tun_client_try_get(&vaddrs[i])) == NULL ||
+				!tun_client_at_path(ce, path, real_peer) ||
+				!tun_client_vouch(ce, true, ns))
+				break;
+		}
+		if (i == nr_vaddrs) {
+			re->last_recv = *now;
+			reply_an_echo_ack(w, nmsg, re);
+			for (i = 0; i < nr_vaddrs; i++)
+				tun_client_try_get(&vaddrs[i])->last_recv = *now;
+			return;
 		}
+	}
 
-		source_addr_of_ipdata(nmsg->ipdata.data, af, &virt_addr);
-		if ((ce = tun_client_get_or_create(&virt_addr, &real_peer)) == NULL)
-			return 0;
+	va_ra_lock_upgrade();
+	/* Keep the real address alive */
+	if ((re = ra_get_or_create(real_peer))) {
+		re->last_recv = *now;
+		/* Send echo reply */
+		reply_an_echo_ack(w, nmsg, re);
+		ra_put_no_free(re);
+	}
+	/* Keep virtual addresses alive */
+	for (i = 0; i < nr_vaddrs; i++) {
+		if ((ce = tun_client_claim(w, &vaddrs[i], real_peer, ns, now)))
+			ce->last_recv = *now;
+	}
+	va_ra_lock_downgrade();
+}
+
+/* Called with the read lock of the client tables held */
+static void handle_netmsg(struct worker *w, void *data, size_t dlen,
+		const struct sockaddr_inx *real_peer, const struct timeval *now)
+{
+	struct minivtun_msg *nmsg;
+	size_t out_dlen;
+	struct netmsg_seq ns;
 
-		ce->last_recv = __current;
-		ce->ra->last_recv = __current;
-
-		pi.flags = 0;
-		pi.proto = nmsg->ipdata.proto;
-		osx_ether_to_af(&pi.proto);
-		iov[0].iov_base = &pi;
-		iov[0].iov_len = sizeof(pi);
-		iov[1].iov_base = (char *)nmsg + MINIVTUN_MSG_IPDATA_OFFSET;
-		iov[1].iov_len = ip_dlen;
-		rc = writev(state.tunfd, iov, 2);
+	out_dlen = dlen;
+	if ((nmsg = netmsg_to_local(w, data, &out_dlen, &ns)) == NULL)
+		return;
+
+	/* Clients of older versions leave the numbers out. */
+	if (ns.seq && !ra_replay_check(w, real_peer, ns.seq, now))
+		return;
+
+	switch (nmsg->hdr.opcode) {
+	case MINIVTUN_MSG_ECHO_REQ:
+		handle_echo_req(w, nmsg, out_dlen, real_peer, &ns, now);
+		break;
+	case MINIVTUN_MSG_IPDATA:
+		handle_ipdata(w, nmsg, out_dlen, real_peer, &ns, now);
+		break;
+	case MINIVTUN_MSG_FEC_DATA:
+	case MINIVTUN_MSG_FEC_PARITY:
+		handle_fec_netmsg(w, nmsg, out_dlen, real_peer, &ns, now);
+		break;
+	default:
+		stats_drop(&w->stats, DROP_BAD_OPCODE);
 		break;
 	}
+}
 
-	return 0;
+/* Handle a batch of 'nr' datagrams received into 'ring' */
+static void handle_netmsg_batch(struct worker *w, struct msg_ring *ring, int nr,
+		const struct timeval *now)
+{
+	int i;
+
+	pthread_rwlock_rdlock(&va_ra_lock);
+	for (i = 0; i < nr; i++) {
+		char *data = ring->iovs[i].iov_base;
+		size_t left = ring->msgs[i].msg_len;
+		size_t seg = msg_ring_segment_size(ring, i);
+
+		/**
+		 * Split a GRO train back into its datagrams. Each one is decrypted
+		 * in place, using the tail of the one before as head room.
+		 */
+		do {
+			size_t len = left < seg ? left : seg;
+			stats_add(&w->stats.net_rx_packets, 1);
+			stats_add(&w->stats.net_rx_bytes, len);
+			handle_netmsg(w, data, len, &ring->addrs[i], now);
+			data += len;
+			left -= len;
+		} while (left);
+	}
+	pthread_rwlock_unlock(&va_ra_lock);
+
+	if (tun_flush_frames(w) < 0)
+		stats_drop(&w->stats, DROP_TUN_WRITE);
 }
 
-static int tunnel_receiving(void)
+static int network_receiving(struct event_source *src, const struct timeval *now)
 {
-	char read_buffer[NM_PI_BUFFER_SIZE], crypt_buffer[NM_PI_BUFFER_SIZE];
-	struct tun_pi *pi = (void *)read_buffer;
-	struct minivtun_msg nmsg;
-	void *out_data;
+	struct worker *w = container_of(src, struct worker, sock_source);
+	int nr;
+
+	if ((nr = netmsg_ring_recv(w)) <= 0)
+		return -1;
+	handle_netmsg_batch(w, &w->rx_ring, nr, now);
+
+	/* A short batch means the socket queue has been drained. */
+	return nr < w->rx_ring.size ? -1 : 0;
+}
+
+/* Datagrams redirected to the worker's AF_XDP socket, see xdp_init() */
+static int xsk_receiving(struct event_source *src, const struct timeval *now)
+{
+	struct worker *w = container_of(src, struct worker, xsk_source);
+	struct msg_ring *ring;
+	int nr;
+
+	if ((nr = xsk_recv(w, &ring)) <= 0)
+		return -1;
+	handle_netmsg_batch(w, ring, nr, now);
+	xsk_recv_done(w);
+
+	return nr < ring->size ? -1 : 0;
+}
+
+/* Queue the parity of a group sent to a client, closing it */
+static void ra_fec_queue_parity(struct worker *w, struct ra_fec_tx *tx)
+{
+	unsigned m = fec_parity_count(tx->enc), j;
+
+	for (j = 0; j < m; j++) {
+		netmsg_queue_parity(w, tx->enc, j, next_xmit_seq(&tx->re->xmit_seq),
+				tx->re->replay ? 0 : -1, &tx->re->real_addr);
+	}
+	fec_encoder_close(tx->enc);
+	list_del_init(&tx->open);
+}
+
+/* Send the parity of the groups a worker left open, however few packets follow */
+static void fec_groups_expired(struct event_loop *loop, const struct timeval *now)
+{
+	struct worker *w = container_of(loop, struct worker, loop);
+	struct ra_fec_tx *tx, *__tx;
+
+	pthread_rwlock_rdlock(&va_ra_lock);
+	list_for_each_entry_safe (tx, __tx, &fec_open[w->id], open)
+		ra_fec_queue_parity(w, tx);
+	pthread_rwlock_unlock(&va_ra_lock);
+
+	if (w->tx_ring.count)
+		netmsg_ring_flush(w);
+}
+
+/**
+ * Turn the IPDATA message in 'nmsg' into a data shard of the group the
+ * worker sends to the client, if it has error correction. Returns the
+ * new length of the message.
+ */
+static size_t ra_fec_encode(struct worker *w, struct ra_entry *re,
+		struct minivtun_msg *nmsg, size_t dlen, struct ra_fec_tx **full)
+{
+	struct ra_fec_tx *tx;
+	struct fec_trailer tr;
+	unsigned k;
+
+	if (re->fec == NULL || (k = __atomic_load_n(&re->fec->k, __ATOMIC_RELAXED)) == 0 ||
+		dlen - MINIVTUN_MSG_BASIC_HLEN > FEC_SHARD_MAX)
+		return dlen;
+
+	tx = &re->fec->tx[w->id];
+	if (!fec_encoder_busy(tx->enc)) {
+		list_add_tail(&tx->open, &fec_open[w->id]);
+		event_loop_alarm(&w->loop, FEC_GROUP_MS, fec_groups_expired);
+	}
+	nmsg->hdr.opcode = MINIVTUN_MSG_FEC_DATA;
+	if (fec_encode(tx->enc, &nmsg->ipdata, dlen - MINIVTUN_MSG_BASIC_HLEN, k,
+			__atomic_load_n(&re->fec->m, __ATOMIC_RELAXED), &tr))
+		*full = tx;
+
+	return netmsg_fec_trailer(nmsg, dlen, &tr);
+}
+
+/* Called with the read lock of the client tables held */
+static int tunnel_read_one(struct worker *w, const struct timeval *now)
+{
+	struct minivtun_msg *nmsg;
+	struct tun_pi *pi;
+	__be16 proto;
 	size_t ip_dlen, out_dlen;
 	unsigned short af = 0;
 	struct tun_addr virt_addr;
 	struct tun_client *ce;
+	struct ra_entry *re;
+	struct ra_fec_tx *fec_full = NULL;
+	__u64 seq;
 	int rc;
 
-	rc = read(state.tunfd, pi, NM_PI_BUFFER_SIZE);
-	if (rc < sizeof(struct tun_pi))
+	/* The frame is read straight into the buffer of the message. */
+	rc = tun_read_netmsg(w, &nmsg);
+	if (rc < (int)sizeof(struct tun_pi))
 		return -1;
+	pi = (void *)((char *)nmsg + MINIVTUN_MSG_IPDATA_OFFSET - sizeof(struct tun_pi));
 
 	osx_af_to_ether(&pi->proto);
 
 	ip_dlen = (size_t)rc - sizeof(struct tun_pi);
+	stats_add(&w->stats.tun_rx_packets, 1);
+	stats_add(&w->stats.tun_rx_bytes, ip_dlen);
 
 	if (config.tap_mode) {
 		/* Ethernet frame */
 		af = AF_MACADDR;
-		if (ip_dlen < 12)
+		if (ip_dlen < 12) {
+			stats_drop(&w->stats, DROP_SHORT_PACKET);
 			return 0;
+		}
 	} else {
 		/* We only accept IPv4 or IPv6 frames. */
 		if (pi->proto == htons(ETH_P_IP)) {
 			af = AF_INET;
-			if (ip_dlen < 20)
+			if (ip_dlen < 20) {
+				stats_drop(&w->stats, DROP_SHORT_PACKET);
 				return 0;
+			}
 		} else if (pi->proto == htons(ETH_P_IPV6)) {
 			af = AF_INET6;
-			if (ip_dlen < 40)
+			if (ip_dlen < 40) {
+				stats_drop(&w->stats, DROP_SHORT_PACKET);
 				return 0;
+			}
 		} else {
 			syslog(LOG_WARNING, "*** Invalid protocol: 0x%x.", ntohs(pi->proto));
+			stats_drop(&w->stats, DROP_BAD_PROTO);
 			return 0;
 		}
 	}
@@ -633,47 +1615,64 @@ static int tunnel_receiving(void)
 			} else {
 				__va.mac = *(struct mac_addr *)gw;
 			}
-			if ((ce = tun_client_try_get(&__va)) == NULL)
+			if (tun_client_try_get(&__va) == NULL) {
+				stats_drop(&w->stats, DROP_NO_ROUTE);
 				return 0;
+			}
 
 			/* Finally, create a client entry with this address */
-			if ((ce = tun_client_get_or_create(&virt_addr,
-				&ce->ra->real_addr)) == NULL)
+			va_ra_lock_upgrade();
+			ce = tun_client_route(&virt_addr, &__va);
+			va_ra_lock_downgrade();
+			/* It might have been recycled while the lock was dropped. */
+			if (ce == NULL || (ce = tun_client_try_get(&virt_addr)) == NULL) {
+				stats_drop(&w->stats, DROP_NO_CLIENT);
 				return 0;
+			}
 		} else if (config.tap_mode) {
 			/* In TAP mode, fall through to broadcast to all clients */
 		} else {
+			stats_drop(&w->stats, DROP_NO_ROUTE);
 			return 0;
 		}
 	}
 
-	memset(&nmsg.hdr, 0x0, sizeof(nmsg.hdr));
-	nmsg.hdr.opcode = MINIVTUN_MSG_IPDATA;
-	memcpy(nmsg.hdr.auth_key, config.crypto_key, sizeof(nmsg.hdr.auth_key));
-	nmsg.ipdata.proto = pi->proto;
-	nmsg.ipdata.ip_dlen = htons(ip_dlen);
-	memcpy(nmsg.ipdata.data, pi + 1, ip_dlen);
-
-	/* Do encryption. */
-	out_data = crypt_buffer;
+	proto = pi->proto;
+	memset(&nmsg->hdr, 0x0, sizeof(nmsg->hdr));
+	nmsg->hdr.opcode = MINIVTUN_MSG_IPDATA;
+	memcpy(nmsg->hdr.auth_key, config.crypto_key, sizeof(nmsg->hdr.auth_key));
+	nmsg->ipdata.proto = proto;
+	nmsg->ipdata.ip_dlen = htons(ip_dlen);
 	out_dlen = MINIVTUN_MSG_IPDATA_OFFSET + ip_dlen;
-	local_to_netmsg(&nmsg, &out_data, &out_dlen);
 
+	/* Encrypt in place, the ring is flushed after the whole batch. */
 	if (ce) {
-		nmsg.hdr.seq = htons(ce->ra->xmit_seq++);
-		(void)sendto(state.sockfd, out_data, out_dlen, 0,
-				(struct sockaddr *)&ce->ra->real_addr,
-				sizeof_sockaddr(&ce->ra->real_addr));
+		re = tun_client_path(ce, proto, nmsg->ipdata.data, ip_dlen, now);
+		seq = next_xmit_seq(&re->xmit_seq);
+		nmsg->hdr.seq = htons(seq);
+		client_stats_tx(&ce->stats[w->id], ip_dlen);
+		client_stats_tx(&re->stats[w->id], ip_dlen);
+		out_dlen = ra_fec_encode(w, re, nmsg, out_dlen, &fec_full);
+		if (re->replay)
+			nmsg = netmsg_push_seq(nmsg, &out_dlen, seq, 0);
+		netmsg_ring_commit(w, nmsg, out_dlen, &re->real_addr);
+		if (fec_full)
+			ra_fec_queue_parity(w, fec_full);
 	} else {
-		/* Traverse all online clients and send */
+		/* Traverse all online clients and send, one copy for each over its first path */
+		struct minivtun_msg bmsg;
 		unsigned i;
-		for (i = 0; i < RA_SET_HASH_SIZE; i++) {
-			struct ra_entry *re;
-			list_for_each_entry (re, &ra_set_hbase[i], list) {
-				nmsg.hdr.seq = htons(re->xmit_seq++);
-				(void)sendto(state.sockfd, out_data, out_dlen, 0,
-						(struct sockaddr *)&re->real_addr,
-						sizeof_sockaddr(&re->real_addr));
+
+		memcpy(&bmsg, nmsg, out_dlen);
+		for (i = 0; i < hash_table_nr_chains(&ra_set); i++) {
+			list_for_each_entry (re, hash_table_chain(&ra_set, i), node.list) {
+				if (re->path)
+					continue;
+				seq = next_xmit_seq(&re->xmit_seq);
+				bmsg.hdr.seq = htons(seq);
+				client_stats_tx(&re->stats[w->id], ip_dlen);
+				queue_netmsg(w, &bmsg, out_dlen, seq, re->replay ? 0 : -1,
+						&re->real_addr);
 			}
 		}
 	}
@@ -681,9 +1680,235 @@ static int tunnel_receiving(void)
 	return 0;
 }
 
+static int tunnel_receiving(struct event_source *src, const struct timeval *now)
+{
+	struct worker *w = container_of(src, struct worker, tun_source);
+	int rc = 0, i;
+
+	pthread_rwlock_rdlock(&va_ra_lock);
+	for (i = 0; i < NM_BATCH_SIZE; i++) {
+		if ((rc = tunnel_read_one(w, now)) < 0)
+			break;
+	}
+	pthread_rwlock_unlock(&va_ra_lock);
+
+	if (w->tx_ring.count)
+		netmsg_ring_flush(w);
+
+	return rc;
+}
+
+static void ra_entry_ntop(const struct ra_entry *re, char *buf, size_t bufsz)
+{
+	char s_real_addr[50];
+
+	inet_ntop(re->real_addr.sa.sa_family, addr_of_sockaddr(&re->real_addr),
+			s_real_addr, sizeof(s_real_addr));
+	snprintf(buf, bufsz, re->real_addr.sa.sa_family == AF_INET6 ? "[%s]:%u" : "%s:%u",
+			s_real_addr, ntohs(port_of_sockaddr(&re->real_addr)));
+}
+
+static void dump_clients_json(FILE *fp)
+{
+	const struct stats_field *f;
+	struct tun_client *ce;
+	struct ra_entry *re;
+	char s_real_addr[60], s_virt_addr[50];
+	unsigned i, n = 0, p, k;
+
+	fprintf(fp, ",\"clients\":[");
+	for (i = 0; i < hash_table_nr_chains(&ra_set); i++) {
+		list_for_each_entry (re, hash_table_chain(&ra_set, i), node.list) {
+			ra_entry_ntop(re, s_real_addr, sizeof(s_real_addr));
+			fprintf(fp, "%s{\"real_addr\":\"%s\",\"last_seen\":%lu", n++ ? "," : "",
+					s_real_addr, (unsigned long)re->last_recv.tv_sec);
+			for (f = client_stats_fields; f->name; f++)
+				fprintf(fp, ",\"%s\":%llu", f->name,
+						(unsigned long long)client_stats_value(re->stats, f));
+			for (f = replay_stats_fields; re->replay && f->name; f++)
+				fprintf(fp, ",\"%s\":%llu", f->name,
+						(unsigned long long)stats_value(re->replay, f));
+			fprintf(fp, "}");
+		}
+	}
+
+	n = 0;
+	fprintf(fp, "],\"addresses\":[");
+	for (i = 0; i < hash_table_nr_chains(&va_map); i++) {
+		list_for_each_entry (ce, hash_table_chain(&va_map, i), node.list) {
+			tun_addr_ntop(&ce->virt_addr, s_virt_addr, sizeof(s_virt_addr));
+			ra_entry_ntop(tun_client_last_path(ce), s_real_addr, sizeof(s_real_addr));
+			fprintf(fp, "%s{\"virt_addr\":\"%s\",\"real_addr\":\"%s\",\"last_seen\":%lu",
+					n++ ? "," : "", s_virt_addr, s_real_addr,
+					(unsigned long)ce->last_recv.tv_sec);
+			fprintf(fp, ",\"paths\":[");
+			for (p = 0, k = 0; p < MAX_CLIENT_PATHS; p++) {
+				if (ce->paths[p] == NULL)
+					continue;
+				ra_entry_ntop(ce->paths[p], s_real_addr, sizeof(s_real_addr));
+				fprintf(fp, "%s{\"path\":%u,\"real_addr\":\"%s\"}", k++ ? "," : "",
+						p, s_real_addr);
+			}
+			fprintf(fp, "]");
+			for (f = client_stats_fields; f->name; f++)
+				fprintf(fp, ",\"%s\":%llu", f->name,
+						(unsigned long long)client_stats_value(ce->stats, f));
+			fprintf(fp, "}");
+		}
+	}
+	fprintf(fp, "]");
+}
+
+static void dump_clients_prometheus(FILE *fp)
+{
+	const struct stats_field *f;
+	struct tun_client *ce;
+	struct ra_entry *re;
+	char s_real_addr[60], s_virt_addr[50];
+	unsigned i;
+
+	for (f = client_stats_fields; f->name; f++) {
+		fprintf(fp, "# HELP minivtun_client_%s_total %s.\n", f->name, f->help);
+		fprintf(fp, "# TYPE minivtun_client_%s_total counter\n", f->name);
+		for (i = 0; i < hash_table_nr_chains(&ra_set); i++) {
+			list_for_each_entry (re, hash_table_chain(&ra_set, i), node.list) {
+				ra_entry_ntop(re, s_real_addr, sizeof(s_real_addr));
+				fprintf(fp, "minivtun_client_%s_total{real_addr=\"%s\"} %llu\n",
+						f->name, s_real_addr,
+						(unsigned long long)client_stats_value(re->stats, f));
+			}
+		}
+	}
+
+	for (f = client_stats_fields; f->name; f++) {
+		fprintf(fp, "# HELP minivtun_address_%s_total %s.\n", f->name, f->help);
+		fprintf(fp, "# TYPE minivtun_address_%s_total counter\n", f->name);
+		for (i = 0; i < hash_table_nr_chains(&va_map); i++) {
+			list_for_each_entry (ce, hash_table_chain(&va_map, i), node.list) {
+				tun_addr_ntop(&ce->virt_addr, s_virt_addr, sizeof(s_virt_addr));
+				ra_entry_ntop(tun_client_last_path(ce), s_real_addr, sizeof(s_real_addr));
+				fprintf(fp, "minivtun_address_%s_total{virt_addr=\"%s\",real_addr=\"%s\"} %llu\n",
+						f->name, s_virt_addr, s_real_addr,
+						(unsigned long long)client_stats_value(ce->stats, f));
+			}
+		}
+	}
+
+	for (f = replay_stats_fields; f->name; f++) {
+		fprintf(fp, "# HELP minivtun_client_%s_total %s.\n", f->name, f->help);
+		fprintf(fp, "# TYPE minivtun_client_%s_total counter\n", f->name);
+		for (i = 0; i < hash_table_nr_chains(&ra_set); i++) {
+			list_for_each_entry (re, hash_table_chain(&ra_set, i), node.list) {
+				if (re->replay == NULL)
+					continue;
+				ra_entry_ntop(re, s_real_addr, sizeof(s_real_addr));
+				fprintf(fp, "minivtun_client_%s_total{real_addr=\"%s\"} %llu\n",
+						f->name, s_real_addr,
+						(unsigned long long)stats_value(re->replay, f));
+			}
+		}
+	}
+
+	fprintf(fp, "# HELP minivtun_client_last_seen_seconds Time of the last packet from the client.\n");
+	fprintf(fp, "# TYPE minivtun_client_last_seen_seconds gauge\n");
+	for (i = 0; i < hash_table_nr_chains(&ra_set); i++) {
+		list_for_each_entry (re, hash_table_chain(&ra_set, i), node.list) {
+			ra_entry_ntop(re, s_real_addr, sizeof(s_real_addr));
+			fprintf(fp, "minivtun_client_last_seen_seconds{real_addr=\"%s\"} %lu\n",
+					s_real_addr, (unsigned long)re->last_recv.tv_sec);
+		}
+	}
+}
+
+/* Dump the client tables for the stats socket */
+static void dump_clients(FILE *fp, int format)
+{
+	pthread_rwlock_rdlock(&va_ra_lock);
+	if (format == STATS_FORMAT_JSON) {
+		dump_clients_json(fp);
+	} else {
+		dump_clients_prometheus(fp);
+	}
+	pthread_rwlock_unlock(&va_ra_lock);
+}
+
+static int open_server_socket(bool reuseport)
+{
+	int sockfd, on = 1;
+
+	if ((sockfd = socket(state.local_addr.sa.sa_family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		fprintf(stderr, "*** socket() failed: %s.\n", strerror(errno));
+		exit(1);
+	}
+	if (reuseport &&
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		fprintf(stderr, "*** setsockopt(SO_REUSEPORT) failed: %s.\n", strerror(errno));
+		exit(1);
+	}
+	if (bind(sockfd, (struct sockaddr *)&state.local_addr,
+		sizeof_sockaddr(&state.local_addr)) < 0) {
+		fprintf(stderr, "*** bind() failed: %s.\n", strerror(errno));
+		exit(1);
+	}
+	if (config.udp_offload && udp_set_offload(sockfd) < 0) {
+		fprintf(stderr, "*** Cannot enable UDP offloads: %s.\n", strerror(errno));
+		exit(1);
+	}
+	set_nonblock(sockfd);
+
+	return sockfd;
+}
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+/**
+ * Pick the socket of a SO_REUSEPORT group by the client IP address, so
+ * a client stays with the same worker whichever port it comes from.
+ * IPv4-mapped clients of an IPv6 socket arrive with IPv4 headers.
+ */
+static int attach_reuseport_steering(int sockfd, unsigned nr_socks)
+{
+	struct sock_filter code[] = {
+		/* A = ip->version */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF + 0),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 14),
+		/* IPv6: A = saddr[0] ^ saddr[1] ^ saddr[2] ^ saddr[3] */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 8),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+		BPF_STMT(BPF_LDX | BPF_W | BPF_MEM, 0),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 16),
+		BPF_STMT(BPF_LDX | BPF_W | BPF_MEM, 0),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),
+		BPF_STMT(BPF_LDX | BPF_W | BPF_MEM, 0),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_JMP | BPF_JA, 1),
+		/* IPv4: A = saddr */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+		/* Multiplicative hash, index by the upper half */
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nr_socks),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = countof(code),
+		.filter = code,
+	};
+
+	return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			&prog, sizeof(prog));
+}
+#endif
+
 int run_server(const char *loc_addr_pair)
 {
 	char s_loc_addr[50];
+	unsigned i;
 	bool is_random_port = false;
 
 	if (get_sockaddr_inx_pair(loc_addr_pair, &state.local_addr, &is_random_port) < 0) {
@@ -701,19 +1926,60 @@ int run_server(const char *loc_addr_pair)
 			s_loc_addr, ntohs(port_of_sockaddr(&state.local_addr)), config.ifname);
 
 	/* Initialize address map hash table. */
-	init_va_ra_maps();
-	hash_initval = rand();
-
-	if ((state.sockfd = socket(state.local_addr.sa.sa_family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-		fprintf(stderr, "*** socket() failed: %s.\n", strerror(errno));
+	if (init_va_ra_maps(config.hash_size, config.max_clients) < 0) {
+		fprintf(stderr, "*** Cannot allocate client tables.\n");
 		exit(1);
 	}
-	if (bind(state.sockfd, (struct sockaddr *)&state.local_addr,
-		sizeof_sockaddr(&state.local_addr)) < 0) {
-		fprintf(stderr, "*** bind() failed: %s.\n", strerror(errno));
+	if (obj_pool_init(&fec_pool, fec_decoder_size(), config.max_fec_clients) < 0) {
+		fprintf(stderr, "*** Cannot allocate FEC decoders.\n");
+		exit(1);
+	}
+	init_va_ra_lock();
+	hash_initval = rand();
+	fec_open = calloc(config.nr_queues, sizeof(*fec_open));
+	assert(fec_open);
+	for (i = 0; i < config.nr_queues; i++)
+		INIT_LIST_HEAD(&fec_open[i]);
+	init_vt_route_tries();
+
+	/**
+	 * Either all workers read from one socket, or each has its own in a
+	 * SO_REUSEPORT group, in which the order of binding is the index the
+	 * steering program returns.
+	 */
+	for (i = 0; i < config.nr_queues; i++) {
+		struct worker *w = &state.workers[i];
+		if (config.reuseport == REUSEPORT_NONE && i > 0) {
+			w->sockfd = state.sockfd;
+		} else {
+			w->sockfd = open_server_socket(config.reuseport != REUSEPORT_NONE);
+		}
+		if (i == 0)
+			state.sockfd = w->sockfd;
+	}
+	if (config.reuseport == REUSEPORT_ADDR) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+		if (attach_reuseport_steering(state.sockfd, config.nr_queues) < 0) {
+			fprintf(stderr, "*** setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed: %s.\n",
+					strerror(errno));
+			exit(1);
+		}
+#else
+		fprintf(stderr, "*** Steering by client address is not supported on this platform.\n");
 		exit(1);
+#endif
 	}
-	set_nonblock(state.sockfd);
+
+	for (i = 0; i < config.nr_queues; i++) {
+		struct worker *w = &state.workers[i];
+		if (netmsg_rings_init(w) < 0) {
+			fprintf(stderr, "*** Cannot allocate datagram buffers.\n");
+			exit(1);
+		}
+	}
+
+	if (config.xdp_ifname && xdp_init(config.xdp_ifname) < 0)
+		exit(1);
 
 	/* Run in background. */
 	if (config.in_background)
@@ -727,40 +1993,34 @@ int run_server(const char *loc_addr_pair)
 		}
 	}
 
-	gettimeofday(&state.last_walk, NULL);
-
-	for (;;) {
-		fd_set rset;
-		struct timeval __current, timeo;
-		int rc;
-
-		FD_ZERO(&rset);
-		FD_SET(state.tunfd, &rset);
-		FD_SET(state.sockfd, &rset);
-
-		timeo = (struct timeval) { 2, 0 };
-		rc = select((state.tunfd > state.sockfd ? state.tunfd : state.sockfd) + 1,
-				&rset, NULL, NULL, &timeo);
-		if (rc < 0) {
-			fprintf(stderr, "*** select(): %s.\n", strerror(errno));
-			return -1;
-		}
-
-		if (FD_ISSET(state.sockfd, &rset)) {
-			rc = network_receiving();
+	for (i = 0; i < config.nr_queues; i++) {
+		struct worker *w = &state.workers[i];
+
+		/* The first worker expires inactive clients every second. */
+		if (event_loop_init(&w->loop, 1000, i ? NULL : va_ra_expire) < 0)
+			exit(1);
+
+		w->sock_source.fd = w->sockfd;
+		w->sock_source.shared = (config.reuseport == REUSEPORT_NONE);
+		w->sock_source.handler = network_receiving;
+		w->tun_source.fd = w->tunfd;
+		w->tun_source.handler = tunnel_receiving;
+		if (event_loop_add(&w->loop, &w->sock_source) < 0 ||
+			event_loop_add(&w->loop, &w->tun_source) < 0)
+			exit(1);
+		if (w->xsk) {
+			w->xsk_source.handler = xsk_receiving;
+			if (event_loop_add(&w->loop, &w->xsk_source) < 0)
+				exit(1);
 		}
+	}
 
-		if (FD_ISSET(state.tunfd, &rset)) {
-			rc = tunnel_receiving();
-		}
+	if (config.stats_socket &&
+		stats_socket_init(config.stats_socket, dump_clients) < 0)
+		exit(1);
 
-		/* Check connection state at each chance. */
-		gettimeofday(&__current, NULL);
-		if (__sub_timeval_ms(&__current, &state.last_walk) >= 3 * 1000) {
-			va_ra_walk_continue();
-			state.last_walk = __current;
-		}
-	}
+	if (run_workers() < 0)
+		return -1;
 
 	return 0;
 }
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "minivtun.h"
+
+/* Longest request accepted: "json" or "prometheus" */
+#define STATS_REQUEST_MAX  64
+
+static stats_dump_fn stats_dump_clients;
+
+const struct stats_field traffic_stats_fields[] = {
+	{ "net_rx_packets", offsetof(struct traffic_stats, net_rx_packets),
+		"Datagrams received from the network" },
+	{ "net_rx_bytes", offsetof(struct traffic_stats, net_rx_bytes),
+		"Bytes of datagrams received from the network" },
+	{ "net_tx_packets", offsetof(struct traffic_stats, net_tx_packets),
+		"Datagrams sent to the network" },
+	{ "net_tx_bytes", offsetof(struct traffic_stats, net_tx_bytes),
+		"Bytes of datagrams sent to the network" },
+	{ "tun_rx_packets", offsetof(struct traffic_stats, tun_rx_packets),
+		"Frames read from the virtual interface" },
+	{ "tun_rx_bytes", offsetof(struct traffic_stats, tun_rx_bytes),
+		"Bytes of frames read from the virtual interface" },
+	{ "tun_tx_packets", offsetof(struct traffic_stats, tun_tx_packets),
+		"Frames written to the virtual interface" },
+	{ "tun_tx_bytes", offsetof(struct traffic_stats, tun_tx_bytes),
+		"Bytes of frames written to the virtual interface" },
+	{ "fec_recovered_packets", offsetof(struct traffic_stats, fec_recovered),
+		"Packets lost in the network and rebuilt from parity" },
+	{ NULL, 0, NULL },
+};
+
+const char *const drop_reason_names[__DROP_MAX] = {
+	[DROP_DECRYPT] = "decrypt",
+	[DROP_SHORT_MSG] = "short_msg",
+	[DROP_BAD_AUTH] = "bad_auth",
+	[DROP_BAD_OPCODE] = "bad_opcode",
+	[DROP_SHORT_PACKET] = "short_packet",
+	[DROP_BAD_PROTO] = "bad_proto",
+	[DROP_TRUNCATED] = "truncated",
+	[DROP_REPLAYED] = "replayed",
+	[DROP_BAD_PATH] = "bad_path",
+	[DROP_NO_CLIENT] = "no_client",
+	[DROP_NO_ROUTE] = "no_route",
+	[DROP_TUN_WRITE] = "tun_write",
+	[DROP_NET_SEND] = "net_send",
+};
+
+static __u64 worker_drops(unsigned i, int reason)
+{
+	return __atomic_load_n(&state.workers[i].stats.drops[reason], __ATOMIC_RELAXED);
+}
+
+static void dump_workers(FILE *fp, int format)
+{
+	const struct stats_field *f;
+	unsigned i;
+	int r;
+
+	if (format == STATS_FORMAT_JSON) {
+		fprintf(fp, "\"workers\":[");
+		for (i = 0; i < config.nr_queues; i++) {
+			fprintf(fp, "%s{\"id\":%u", i ? "," : "", i);
+			for (f = traffic_stats_fields; f->name; f++) {
+				fprintf(fp, ",\"%s\":%llu", f->name, (unsigned long long)
+						stats_value(&state.workers[i].stats, f));
+			}
+			fprintf(fp, ",\"drops\":{");
+			for (r = 0; r < __DROP_MAX; r++) {
+				fprintf(fp, "%s\"%s\":%llu", r ? "," : "", drop_reason_names[r],
+						(unsigned long long)worker_drops(i, r));
+			}
+			fprintf(fp, "}}");
+		}
+		fprintf(fp, "]");
+	} else {
+		for (f = traffic_stats_fields; f->name; f++) {
+			fprintf(fp, "# HELP minivtun_%s_total %s.\n", f->name, f->help);
+			fprintf(fp, "# TYPE minivtun_%s_total counter\n", f->name);
+			for (i = 0; i < config.nr_queues; i++) {
+				fprintf(fp, "minivtun_%s_total{worker=\"%u\"} %llu\n", f->name, i,
+						(unsigned long long)stats_value(&state.workers[i].stats, f));
+			}
+		}
+		fprintf(fp, "# HELP minivtun_dropped_packets_total Packets dropped, by reason.\n");
+		fprintf(fp, "# TYPE minivtun_dropped_packets_total counter\n");
+		for (i = 0; i < config.nr_queues; i++) {
+			for (r = 0; r < __DROP_MAX; r++) {
+				fprintf(fp, "minivtun_dropped_packets_total{worker=\"%u\",reason=\"%s\"} %llu\n",
+						i, drop_reason_names[r], (unsigned long long)worker_drops(i, r));
+			}
+		}
+	}
+}
+
+/**
+ * Log the packets dropped since the last summary, at most once every
+ * 'drop_log_interval' seconds and only if there were any.
+ */
+void stats_log_drops(const struct timeval *now)
+{
+	static __u64 last_drops[__DROP_MAX];
+	static struct timeval last_log;
+	char buf[512];
+	size_t len = 0;
+	unsigned i;
+	int r;
+
+	if ((unsigned)__sub_timeval_ms(now, &last_log) < config.drop_log_interval * 1000 &&
+		!timercmp(&last_log, now, >))
+		return;
+	last_log = *now;
+
+	for (r = 0; r < __DROP_MAX; r++) {
+		__u64 sum = 0;
+		for (i = 0; i < config.nr_queues; i++)
+			sum += worker_drops(i, r);
+		if (sum != last_drops[r] && len < sizeof(buf)) {
+			len += snprintf(buf + len, sizeof(buf) - len, " %s=%llu",
+					drop_reason_names[r], (unsigned long long)(sum - last_drops[r]));
+		}
+		last_drops[r] = sum;
+	}
+
+	if (len)
+		syslog(LOG_WARNING, "Dropped packets in the last %u seconds:%s",
+				config.drop_log_interval, buf);
+}
+
+static void stats_serve(int fd)
+{
+	struct timeval timeo = { 1, 0 };
+	char req[STATS_REQUEST_MAX], *buf = NULL;
+	size_t len = 0, done = 0;
+	int format = STATS_FORMAT_PROMETHEUS;
+	ssize_t rc;
+	FILE *fp;
+
+	/* A stalled peer holds up the next dump for a moment, no more. */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeo, sizeof(timeo));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeo, sizeof(timeo));
+
+	if ((rc = read(fd, req, sizeof(req) - 1)) > 0) {
+		req[rc] = '\0';
+		if (strncmp(req, "json", 4) == 0)
+			format = STATS_FORMAT_JSON;
+	}
+
+	/* Format in memory first, to keep the tables locked only briefly */
+	if ((fp = open_memstream(&buf, &len)) == NULL)
+		return;
+	if (format == STATS_FORMAT_JSON)
+		fprintf(fp, "{");
+	dump_workers(fp, format);
+	if (stats_dump_clients)
+		stats_dump_clients(fp, format);
+	if (format == STATS_FORMAT_JSON)
+		fprintf(fp, "}\n");
+	fclose(fp);
+
+	while (done < len) {
+		if ((rc = send(fd, buf + done, len - done, MSG_NOSIGNAL)) <= 0)
+			break;
+		done += rc;
+	}
+	free(buf);
+}
+
+static void *stats_thread(void *arg)
+{
+	int lfd = (int)(long)arg, fd;
+
+	for (;;) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			syslog(LOG_ERR, "*** Stats socket accept() failed: %s.", strerror(errno));
+			break;
+		}
+		stats_serve(fd);
+		close(fd);
+	}
+
+	close(lfd);
+	return NULL;
+}
+
+/**
+ * Listen on a Unix-domain socket and serve stats dumps in a thread of
+ * its own, so that no peer of it can hold up the datapath.
+ */
+int stats_socket_init(const char *path, stats_dump_fn dump_clients)
+{
+	struct sockaddr_un sun;
+	pthread_t thread;
+	int fd, rc;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "*** Stats socket path is too long: %s.\n", path);
+		return -1;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "*** socket() failed: %s.\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&sun, 0x0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(fd, 8) < 0) {
+		fprintf(stderr, "*** Cannot listen on '%s': %s.\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	stats_dump_clients = dump_clients;
+	if ((rc = pthread_create(&thread, NULL, stats_thread, (void *)(long)fd))) {
+		fprintf(stderr, "*** pthread_create() failed: %s.\n", strerror(rc));
+		close(fd);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
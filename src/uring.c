@@ -0,0 +1,763 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/uio.h>
+
+#include "minivtun.h"
+
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+	#include <poll.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#include <linux/io_uring.h>
+#endif
+
+/* Kernel headers older than Linux 6.0 lack multishot receives */
+#ifndef IORING_RECV_MULTISHOT
+
+int uring_init(struct worker *w)
+{
+	if (w->id == 0)
+		syslog(LOG_WARNING, "io_uring is not supported by this build, using the classic datapath.");
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int uring_run(struct worker *w)
+{
+	return -1;
+}
+
+void uring_watch_socket(struct worker *w)
+{
+}
+
+int uring_recv(struct worker *w, struct msg_ring *ring)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+ssize_t uring_tun_read(struct worker *w, struct minivtun_msg **nmsg)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int uring_tun_write(struct worker *w, struct tun_pi *pi, void *data, size_t len)
+{
+	return -1;
+}
+
+int uring_send(struct worker *w, struct msg_ring *ring)
+{
+	ring->count = 0;
+	return 0;
+}
+
+#else
+
+/**
+ * Datapath on io_uring, driven through the raw system calls. Multishot
+ * requests stay armed on the socket and on the TUN queue, and complete
+ * into buffers the kernel picks from provided-buffer rings. The buffers
+ * are handed to the usual 'sock_source' and 'tun_source' handlers, whose
+ * TUN writes and UDP sends are queued and submitted in batches. The
+ * event loop keeps the timer and the other sources, its epoll descriptor
+ * is polled from the ring.
+ */
+
+#define URING_ENTRIES  256
+#define URING_NET_BUFS  256
+#define URING_GRO_BUFS  64
+#define URING_TUN_BUFS  256
+
+/* IORING_OP_READ_MULTISHOT, Linux 6.7 */
+#define URING_OP_READ_MULTISHOT  49
+
+/* Room for the source address of a datagram, keeping what follows aligned */
+#define URING_NAME_SIZE  ((sizeof(struct sockaddr_inx) + 7) & ~7UL)
+
+enum {
+	UD_NET_RECV = 1, /* argument: socket generation */
+	UD_TUN_READ,
+	UD_EPOLL,
+	UD_SEND,         /* argument: index of the message */
+	UD_TUN_WRITE,    /* argument: buffer written from */
+	UD_CANCEL,
+};
+
+#define URING_UD(op, arg)  ((__u64)(op) << 32 | (__u32)(arg))
+#define URING_UD_OP(ud)  ((unsigned)((ud) >> 32))
+#define URING_UD_ARG(ud)  ((__u32)(ud))
+
+/**
+ * Buffers the kernel picks from for a multishot request. A buffer leaves
+ * the ring with a completion, waits on the ready queue until a handler
+ * takes it ('lent'), and goes back once no queued write refers to it.
+ */
+struct uring_bufs {
+	struct io_uring_buf_ring *br;
+	char *mem;
+	unsigned nr;
+	size_t stride;
+	size_t offset; /* where the kernel fills a buffer */
+	unsigned len;
+	__u16 bgid;
+	__u16 tail;
+	unsigned held; /* out of the ring */
+	unsigned short *refs;
+	unsigned short *ready_bid;
+	unsigned *ready_len;
+	unsigned ready_head;
+	unsigned nr_ready;
+	unsigned short *lent;
+	unsigned nr_lent;
+	bool armed;
+	bool seen; /* the request has completed successfully */
+};
+
+struct uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_ktail;
+	unsigned sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct uring_bufs net;
+	struct uring_bufs tun;
+	struct msghdr recv_hdr; /* layout of the multishot receives */
+	size_t recv_hlen;
+	unsigned sock_gen;
+	bool epoll_armed;
+	bool epoll_ready;
+
+	/* Sends of the current uring_send() */
+	struct msg_ring *send_ring;
+	struct mmsghdr *send_msgs;
+	unsigned sends_pending;
+	unsigned sends_done;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Submit what is queued, and wait for at least 'min_complete' completions */
+static int uring_enter(struct uring *u, unsigned min_complete)
+{
+	unsigned to_submit = u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	__atomic_store_n(u->sq_ktail, u->sq_tail, __ATOMIC_RELEASE);
+	if (sys_io_uring_enter(u->fd, to_submit, min_complete, IORING_ENTER_GETEVENTS) < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			return 0;
+		syslog(LOG_ERR, "*** io_uring_enter(): %s.", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	while (u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		if (uring_enter(u, 0) < 0)
+			exit(1);
+	}
+	sqe = &u->sqes[u->sq_tail++ & u->sq_mask];
+	memset(sqe, 0x0, sizeof(*sqe));
+	return sqe;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+static inline char *uring_buf(struct uring_bufs *b, unsigned bid)
+{
+	return b->mem + bid * b->stride;
+}
+
+static void uring_bufs_recycle(struct uring_bufs *b, unsigned bid)
+{
+	struct io_uring_buf *buf = &b->br->bufs[b->tail & (b->nr - 1)];
+
+	buf->addr = (unsigned long)(uring_buf(b, bid) + b->offset);
+	buf->len = b->len;
+	buf->bid = bid;
+	b->tail++;
+	b->held--;
+	__atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+static void uring_bufs_put(struct uring_bufs *b, unsigned bid)
+{
+	if (--b->refs[bid] == 0)
+		uring_bufs_recycle(b, bid);
+}
+
+/* Put back the buffers taken by a handler, once it returns */
+static void uring_bufs_release(struct uring_bufs *b)
+{
+	unsigned i;
+
+	for (i = 0; i < b->nr_lent; i++)
+		uring_bufs_put(b, b->lent[i]);
+	b->nr_lent = 0;
+}
+
+/* Take the next buffer from the ready queue, returns its length */
+static unsigned uring_bufs_lend(struct uring_bufs *b, unsigned *bid)
+{
+	unsigned len;
+
+	*bid = b->ready_bid[b->ready_head];
+	len = b->ready_len[b->ready_head];
+	b->ready_head = (b->ready_head + 1) & (b->nr - 1);
+	b->nr_ready--;
+	b->lent[b->nr_lent++] = *bid;
+	return len;
+}
+
+/* Buffer that 'p' points into, or -1 */
+static int uring_bufs_find(struct uring_bufs *b, const void *p)
+{
+	const char *c = p;
+
+	if (!b->mem || c < b->mem || c >= b->mem + b->nr * b->stride)
+		return -1;
+	return (int)((c - b->mem) / b->stride);
+}
+
+/**
+ * Register 'nr' buffers of 'size' bytes as group 'bgid', the kernel
+ * filling 'len' bytes of each from 'offset' on.
+ */
+static int uring_bufs_init(struct uring *u, struct uring_bufs *b, __u16 bgid,
+		unsigned nr, size_t size, size_t offset, unsigned len)
+{
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	memset(b, 0x0, sizeof(*b));
+	b->nr = nr;
+	b->bgid = bgid;
+	b->offset = offset;
+	b->len = len;
+	b->stride = (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+	if (posix_memalign((void **)&b->br, getpagesize(), nr * sizeof(struct io_uring_buf)) ||
+		posix_memalign((void **)&b->mem, CACHE_LINE_SIZE, nr * b->stride))
+		return -ENOMEM;
+	b->refs = calloc(nr, sizeof(*b->refs));
+	b->ready_bid = calloc(nr, sizeof(*b->ready_bid));
+	b->ready_len = calloc(nr, sizeof(*b->ready_len));
+	b->lent = calloc(nr, sizeof(*b->lent));
+	if (!b->refs || !b->ready_bid || !b->ready_len || !b->lent)
+		return -ENOMEM;
+
+	memset(b->br, 0x0, nr * sizeof(struct io_uring_buf));
+	memset(&reg, 0x0, sizeof(reg));
+	reg.ring_addr = (unsigned long)b->br;
+	reg.ring_entries = nr;
+	reg.bgid = bgid;
+	if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+
+	b->held = nr;
+	for (i = 0; i < nr; i++)
+		uring_bufs_recycle(b, i);
+
+	return 0;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+static void uring_arm_recv(struct worker *w)
+{
+	struct uring *u = w->uring;
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = w->sockfd;
+	sqe->addr = (unsigned long)&u->recv_hdr;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = u->net.bgid;
+	sqe->user_data = URING_UD(UD_NET_RECV, u->sock_gen);
+	u->net.armed = true;
+}
+
+static void uring_arm_tun(struct worker *w)
+{
+	struct uring *u = w->uring;
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+	sqe->opcode = URING_OP_READ_MULTISHOT;
+	sqe->fd = w->tunfd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = u->tun.bgid;
+	sqe->user_data = URING_UD(UD_TUN_READ, 0);
+	u->tun.armed = true;
+}
+
+static void uring_arm_epoll(struct worker *w)
+{
+	struct uring *u = w->uring;
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = w->loop.epfd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = URING_UD(UD_EPOLL, 0);
+	u->epoll_armed = true;
+}
+
+/* Rearm the multishot requests that ended, if buffers are left for them */
+static void uring_rearm(struct worker *w)
+{
+	struct uring *u = w->uring;
+
+	if (w->uring_sock && w->sockfd >= 0 && !u->net.armed && u->net.held < u->net.nr)
+		uring_arm_recv(w);
+	if (w->uring_tun && !u->tun.armed && u->tun.held < u->tun.nr)
+		uring_arm_tun(w);
+	if (!u->epoll_armed)
+		uring_arm_epoll(w);
+}
+
+/* Leave a descriptor whose multishot request is not supported to the event loop */
+static void uring_fall_back(struct worker *w, struct event_source *src, bool *flag)
+{
+	*flag = false;
+	if (src->fd >= 0 && event_loop_add(&w->loop, src) < 0)
+		exit(1);
+	w->uring->epoll_ready = true;
+	if (w->id == 0)
+		syslog(LOG_WARNING, "No multishot %s on io_uring, polling it instead.",
+				src == &w->sock_source ? "receive" : "read");
+}
+
+/**
+ * Account a completion that carries a buffer. Returns true if the buffer
+ * was queued for a handler, false if it went back to the ring.
+ */
+static bool uring_bufs_complete(struct uring_bufs *b, const struct io_uring_cqe *cqe,
+		bool keep)
+{
+	unsigned bid, i;
+
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return false;
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	b->held++;
+	if (!keep || cqe->res <= 0) {
+		uring_bufs_recycle(b, bid);
+		return false;
+	}
+	i = (b->ready_head + b->nr_ready++) & (b->nr - 1);
+	b->ready_bid[i] = bid;
+	b->ready_len[i] = cqe->res;
+	b->refs[bid] = 1;
+	b->seen = true;
+	return true;
+}
+
+static void uring_complete(struct worker *w, const struct io_uring_cqe *cqe)
+{
+	struct uring *u = w->uring;
+	unsigned arg = URING_UD_ARG(cqe->user_data);
+	bool more = cqe->flags & IORING_CQE_F_MORE;
+	struct msghdr *mh;
+
+	switch (URING_UD_OP(cqe->user_data)) {
+	case UD_NET_RECV:
+		/* Late completions of a replaced socket are ignored. */
+		uring_bufs_complete(&u->net, cqe, arg == u->sock_gen);
+		if (arg != u->sock_gen || more)
+			break;
+		u->net.armed = false;
+		if ((cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) && !u->net.seen)
+			uring_fall_back(w, &w->sock_source, &w->uring_sock);
+		break;
+	case UD_TUN_READ:
+		uring_bufs_complete(&u->tun, cqe, true);
+		if (more)
+			break;
+		u->tun.armed = false;
+		if ((cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP || cqe->res == -EBADFD) &&
+			!u->tun.seen)
+			uring_fall_back(w, &w->tun_source, &w->uring_tun);
+		break;
+	case UD_EPOLL:
+		u->epoll_ready = true;
+		if (!more)
+			u->epoll_armed = false;
+		break;
+	case UD_SEND:
+		mh = &u->send_msgs[arg].msg_hdr;
+		u->sends_pending--;
+		if (cqe->res >= 0)
+			u->sends_done += mh->msg_iovlen;
+		else
+			msg_ring_gso_failed(u->send_ring, mh, -cqe->res);
+		break;
+	case UD_TUN_WRITE:
+		uring_bufs_put(&u->net, arg);
+		if (cqe->res < 0)
+			stats_drop(&w->stats, DROP_TUN_WRITE);
+		break;
+	}
+}
+
+static void uring_reap(struct worker *w)
+{
+	struct uring *u = w->uring;
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++)
+		uring_complete(w, &u->cqes[head & u->cq_mask]);
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+/**
+ * Hand datagrams received by the multishot request to the ring, in place.
+ * Each buffer starts with 'struct io_uring_recvmsg_out', the source
+ * address and the control messages, which leaves head room for
+ * decryption. Returns the number of datagrams, as msg_ring_recv() does.
+ */
+int uring_recv(struct worker *w, struct msg_ring *ring)
+{
+	struct uring *u = w->uring;
+	struct uring_bufs *b = &u->net;
+	unsigned n = 0, bid, len;
+
+	while (n < ring->size && b->nr_ready) {
+		struct io_uring_recvmsg_out *out;
+		char *buf;
+		size_t plen;
+
+		len = uring_bufs_lend(b, &bid);
+		buf = uring_buf(b, bid);
+		out = (void *)buf;
+		if (len < u->recv_hlen)
+			continue;
+		plen = len - u->recv_hlen;
+		if (out->payloadlen < plen)
+			plen = out->payloadlen;
+
+		memset(&ring->addrs[n], 0x0, sizeof(ring->addrs[n]));
+		memcpy(&ring->addrs[n], buf + sizeof(*out),
+				out->namelen < sizeof(ring->addrs[n]) ? out->namelen : sizeof(ring->addrs[n]));
+		ring->iovs[n].iov_base = buf + u->recv_hlen;
+		ring->msgs[n].msg_len = plen;
+		ring->msgs[n].msg_hdr.msg_control = buf + sizeof(*out) + URING_NAME_SIZE;
+		ring->msgs[n].msg_hdr.msg_controllen = out->controllen;
+		n++;
+	}
+
+	if (n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return (int)n;
+}
+
+/* Hand out a TUN frame read by the multishot request, see tun_read_netmsg() */
+ssize_t uring_tun_read(struct worker *w, struct minivtun_msg **nmsg)
+{
+	struct uring_bufs *b = &w->uring->tun;
+	unsigned bid;
+	ssize_t len;
+
+	if (!b->nr_ready) {
+		errno = EAGAIN;
+		return -1;
+	}
+	/* The message is queued from its own buffer, but takes a send slot. */
+	if (w->tx_ring.count == w->tx_ring.size)
+		netmsg_ring_flush(w);
+
+	len = uring_bufs_lend(b, &bid);
+	*nmsg = (void *)(uring_buf(b, bid) + MSG_RING_HEADROOM);
+	return len;
+}
+
+/**
+ * Queue a TUN write of a packet in a received datagram, holding on to
+ * its buffer until the write completes. Anything else is written now.
+ */
+int uring_tun_write(struct worker *w, struct tun_pi *pi, void *data, size_t len)
+{
+	struct uring *u = w->uring;
+	struct io_uring_sqe *sqe;
+	char *frame = (char *)data - sizeof(*pi);
+	int bid;
+
+	if ((bid = uring_bufs_find(&u->net, data)) < 0) {
+		struct iovec iov[2];
+
+		iov[0].iov_base = pi;
+		iov[0].iov_len = sizeof(*pi);
+		iov[1].iov_base = data;
+		iov[1].iov_len = len;
+		return writev(w->tunfd, iov, 2) < 0 ? -1 : 0;
+	}
+
+	memcpy(frame, pi, sizeof(*pi));
+	sqe = uring_get_sqe(u);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = w->tunfd;
+	sqe->addr = (unsigned long)frame;
+	sqe->len = sizeof(*pi) + len;
+	sqe->user_data = URING_UD(UD_TUN_WRITE, bid);
+	u->net.refs[bid]++;
+	return 0;
+}
+
+/**
+ * Submit the queued datagrams, together with the pending TUN writes, and
+ * wait for them: the messages may sit in send slots that are reused right
+ * after. Being MSG_DONTWAIT, the sends complete within the submission.
+ * Returns the number of datagrams sent, as msg_ring_send() does.
+ */
+int uring_send(struct worker *w, struct msg_ring *ring)
+{
+	struct uring *u = w->uring;
+	struct mmsghdr *msgs;
+	unsigned nr, i, min_complete = 0;
+
+	nr = msg_ring_messages(ring, 0, &msgs);
+	u->send_ring = ring;
+	u->send_msgs = msgs;
+	u->sends_done = 0;
+	for (i = 0; i < nr; i++) {
+		struct io_uring_sqe *sqe = uring_get_sqe(u);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = w->sockfd;
+		sqe->addr = (unsigned long)&msgs[i].msg_hdr;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_DONTWAIT;
+		sqe->user_data = URING_UD(UD_SEND, i);
+		u->sends_pending++;
+	}
+
+	while (u->sends_pending) {
+		if (uring_enter(u, min_complete) < 0)
+			exit(1);
+		uring_reap(w);
+		min_complete = 1;
+	}
+	ring->count = 0;
+
+	return (int)u->sends_done;
+}
+
+/* Called from worker_attach_paths() when the client socket is replaced */
+void uring_watch_socket(struct worker *w)
+{
+	struct uring *u = w->uring;
+
+	if (u->net.armed) {
+		struct io_uring_sqe *sqe = uring_get_sqe(u);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = URING_UD(UD_NET_RECV, u->sock_gen);
+		sqe->user_data = URING_UD(UD_CANCEL, 0);
+		u->net.armed = false;
+	}
+	/* Armed again on the new socket by the loop */
+	u->sock_gen++;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+static int uring_map(struct uring *u, const struct io_uring_params *p)
+{
+	size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(__u32);
+	size_t cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	char *sq, *cq;
+	void *sqes;
+	unsigned i;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size > sq_size)
+			sq_size = cq_size;
+	}
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			u->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				u->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -1;
+	}
+	sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return -1;
+
+	u->sq_head = (unsigned *)(sq + p->sq_off.head);
+	u->sq_ktail = (unsigned *)(sq + p->sq_off.tail);
+	u->sq_tail = *u->sq_ktail;
+	u->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+	u->sq_entries = *(unsigned *)(sq + p->sq_off.ring_entries);
+	u->sqes = sqes;
+	for (i = 0; i < u->sq_entries; i++)
+		((unsigned *)(sq + p->sq_off.array))[i] = i;
+
+	u->cq_head = (unsigned *)(cq + p->cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+/**
+ * Set up the ring of a worker, in the thread that runs it, and take its
+ * socket and TUN queue over from the event loop. Returns -1 if io_uring
+ * is not available, the worker then runs the classic loop.
+ */
+int uring_init(struct worker *w)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	size_t ctrl_size = config.udp_offload ? CMSG_SPACE(sizeof(int)) : 0;
+
+	if (!(u = calloc(1, sizeof(*u))))
+		return -1;
+
+	memset(&p, 0x0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_ENTRIES * 4;
+#ifdef IORING_SETUP_DEFER_TASKRUN
+	p.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+#endif
+	if ((u->fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0 && errno == EINVAL) {
+		/* Before Linux 6.1, completions are run without being asked for. */
+		p.flags = IORING_SETUP_CQSIZE;
+		u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	}
+	if (u->fd < 0)
+		goto fail;
+	if (!(p.features & IORING_FEAT_SUBMIT_STABLE) || !(p.features & IORING_FEAT_NODROP)) {
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+	if (uring_map(u, &p) < 0)
+		goto fail;
+
+	/* Received datagrams, behind the header, address and GRO size */
+	memset(&u->recv_hdr, 0x0, sizeof(u->recv_hdr));
+	u->recv_hdr.msg_namelen = URING_NAME_SIZE;
+	u->recv_hdr.msg_controllen = ctrl_size;
+	u->recv_hlen = sizeof(struct io_uring_recvmsg_out) + URING_NAME_SIZE + ctrl_size;
+	if (uring_bufs_init(u, &u->net, 0,
+			config.udp_offload ? URING_GRO_BUFS : URING_NET_BUFS,
+			u->recv_hlen + w->rx_ring.buf_size + MSG_RING_TAILROOM, 0,
+			u->recv_hlen + w->rx_ring.buf_size) < 0)
+		goto fail;
+
+	/* TUN frames, laid out as tunnel_read_one() expects them */
+	if (!w->offload &&
+		uring_bufs_init(u, &u->tun, 1, URING_TUN_BUFS,
+			MSG_RING_HEADROOM + sizeof(struct minivtun_msg) + MSG_RING_TAILROOM,
+			MSG_RING_HEADROOM + MINIVTUN_MSG_IPDATA_OFFSET - sizeof(struct tun_pi),
+			NM_PI_BUFFER_SIZE) < 0)
+		goto fail;
+
+	w->uring = u;
+	if (w->sockfd >= 0)
+		event_loop_del(&w->loop, &w->sock_source);
+	w->uring_sock = true;
+	/* With offloads, frames need the virtio-net header handled on read. */
+	if (!w->offload) {
+		event_loop_del(&w->loop, &w->tun_source);
+		w->uring_tun = true;
+	}
+	return 0;
+
+fail:
+	if (w->id == 0)
+		syslog(LOG_WARNING, "io_uring is not available (%s), using the classic datapath.",
+				strerror(errno));
+	if (u->fd >= 0)
+		close(u->fd);
+	free(u);
+	return -1;
+}
+
+int uring_run(struct worker *w)
+{
+	struct uring *u = w->uring;
+	bool loop_pending = true;
+	unsigned n;
+	int rc;
+
+	for (;;) {
+		bool busy = loop_pending || u->net.nr_ready || u->tun.nr_ready;
+
+		uring_rearm(w);
+		if (uring_enter(u, busy ? 0 : 1) < 0)
+			return -1;
+		uring_reap(w);
+		gettimeofday(&w->loop.now, NULL);
+
+		/* Timer ticks and the other sources */
+		if (u->epoll_ready || loop_pending) {
+			u->epoll_ready = false;
+			if ((rc = event_loop_poll(&w->loop)) < 0)
+				return -1;
+			loop_pending = rc > 0;
+		}
+
+		for (n = 0; u->net.nr_ready && n < EVENT_BUDGET_EACH_SOURCE; n++) {
+			w->sock_source.handler(&w->sock_source, &w->loop.now);
+			uring_bufs_release(&u->net);
+		}
+		for (n = 0; u->tun.nr_ready && n < EVENT_BUDGET_EACH_SOURCE; n++) {
+			w->tun_source.handler(&w->tun_source, &w->loop.now);
+			uring_bufs_release(&u->tun);
+		}
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,785 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "minivtun.h"
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+
+int xdp_init(const char *ifname)
+{
+	fprintf(stderr, "*** AF_XDP is not supported on this platform.\n");
+	return -1;
+}
+
+int xsk_recv(struct worker *w, struct msg_ring **ring)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+void xsk_recv_done(struct worker *w)
+{
+}
+
+int xsk_send(struct worker *w, struct msg_ring *ring)
+{
+	return 0;
+}
+
+#else
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "jhash.h"
+
+/**
+ * An XDP program on the underlay interface redirects the UDP datagrams
+ * for our port to an AF_XDP socket of the worker serving the receive
+ * queue, the rest of the traffic is passed to the kernel. Datagrams are
+ * handled right in the UMEM frames they arrive in. Replies are built as
+ * Ethernet frames and sent through the socket's TX ring, addressed with
+ * the MAC and IP addresses learnt from the frames of the same peer; the
+ * kernel socket still takes whatever cannot go that way.
+ */
+
+#define XSK_FRAME_SIZE  4096
+#define XSK_RX_FRAMES  1024
+#define XSK_TX_FRAMES  1024
+#define XSK_FRAMES  (XSK_RX_FRAMES + XSK_TX_FRAMES)
+
+/* Where the kernel puts a received frame, XDP_PACKET_HEADROOM */
+#define XSK_RX_HEADROOM  256
+
+#define XSK_ETH_HLEN  14
+#define XSK_NEIGH_SIZE  256
+
+/* A producer/consumer ring shared with the kernel */
+struct xsk_ring {
+	__u32 *producer;
+	__u32 *consumer;
+	__u32 *flags;
+	void *descs;
+	__u32 mask;
+};
+
+struct xsk {
+	int fd;
+	char *umem;
+	struct xsk_ring fill;
+	struct xsk_ring comp;
+	struct xsk_ring rx;
+	struct xsk_ring tx;
+
+	/* Frames received, lent to the handler until xsk_recv_done() */
+	__u64 lent[NM_BATCH_SIZE];
+	unsigned nr_lent;
+	struct msg_ring ring; /* iovecs point into the UMEM, no buffers */
+
+	__u64 tx_free[XSK_TX_FRAMES];
+	unsigned nr_tx_free;
+	__u16 ip_id;
+};
+
+/**
+ * How to reach a peer from the interface, as seen in its last frame.
+ * IPv4 addresses are kept IPv4-mapped. Entries are shared by all
+ * workers, each one guarded by a sequence count: odd while written,
+ * readers retry nothing and fall back to the kernel socket instead.
+ */
+struct xsk_neigh {
+	unsigned seq;
+	struct in6_addr peer;
+	struct in6_addr local;
+	__u8 peer_mac[6];
+	__u8 local_mac[6];
+};
+
+static struct xsk_neigh xsk_neighs[XSK_NEIGH_SIZE];
+static unsigned xdp_mtu;
+
+static inline struct xsk_neigh *xsk_neigh_slot(const struct in6_addr *peer)
+{
+	return &xsk_neighs[jhash2((const __u32 *)peer, 4, 0) % XSK_NEIGH_SIZE];
+}
+
+static bool xsk_neigh_lookup(const struct in6_addr *peer, struct xsk_neigh *n)
+{
+	struct xsk_neigh *e = xsk_neigh_slot(peer);
+	unsigned seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+
+	if (seq == 0 || (seq & 1))
+		return false;
+	memcpy(n, e, sizeof(*n));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+		return false;
+	return is_in6_equal(&n->peer, peer);
+}
+
+static void xsk_neigh_learn(const struct xsk_neigh *n)
+{
+	struct xsk_neigh *e = xsk_neigh_slot(&n->peer), old;
+	unsigned seq;
+
+	if (xsk_neigh_lookup(&n->peer, &old) &&
+		is_in6_equal(&old.local, &n->local) &&
+		memcmp(old.peer_mac, n->peer_mac, 6) == 0 &&
+		memcmp(old.local_mac, n->local_mac, 6) == 0)
+		return;
+
+	/* An entry being written by another worker is left to it. */
+	seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1,
+			false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->peer = n->peer;
+	e->local = n->local;
+	memcpy(e->peer_mac, n->peer_mac, 6);
+	memcpy(e->local_mac, n->local_mac, 6);
+	__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline void in6_set_v4mapped(struct in6_addr *a6, const void *a4)
+{
+	memset(a6, 0x0, 10);
+	a6->s6_addr[10] = 0xff;
+	a6->s6_addr[11] = 0xff;
+	memcpy(&a6->s6_addr[12], a4, 4);
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+static inline __u32 xsk_ring_avail(struct xsk_ring *r)
+{
+	return __atomic_load_n(r->producer, __ATOMIC_ACQUIRE) - *r->consumer;
+}
+
+static inline void xsk_ring_consume(struct xsk_ring *r, __u32 n)
+{
+	__atomic_store_n(r->consumer, *r->consumer + n, __ATOMIC_RELEASE);
+}
+
+static inline void xsk_ring_produce(struct xsk_ring *r, __u32 n)
+{
+	__atomic_store_n(r->producer, *r->producer + n, __ATOMIC_RELEASE);
+}
+
+static inline bool xsk_ring_needs_wakeup(struct xsk_ring *r)
+{
+	return __atomic_load_n(r->flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP;
+}
+
+static void xsk_fill(struct xsk *x, const __u64 *addrs, unsigned n)
+{
+	__u64 *descs = x->fill.descs;
+	__u32 prod = *x->fill.producer;
+	unsigned i;
+
+	/* The fill ring has room for all receive frames. */
+	for (i = 0; i < n; i++)
+		descs[(prod + i) & x->fill.mask] = addrs[i];
+	xsk_ring_produce(&x->fill, n);
+	if (xsk_ring_needs_wakeup(&x->fill))
+		recvfrom(x->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/**
+ * Find the UDP payload of a frame passed by the XDP program, and fill
+ * in its source and the neighbour entry of the peer. UDP checksums are
+ * not verified, they are left to the cipher and the inner packets.
+ */
+static char *xsk_parse(char *frame, size_t len, size_t *plen,
+		struct sockaddr_inx *src, struct xsk_neigh *n)
+{
+	__u8 *ip = (__u8 *)frame + XSK_ETH_HLEN, *udp;
+	size_t ulen;
+
+	memcpy(n->local_mac, frame, 6);
+	memcpy(n->peer_mac, frame + 6, 6);
+	memset(src, 0x0, sizeof(*src));
+
+	if (len >= XSK_ETH_HLEN + 20 + 8 && ip[0] == 0x45 && ip[9] == IPPROTO_UDP) {
+		size_t tot_len = ntohs(*(__be16 *)(ip + 2));
+		udp = ip + 20;
+		ulen = ntohs(*(__be16 *)(udp + 4));
+		if (tot_len < 28 || tot_len > len - XSK_ETH_HLEN || ulen < 8 || ulen > tot_len - 20)
+			return NULL;
+		in6_set_v4mapped(&n->peer, ip + 12);
+		in6_set_v4mapped(&n->local, ip + 16);
+		/* The kernel socket reports IPv4 peers IPv4-mapped too. */
+		if (state.local_addr.sa.sa_family == AF_INET6) {
+			src->in6.sin6_family = AF_INET6;
+			src->in6.sin6_addr = n->peer;
+			src->in6.sin6_port = *(__be16 *)udp;
+		} else {
+			src->in.sin_family = AF_INET;
+			memcpy(&src->in.sin_addr, ip + 12, 4);
+			src->in.sin_port = *(__be16 *)udp;
+		}
+	} else if (len >= XSK_ETH_HLEN + 40 + 8 && (ip[0] >> 4) == 6 &&
+			ip[6] == IPPROTO_UDP) {
+		size_t pl_len = ntohs(*(__be16 *)(ip + 4));
+		udp = ip + 40;
+		ulen = ntohs(*(__be16 *)(udp + 4));
+		if (pl_len > len - XSK_ETH_HLEN - 40 || ulen < 8 || ulen > pl_len)
+			return NULL;
+		memcpy(&n->peer, ip + 8, 16);
+		memcpy(&n->local, ip + 24, 16);
+		src->in6.sin6_family = AF_INET6;
+		src->in6.sin6_addr = n->peer;
+		src->in6.sin6_port = *(__be16 *)udp;
+	} else {
+		return NULL;
+	}
+
+	*plen = ulen - 8;
+	return (char *)udp + 8;
+}
+
+/**
+ * Take a batch of datagrams off the RX ring, into a ring whose iovecs
+ * point at them. The frames are lent until xsk_recv_done(). A short
+ * batch means the RX ring has been drained.
+ */
+int xsk_recv(struct worker *w, struct msg_ring **ring)
+{
+	struct xsk *x = w->xsk;
+	struct msg_ring *r = &x->ring;
+	struct xdp_desc *descs = x->rx.descs;
+	struct xsk_neigh n;
+	unsigned nr = 0;
+	__u32 avail;
+
+	while (nr < r->size && (avail = xsk_ring_avail(&x->rx))) {
+		__u32 cons = *x->rx.consumer, i;
+
+		if (avail > r->size - nr)
+			avail = r->size - nr;
+		for (i = 0; i < avail; i++) {
+			struct xdp_desc *d = &descs[(cons + i) & x->rx.mask];
+			__u64 frame = d->addr & ~(__u64)(XSK_FRAME_SIZE - 1);
+			size_t plen;
+			char *data;
+
+			data = xsk_parse(x->umem + d->addr, d->len, &plen, &r->addrs[nr], &n);
+			if (data == NULL) {
+				xsk_fill(x, &frame, 1);
+				continue;
+			}
+			xsk_neigh_learn(&n);
+			x->lent[nr] = frame;
+			r->iovs[nr].iov_base = data;
+			r->msgs[nr].msg_len = plen;
+			nr++;
+		}
+		xsk_ring_consume(&x->rx, avail);
+	}
+	x->nr_lent = nr;
+
+	if (nr == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	*ring = r;
+	return (int)nr;
+}
+
+/* Give the frames of the last batch back to the kernel */
+void xsk_recv_done(struct worker *w)
+{
+	struct xsk *x = w->xsk;
+
+	if (x->nr_lent)
+		xsk_fill(x, x->lent, x->nr_lent);
+	x->nr_lent = 0;
+}
+
+/* Collect the TX frames the kernel is done with */
+static void xsk_reclaim(struct xsk *x)
+{
+	__u64 *descs = x->comp.descs;
+	__u32 avail = xsk_ring_avail(&x->comp), cons = *x->comp.consumer, i;
+
+	for (i = 0; i < avail; i++)
+		x->tx_free[x->nr_tx_free++] = descs[(cons + i) & x->comp.mask];
+	xsk_ring_consume(&x->comp, avail);
+}
+
+/* Build an Ethernet frame carrying a datagram to 'n->peer', returns its length */
+static size_t xsk_build_frame(struct xsk *x, __u8 *frame,
+		const struct xsk_neigh *n, __be16 dport, const void *data, size_t dlen)
+{
+	__u8 *ip = frame + XSK_ETH_HLEN, *udp;
+	size_t ulen = 8 + dlen;
+	__u16 csum;
+
+	memcpy(frame, n->peer_mac, 6);
+	memcpy(frame + 6, n->local_mac, 6);
+
+	if (IN6_IS_ADDR_V4MAPPED(&n->peer)) {
+		*(__be16 *)(frame + 12) = htons(ETH_P_IP);
+		udp = ip + 20;
+		ip[0] = 0x45;
+		ip[1] = 0;
+		*(__be16 *)(ip + 2) = htons(20 + ulen);
+		*(__be16 *)(ip + 4) = htons(x->ip_id++);
+		*(__be16 *)(ip + 6) = 0;
+		ip[8] = 64;
+		ip[9] = IPPROTO_UDP;
+		memset(ip + 10, 0x0, 2);
+		memcpy(ip + 12, &n->local.s6_addr[12], 4);
+		memcpy(ip + 16, &n->peer.s6_addr[12], 4);
+		csum = ~csum_fold(csum_add(0, ip, 20));
+		memcpy(ip + 10, &csum, 2);
+	} else {
+		*(__be16 *)(frame + 12) = htons(ETH_P_IPV6);
+		udp = ip + 40;
+		*(__be32 *)ip = htonl(0x60000000);
+		*(__be16 *)(ip + 4) = htons(ulen);
+		ip[6] = IPPROTO_UDP;
+		ip[7] = 64;
+		memcpy(ip + 8, &n->local, 16);
+		memcpy(ip + 24, &n->peer, 16);
+	}
+
+	*(__be16 *)udp = port_of_sockaddr(&state.local_addr);
+	*(__be16 *)(udp + 2) = dport;
+	*(__be16 *)(udp + 4) = htons(ulen);
+	memset(udp + 6, 0x0, 2);
+	memcpy(udp + 8, data, dlen);
+
+	/* Optional over IPv4, but not over IPv6 */
+	if (!IN6_IS_ADDR_V4MAPPED(&n->peer)) {
+		__be32 tail[2] = { htonl(ulen), htonl(IPPROTO_UDP) };
+		__u64 sum = csum_add(0, ip + 8, 32);
+		sum = csum_add(sum, tail, sizeof(tail));
+		csum = ~csum_fold(csum_add(sum, udp, ulen));
+		if (csum == 0)
+			csum = 0xffff;
+		memcpy(udp + 6, &csum, 2);
+	}
+
+	return udp + ulen - frame;
+}
+
+/**
+ * Send the queued datagrams whose peers have been seen on the interface
+ * through the TX ring. The others are left on the ring, moved to its
+ * front, for the kernel socket. Returns the number sent.
+ */
+int xsk_send(struct worker *w, struct msg_ring *ring)
+{
+	struct xsk *x = w->xsk;
+	struct xdp_desc *descs = x->tx.descs;
+	__u32 prod = *x->tx.producer;
+	unsigned sent = 0, kept = 0, i;
+
+	xsk_reclaim(x);
+
+	for (i = 0; i < ring->count; i++) {
+		struct mmsghdr *mh = &ring->msgs[i];
+		struct iovec *iov = mh->msg_hdr.msg_iov;
+		struct sockaddr_inx *dst = &ring->addrs[i];
+		size_t hlen = XSK_ETH_HLEN + 8;
+		struct in6_addr peer;
+		struct xsk_neigh n;
+		__u64 addr;
+
+		if (dst->sa.sa_family == AF_INET6) {
+			peer = dst->in6.sin6_addr;
+		} else {
+			in6_set_v4mapped(&peer, &dst->in.sin_addr);
+		}
+		hlen += IN6_IS_ADDR_V4MAPPED(&peer) ? 20 : 40;
+
+		if (mh->msg_hdr.msg_namelen == 0 || x->nr_tx_free == 0 ||
+			hlen - XSK_ETH_HLEN + iov->iov_len > xdp_mtu ||
+			!xsk_neigh_lookup(&peer, &n)) {
+			if (kept != i) {
+				ring->iovs[kept] = ring->iovs[i];
+				ring->addrs[kept] = ring->addrs[i];
+				ring->msgs[kept].msg_hdr.msg_namelen = mh->msg_hdr.msg_namelen;
+			}
+			kept++;
+			continue;
+		}
+
+		addr = x->tx_free[--x->nr_tx_free];
+		descs[(prod + sent) & x->tx.mask].addr = addr;
+		descs[(prod + sent) & x->tx.mask].len = xsk_build_frame(x,
+				(__u8 *)x->umem + addr, &n, port_of_sockaddr(dst),
+				iov->iov_base, iov->iov_len);
+		descs[(prod + sent) & x->tx.mask].options = 0;
+		sent++;
+	}
+	ring->count = kept;
+
+	if (sent) {
+		xsk_ring_produce(&x->tx, sent);
+		if (xsk_ring_needs_wakeup(&x->tx))
+			sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+	}
+	return (int)sent;
+}
+
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Forward jumps of the program are patched when their label is placed. */
+enum {
+	XDP_L_IPV6 = 1,
+	XDP_L_REDIRECT,
+	XDP_L_PASS,
+};
+
+struct xdp_prog {
+	struct bpf_insn insns[64];
+	__u8 labels[64];
+	unsigned len;
+};
+
+static void xdp_emit(struct xdp_prog *p, __u8 code, __u8 dst, __u8 src,
+		__s16 off, __s32 imm)
+{
+	struct bpf_insn *insn = &p->insns[p->len];
+
+	memset(insn, 0x0, sizeof(*insn));
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+	insn->off = off;
+	insn->imm = imm;
+	p->labels[p->len++] = 0;
+}
+
+static void xdp_jump(struct xdp_prog *p, __u8 code, __u8 dst, __u8 src,
+		__s32 imm, int label)
+{
+	xdp_emit(p, code, dst, src, 0, imm);
+	p->labels[p->len - 1] = label;
+}
+
+static void xdp_label(struct xdp_prog *p, int label)
+{
+	unsigned i;
+
+	for (i = 0; i < p->len; i++) {
+		if (p->labels[i] == label) {
+			p->insns[i].off = p->len - i - 1;
+			p->labels[i] = 0;
+		}
+	}
+}
+
+/* Compare a 32-bit word of the packet (r2) with what is in memory at 'a' */
+static void xdp_match_word(struct xdp_prog *p, int off, const void *a)
+{
+	__s32 word;
+
+	memcpy(&word, a, 4);
+	xdp_emit(p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_5, BPF_REG_2, off, 0);
+	xdp_jump(p, BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, word, XDP_L_PASS);
+}
+
+/**
+ * Load the program redirecting UDP datagrams to the local address and
+ * port into the XSKMAP slot of the receive queue, if a socket is there.
+ * IPv4 with options or fragmented, and anything else, is passed.
+ */
+static int xdp_load_prog(int map_fd, const struct sockaddr_inx *local)
+{
+	static char log[65536];
+	struct xdp_prog p = { .len = 0 };
+	bool v4 = true, v6 = false, bound = (local->in.sin_addr.s_addr != INADDR_ANY);
+	__be16 port = port_of_sockaddr(local);
+	union bpf_attr attr;
+	unsigned i;
+	int fd;
+
+	if (local->sa.sa_family == AF_INET6) {
+		bound = !IN6_IS_ADDR_UNSPECIFIED(&local->in6.sin6_addr);
+		v4 = !bound;
+		v6 = true;
+	}
+
+	/* r2 = ctx->data, r3 = ctx->data_end */
+	xdp_emit(&p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1,
+			offsetof(struct xdp_md, data), 0);
+	xdp_emit(&p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_1,
+			offsetof(struct xdp_md, data_end), 0);
+	xdp_emit(&p, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+	xdp_emit(&p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, XSK_ETH_HLEN + 20 + 8);
+	xdp_jump(&p, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, XDP_L_PASS);
+	xdp_emit(&p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 12, 0);
+	if (v6)
+		xdp_jump(&p, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, htons(ETH_P_IPV6), XDP_L_IPV6);
+	if (v4) {
+		xdp_jump(&p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, htons(ETH_P_IP), XDP_L_PASS);
+		xdp_emit(&p, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, XSK_ETH_HLEN, 0);
+		xdp_jump(&p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0x45, XDP_L_PASS);
+		xdp_emit(&p, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, XSK_ETH_HLEN + 9, 0);
+		xdp_jump(&p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_UDP, XDP_L_PASS);
+		xdp_emit(&p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, XSK_ETH_HLEN + 6, 0);
+		xdp_emit(&p, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3fff));
+		xdp_jump(&p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, XDP_L_PASS);
+		if (bound)
+			xdp_match_word(&p, XSK_ETH_HLEN + 16, &local->in.sin_addr);
+		xdp_emit(&p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, XSK_ETH_HLEN + 20 + 2, 0);
+		xdp_jump(&p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, port, XDP_L_PASS);
+		xdp_jump(&p, BPF_JMP | BPF_JA, 0, 0, 0, XDP_L_REDIRECT);
+	} else {
+		xdp_jump(&p, BPF_JMP | BPF_JA, 0, 0, 0, XDP_L_PASS);
+	}
+	xdp_label(&p, XDP_L_IPV6);
+	if (v6) {
+		xdp_emit(&p, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 40 - 20);
+		xdp_jump(&p, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, XDP_L_PASS);
+		xdp_emit(&p, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, XSK_ETH_HLEN + 6, 0);
+		xdp_jump(&p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_UDP, XDP_L_PASS);
+		if (bound) {
+			for (i = 0; i < 4; i++)
+				xdp_match_word(&p, XSK_ETH_HLEN + 24 + i * 4,
+						&local->in6.sin6_addr.s6_addr[i * 4]);
+		}
+		xdp_emit(&p, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, XSK_ETH_HLEN + 40 + 2, 0);
+		xdp_jump(&p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, port, XDP_L_PASS);
+	}
+
+	/* return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS); */
+	xdp_label(&p, XDP_L_REDIRECT);
+	xdp_emit(&p, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1,
+			offsetof(struct xdp_md, rx_queue_index), 0);
+	xdp_emit(&p, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+	xdp_emit(&p, 0, 0, 0, 0, 0);
+	xdp_emit(&p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+	xdp_emit(&p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+	xdp_emit(&p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	xdp_label(&p, XDP_L_PASS);
+	xdp_emit(&p, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+	xdp_emit(&p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	memset(&attr, 0x0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (unsigned long)p.insns;
+	attr.insn_cnt = p.len;
+	attr.license = (unsigned long)"GPL";
+	strcpy(attr.prog_name, "minivtun");
+	if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) >= 0)
+		return fd;
+
+	/* Load it again to tell why */
+	attr.log_buf = (unsigned long)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	log[0] = '\0';
+	if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) < 0)
+		fprintf(stderr, "*** Cannot load the XDP program: %s.\n%s", strerror(errno), log);
+	return fd;
+}
+
+static int xsk_ring_map(int fd, const struct xdp_ring_offset *off, unsigned nr,
+		size_t desc_size, off_t pgoff, struct xsk_ring *r)
+{
+	char *map = mmap(NULL, off->desc + nr * desc_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, pgoff);
+
+	if (map == MAP_FAILED)
+		return -1;
+	r->producer = (void *)(map + off->producer);
+	r->consumer = (void *)(map + off->consumer);
+	r->flags = (void *)(map + off->flags);
+	r->descs = map + off->desc;
+	r->mask = nr - 1;
+	return 0;
+}
+
+/* Create the AF_XDP socket of a worker on receive queue 'queue' */
+static struct xsk *xsk_create(int ifindex, unsigned queue)
+{
+	struct xdp_umem_reg mr;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t optlen = sizeof(off);
+	int rx_frames = XSK_RX_FRAMES, tx_frames = XSK_TX_FRAMES;
+	struct xsk *x;
+	unsigned i;
+
+	if ((x = calloc(1, sizeof(*x))) == NULL)
+		return NULL;
+	if ((x->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+		goto err;
+	x->umem = mmap(NULL, XSK_FRAMES * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (x->umem == MAP_FAILED)
+		goto err_close;
+
+	memset(&mr, 0x0, sizeof(mr));
+	mr.addr = (unsigned long)x->umem;
+	mr.len = XSK_FRAMES * XSK_FRAME_SIZE;
+	mr.chunk_size = XSK_FRAME_SIZE;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0 ||
+		setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &rx_frames, sizeof(int)) < 0 ||
+		setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &tx_frames, sizeof(int)) < 0 ||
+		setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &rx_frames, sizeof(int)) < 0 ||
+		setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &tx_frames, sizeof(int)) < 0 ||
+		getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+		goto err_unmap;
+
+	if (xsk_ring_map(x->fd, &off.fr, XSK_RX_FRAMES, sizeof(__u64),
+			XDP_UMEM_PGOFF_FILL_RING, &x->fill) < 0 ||
+		xsk_ring_map(x->fd, &off.cr, XSK_TX_FRAMES, sizeof(__u64),
+			XDP_UMEM_PGOFF_COMPLETION_RING, &x->comp) < 0 ||
+		xsk_ring_map(x->fd, &off.rx, XSK_RX_FRAMES, sizeof(struct xdp_desc),
+			XDP_PGOFF_RX_RING, &x->rx) < 0 ||
+		xsk_ring_map(x->fd, &off.tx, XSK_TX_FRAMES, sizeof(struct xdp_desc),
+			XDP_PGOFF_TX_RING, &x->tx) < 0)
+		goto err_unmap;
+
+	/* The first frames are for receiving, the others for sending. */
+	for (i = 0; i < XSK_RX_FRAMES; i++)
+		((__u64 *)x->fill.descs)[i] = (__u64)i * XSK_FRAME_SIZE;
+	xsk_ring_produce(&x->fill, XSK_RX_FRAMES);
+	for (i = 0; i < XSK_TX_FRAMES; i++)
+		x->tx_free[i] = (__u64)(XSK_RX_FRAMES + i) * XSK_FRAME_SIZE;
+	x->nr_tx_free = XSK_TX_FRAMES;
+
+	memset(&sxdp, 0x0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+	if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+		goto err_unmap;
+
+	if (msg_ring_init(&x->ring, NM_BATCH_SIZE, 0) < 0)
+		goto err_unmap;
+
+	return x;
+
+err_unmap:
+	/* The rings go away with the socket. */
+	munmap(x->umem, XSK_FRAMES * XSK_FRAME_SIZE);
+err_close:
+	close(x->fd);
+err:
+	free(x);
+	return NULL;
+}
+
+/**
+ * Set up AF_XDP on the underlay interface for all workers: a socket on
+ * the receive queue of the same index, and the XDP program feeding
+ * them. Workers whose queue does not exist stay on the kernel socket.
+ * Each socket is to be polled as the worker's 'xsk_source'. The program
+ * is detached when the process exits.
+ */
+int xdp_init(const char *ifname)
+{
+	struct ifreq ifr;
+	union bpf_attr attr;
+	int sockfd, ifindex, map_fd, prog_fd, link_fd;
+	unsigned i, nr_xsks = 0;
+
+	if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		fprintf(stderr, "*** socket() failed: %s.\n", strerror(errno));
+		return -1;
+	}
+	memset(&ifr, 0x0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	if (ioctl(sockfd, SIOCGIFMTU, &ifr) < 0) {
+		fprintf(stderr, "*** Cannot find interface '%s': %s.\n", ifname, strerror(errno));
+		close(sockfd);
+		return -1;
+	}
+	xdp_mtu = ifr.ifr_mtu;
+	ioctl(sockfd, SIOCGIFINDEX, &ifr);
+	ifindex = ifr.ifr_ifindex;
+	close(sockfd);
+	if (XSK_RX_HEADROOM + XSK_ETH_HLEN + xdp_mtu + MSG_RING_TAILROOM > XSK_FRAME_SIZE) {
+		fprintf(stderr, "*** MTU of '%s' is too large for AF_XDP frames.\n", ifname);
+		return -1;
+	}
+
+	memset(&attr, 0x0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(__u32);
+	attr.value_size = sizeof(__u32);
+	attr.max_entries = config.nr_queues;
+	strcpy(attr.map_name, "minivtun_xsks");
+	if ((map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+		fprintf(stderr, "*** Cannot create the XSKMAP: %s.\n", strerror(errno));
+		return -1;
+	}
+	if ((prog_fd = xdp_load_prog(map_fd, &state.local_addr)) < 0)
+		return -1;
+
+	for (i = 0; i < config.nr_queues; i++) {
+		struct worker *w = &state.workers[i];
+		__u32 key = i, value;
+
+		if ((w->xsk = xsk_create(ifindex, i)) == NULL) {
+			syslog(LOG_WARNING, "Cannot bind an AF_XDP socket to queue %u of '%s': %s, "
+					"worker %u stays on the kernel socket.", i, ifname, strerror(errno), i);
+			continue;
+		}
+		w->xsk_source.fd = value = w->xsk->fd;
+		memset(&attr, 0x0, sizeof(attr));
+		attr.map_fd = map_fd;
+		attr.key = (unsigned long)&key;
+		attr.value = (unsigned long)&value;
+		if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+			fprintf(stderr, "*** Cannot add the AF_XDP socket to the XSKMAP: %s.\n",
+					strerror(errno));
+			return -1;
+		}
+		nr_xsks++;
+	}
+	if (nr_xsks == 0) {
+		fprintf(stderr, "*** No AF_XDP socket could be bound on '%s'.\n", ifname);
+		return -1;
+	}
+
+	/* Native mode if the driver has it, generic mode otherwise */
+	memset(&attr, 0x0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+	if ((link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+		attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+		link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	}
+	if (link_fd < 0) {
+		fprintf(stderr, "*** Cannot attach the XDP program to '%s': %s.\n",
+				ifname, strerror(errno));
+		return -1;
+	}
+
+	syslog(LOG_INFO, "AF_XDP on '%s' (%s mode) for %u of %u workers.", ifname,
+			attr.link_create.flags == XDP_FLAGS_DRV_MODE ? "native" : "generic",
+			nr_xsks, config.nr_queues);
+	return 0;
+}
+
+#endif